@@ -0,0 +1,208 @@
+#ifndef apifields_h
+#define apifields_h
+
+#include "json.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <tuple>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+
+/* Support for the typed device API generated from endpoints.json.
+  Each generated struct lists its members in a constexpr apiFields()
+  table, which drives reading it from and writing it to Json. */
+
+namespace dpt {
+
+using std::string;
+using std::vector;
+using std::optional;
+using std::shared_ptr;
+
+class Dpt;
+class DptResponse;
+
+/* A member of S and its name on the wire */
+template<class S, class T>
+struct ApiField {
+  char const* name;
+  T S::* member;
+};
+
+template<class S, class T>
+constexpr ApiField<S,T> apiField(char const* name, T S::* member)
+{
+  return ApiField<S,T>{name, member};
+}
+
+template<class T, class = void>
+struct IsApiStruct : std::false_type {};
+
+template<class T>
+struct IsApiStruct<T,std::void_t<decltype(T::apiFields())>> : std::true_type {};
+
+/* Members the device leaves out keep their default */
+void readApi(Json const& js, string* out);
+void readApi(Json const& js, int64_t* out);
+void readApi(Json const& js, double* out);
+void readApi(Json const& js, bool* out);
+template<class T>
+void readApi(Json const& js, optional<T>* out);
+template<class T>
+void readApi(Json const& js, vector<T>* out);
+template<class S>
+std::enable_if_t<IsApiStruct<S>::value> readApi(Json const& js, S* out);
+
+template<class S>
+std::enable_if_t<IsApiStruct<S>::value,Json> writeApi(S const& value);
+
+template<class T>
+void readApi(Json const& js, optional<T>* out)
+{
+  if (js.kind() == JsonKind::Null) {
+    out->reset();
+    return;
+  }
+  T value;
+  readApi(js, &value);
+  *out = std::move(value);
+}
+
+template<class T>
+void readApi(Json const& js, vector<T>* out)
+{
+  out->clear();
+  out->reserve(js.size());
+  for (auto const& kv : js) {
+    out->emplace_back();
+    readApi(kv.second, &out->back());
+  }
+}
+
+template<class S>
+std::enable_if_t<IsApiStruct<S>::value> readApi(Json const& js, S* out)
+{
+  std::apply([&js, out](auto const&... field) {
+    (
+      [&js, out](auto const& f) {
+        if (Json const* child = js.findChild(f.name)) {
+          readApi(*child, &(out->*f.member));
+        }
+      }(field),
+      ...
+    );
+  }, S::apiFields());
+}
+
+template<class T>
+void writeApi(Json& js, char const* name, T const& value)
+{
+  if constexpr (IsApiStruct<T>::value) {
+    js.add_child(name, writeApi(value));
+  } else {
+    js.put(name, value);
+  }
+}
+
+template<class T>
+void writeApi(Json& js, char const* name, optional<T> const& value)
+{
+  if (value) {
+    writeApi(js, name, *value);
+  }
+}
+
+template<class T>
+void writeApi(Json& js, char const* name, vector<T> const& values)
+{
+  Json array = Json::array();
+  for (auto const& value : values) {
+    if constexpr (IsApiStruct<T>::value) {
+      array.push_back(writeApi(value));
+    } else {
+      array.push_back(value);
+    }
+  }
+  js.add_child(name, array);
+}
+
+template<class S>
+std::enable_if_t<IsApiStruct<S>::value,Json> writeApi(S const& value)
+{
+  Json js;
+  std::apply([&js, &value](auto const&... field) {
+    (writeApi(js, field.name, value.*field.member), ...);
+  }, S::apiFields());
+  return js;
+}
+
+/* Percent-encode everything but unreserved characters, so a path
+  with slashes fits in one path segment */
+string urlEncode(std::string_view s);
+
+/* ?name=value&... of the set members of a query struct */
+template<class Q>
+string apiQuery(Q const& query)
+{
+  string rtv;
+  auto add = [&rtv](char const* name, string const& value) {
+    rtv += rtv.empty() ? '?' : '&';
+    rtv += name;
+    rtv += '=';
+    rtv += urlEncode(value);
+  };
+  std::apply([&add, &query](auto const&... field) {
+    (
+      [&add, &query](auto const& f) {
+        auto const& value = query.*f.member;
+        if constexpr (std::is_same_v<std::decay_t<decltype(value)>,string>) {
+          add(f.name, value);
+        } else if (value) {
+          add(f.name, *value);
+        }
+      }(field),
+      ...
+    );
+  }, Q::apiFields());
+  return rtv;
+}
+
+/* What the generated DptApi sends its requests through: the
+  session and host of a Dpt */
+class ApiTransport {
+public:
+  ApiTransport(Dpt const& dpt);
+
+protected:
+  /* Throws on a non 2xx response, like Dpt::sendRequest */
+  shared_ptr<DptResponse> send(
+    char const* method,
+    string const& url,
+    Json const* body = nullptr
+  ) const;
+
+  /* Upload file as multipart form data */
+  shared_ptr<DptResponse> sendFile(
+    char const* method,
+    string const& url,
+    vector<uint8_t> const& file
+  ) const;
+
+  /* Parse a response in place into a generated struct */
+  template<class T>
+  static T read(shared_ptr<DptResponse> const& response)
+  {
+    T rtv;
+    readApi(parse(response), &rtv);
+    return rtv;
+  }
+  static Json parse(shared_ptr<DptResponse> const& response);
+
+  Dpt const& m_dpt;
+};
+
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef cancellation_h
+#define cancellation_h
+
+#include <atomic>
+#include <chrono>
+#include "exception.h"
+
+namespace dpt {
+
+/* How often a request in flight looks at its token */
+constexpr std::chrono::milliseconds CancelPollInterval(10);
+
+/* Stops one operation, eg, a sync. Cancelling is a single atomic
+  store, so it is safe from other threads and signal handlers; the
+  operation throws SyncInterrupted at its next check, or within
+  CancelPollInterval while waiting on a request. */
+class CancellationToken {
+public:
+  void cancel() noexcept { m_cancelled = true; }
+  bool cancelled() const noexcept { return m_cancelled; }
+
+  void throwIfCancelled() const
+  {
+    if (m_cancelled) {
+      throw SyncInterrupted();
+    }
+  }
+
+private:
+  std::atomic<bool> m_cancelled{false};
+};
+
+};
+
+#endif
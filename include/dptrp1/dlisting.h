@@ -0,0 +1,88 @@
+#ifndef dlisting_h
+#define dlisting_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <ctime>
+#include <boost/filesystem.hpp>
+
+/* Sorted listings of local and dpt entries for the streaming diff */
+
+namespace dpt {
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using boost::filesystem::path;
+
+/* One file or folder of a listing. rel_path is the generic
+  relative path, without leading slash. */
+struct DEntry {
+  string rel_path;
+  string rev;
+  string id;
+  size_t filesize = 0;
+  time_t last_modified_time = 0;
+  bool is_dir = false;
+  bool is_note = false;
+};
+
+/* Path order where a folder comes right before its contents, ie,
+  comparing component by component */
+bool pathLess(string const& a, string const& b);
+
+/* A finished listing. It is never modified once taken, so any thread
+  can read it while later syncs run. */
+struct ListingSnapshot {
+  time_t taken = 0;
+  /* in pathLess order */
+  vector<DEntry> entries;
+
+  /* Null when there is no such entry */
+  DEntry const* find(string const& rel_path) const;
+};
+
+/* Takes entries in any order and plays them back in pathLess order.
+  Once the buffered entries exceed the memory budget they are sorted
+  and spilled to a run file under spill_dir; the runs are merged on
+  the way out. */
+class DEntrySorter {
+public:
+  DEntrySorter(size_t memory_budget, path const& spill_dir);
+  ~DEntrySorter();
+  DEntrySorter(DEntrySorter const& other) = delete;
+  DEntrySorter& operator=(DEntrySorter const& other) = delete;
+  void push(DEntry entry);
+
+  /* The next entry in order, false when there is none. No more
+    entries can be pushed after the first call. */
+  bool next(DEntry* entry);
+
+  /* Number of run files written so far */
+  size_t spills() const noexcept { return m_runs.size(); }
+
+private:
+  struct Run {
+    path file;
+    unique_ptr<std::ifstream> in;
+    DEntry head;
+    bool has_head = false;
+  };
+  void spill();
+  void startMerge();
+  bool readHead(Run& run);
+
+  size_t m_memory_budget;
+  size_t m_buffered_bytes = 0;
+  path m_spill_dir;
+  vector<DEntry> m_buffer;
+  size_t m_buffer_pos = 0;
+  vector<Run> m_runs;
+  bool m_merging = false;
+};
+
+};
+
+#endif
@@ -7,18 +7,30 @@
 #include <map>
 #include <unordered_map>
 #include <memory>
-#include <boost/property_tree/json_parser.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/asio.hpp>
 #include <NFHTTP/NFHTTP.h>
 #include <iostream>
+#include "json.h"
+#include <dptrp1/dptapi.h> /* generated by tools/apigen */
 #include "dtree.h"
 #include "revdb.h"
+#include "dlisting.h"
+#include "lrucache.h"
+#include "hostresolver.h"
+#include "cancellation.h"
 #include "git.h"
+#include "linksnapshot.h"
 #include <atomic>
+#include <mutex>
+#include <thread>
+
+struct evp_pkey_st;
 
 namespace dpt {
 
+class HttpSigner;
+
 using std::vector;
 using std::string;
 using std::map;
@@ -26,20 +38,22 @@ using std::shared_ptr;
 using std::pair;
 using std::make_shared;
 
-using boost::property_tree::ptree;
 using boost::filesystem::path;
 
-inline atomic<int> interrupt_flag = 0;
-
 enum DryRunFlag {
   NormalRun = 0,
   DryRun = 1,
 };
 
-class Json : public ptree {
-  public:
-    static Json fromString(string const& body);
-    string toString() const;
+/* Entries per /documents2 request, the API recommends 100-1000 */
+constexpr size_t DptListingPageSize = 500;
+
+/* Paths remembered by Dpt::resolveDptPath */
+constexpr size_t DptResolveCacheSize = 128;
+
+enum SnapshotBackend {
+  GitSnapshots = 0,
+  LinkSnapshots = 1,
 };
 
 class DptResponse : public nativeformat::http::Response {
@@ -69,6 +83,15 @@ struct Battery {
   Status status;
 };
 
+/* One device. Instances share nothing: each has its own HTTP
+  client, session, cancellation token, logger and messager, so one
+  process can sync many devices on as many threads.
+
+  Within an instance, configure it (set*) before use. Syncs, uploads
+  and other operations that touch the trees take turns. stop(),
+  cancellation(), the listings and the queries that only talk to the
+  device, eg, battery(), are safe from any thread at any time.
+  Instances logging to one stream may interleave their lines. */
 class Dpt {
 public:
   ~Dpt();
@@ -98,6 +121,11 @@ public:
   path syncDir() const;
   void setSyncDir(path const&);
 
+  /* Choose how checkpoints are stored, before setupSyncDir().
+    Git is the default, LinkSnapshots suits huge libraries on
+    filesystems with reflinks. */
+  void setSnapshotBackend(SnapshotBackend backend) noexcept;
+
   /* Prepare the root sync directory, eg, setting up git
     repository. */
   void setupSyncDir();
@@ -106,14 +134,38 @@ public:
     digitalpaper.localhost */
   inline string hostname() const noexcept;
 
+  /* Talk to another device, eg, one from discoverDevices() */
+  void setHostname(string const& hostname);
+
   /* Returns the ip address of hostname() through mDNS.
     Optionally, you can pass a pointer to retrive
-    the ip being resolved to. */
+    the ip being resolved to. The address is cached, and refreshed
+    in the background while setPinAddress is on. By default requests
+    still connect by hostname, so this gives them no speed-up. */
   bool resolveHost(boost::asio::ip::address* addr = nullptr) const;
 
-  /* Authenticate to DPT-RP1 */
+  /* Connect to the resolved address instead of hostname(), skipping
+    mDNS on every request. Off by default: the TLS server name then
+    becomes the address, and NSURLSession drops the Host header.
+    A request that cannot connect to the address is retried by
+    hostname. Only when on do requests skip per-request mDNS look-ups;
+    turning it off stops the background refresh. */
+  void setPinAddress(bool pin);
+
+  /* The devices on the LAN, looked up by hostname() and the names
+    mDNS gives to devices sharing it */
+  vector<DeviceAddress> discoverDevices(size_t max_devices = 4) const;
+
+  /* Authenticate to DPT-RP1. The credential is cached next to the
+    private key and reused by later processes while the device
+    accepts it. Requests made with an expired credential
+    authenticate again and are retried. */
   void authenticate();
 
+  /* The typed client generated from endpoints.json, sending
+    through this session */
+  DptApi api() const;
+
   /* A helper to send and receive Json from DPT-RP1 */
   Json sendJson(
     string const& method,
@@ -129,10 +181,21 @@ public:
     shared_ptr<DptRequest> request
   ) const;
 
+  /* Send an HTTP request, whatever the response status */
+  shared_ptr<DptResponse> performRequest(
+    shared_ptr<DptRequest> request
+  ) const;
+
   /* Read an HTTP response */
   string readResponse(shared_ptr<DptResponse> response) const;
 
-  /* Instruct DPT to open a document */
+  /* Look up one dpt path, eg, Document/Received, without listing
+    the whole library. Null when there is no such entry. Answers
+    from a cache, forgetResolvedPath first to ask the device. */
+  shared_ptr<DNode> resolveDptPath(path const& dpt);
+
+  /* Instruct DPT to open a document, looking the path up again
+    when the node known for it is no longer on the device */
   void dptOpenDocument(path const& dpt);
 
   /* Shorthand to upload a local file and open in DPT */
@@ -144,6 +207,12 @@ public:
   /* Sync DPT time against local time */
   void syncTime() const;
 
+  /* Diff within a memory budget: the local scan and the dpt
+    listing are sorted on disk once they outgrow it, and only
+    folders and files that differ are kept as nodes. 0, the default,
+    builds both full trees instead. */
+  void setDiffMemoryBudget(size_t bytes) noexcept;
+
   /* Sync all files with automatic rollback on error  */
   void safeSyncAllFiles(DryRunFlag dryrun = NormalRun);
 
@@ -155,18 +224,75 @@ public:
     size_t limit = 100
   ) const;
 
+  /* Returns the commits older than the given one, for paging
+    through the history past what updateGitCommits cached */
+  vector<shared_ptr<GitCommit>> listGitCommits(
+    string const& after,
+    size_t limit = 100
+  ) const;
+
   /* Extract a git commit to local dest */
   void extractGitCommit(string const& commit, path const& dest);
 
-  /* Stop syncing */
+  /* Returns every version of a file in the sync dir, newest first */
+  vector<GitFileVersion> listFileVersions(rpath const& relpath) const;
+
+  /* Write one version of a file to local dest */
+  void restoreFileVersion(
+    GitFileVersion const& version,
+    path const& dest
+  );
+
+  /* Squash expired checkpoints and repack the backup repository
+    on a background thread. Syncs and history queries wait for it. */
+  void startMaintenance(RetentionPolicy const& policy = RetentionPolicy());
+
+  /* Stop syncing, or the running operation. Outside an operation,
+    only the requests in flight stop. Several Dpt in one process are
+    stopped independently. */
   void stop();
 
+  /* The token of the running operation, or of the requests made
+    outside one. stop() cancels it, and each operation starts with a
+    new one. */
+  shared_ptr<CancellationToken> cancellation() const;
+
+  /* The dpt and local files as of the last full listing, null
+    before the first. Syncs with a diff memory budget do not take
+    full listings and leave these as they were. */
+  shared_ptr<ListingSnapshot const> dptListing() const;
+  shared_ptr<ListingSnapshot const> localListing() const;
+
   /* Get DPT battery status */
   Battery battery() const;
 
 protected:
   void gitInit();
-  string getNonce(string client_id);
+
+  /* An operation for stop(), which cancels its token until the scope
+    ends. Scopes nest, inner ones share the outer token. */
+  class OperationScope {
+  public:
+    explicit OperationScope(Dpt& dpt);
+    ~OperationScope();
+    OperationScope(OperationScope const& other) = delete;
+    OperationScope& operator=(OperationScope const& other) = delete;
+    shared_ptr<CancellationToken> const& token() const noexcept
+    {
+      return m_token;
+    }
+  private:
+    Dpt& m_dpt;
+    shared_ptr<CancellationToken> m_token;
+  };
+
+  string getNonce(string const& client_id) const;
+  void handshake() const;
+  void reauthenticate(string const& stale) const;
+  string credential() const;
+  path credentialCachePath() const;
+  void loadCredential() const;
+  void saveCredential() const;
 
   void updateLocalNode(
     shared_ptr<DNode> node,
@@ -180,6 +306,16 @@ protected:
 
   void overwriteToDpt(path const& local, path const& dpt);
   void overwriteFromDpt(path const& dpt, path const& local);
+  void backupFromDpt(
+    shared_ptr<DNode const> dpt,
+    vector<pair<rpath,git_oid>>& blobs
+  );
+  git_oid downloadDptBlob(shared_ptr<DNode> node);
+  void downloadDptFile(
+    shared_ptr<DNode> node,
+    std::function<void(uint8_t const*, size_t)> const& write
+  );
+  void backupToDptSnapshot(vector<shared_ptr<DNode const>> const& sources);
   void deleteFromDpt(path const& file);
   void deleteFromLocal(path const& file);
   void moveBetweenLocal(path const& from, path const& to);
@@ -187,6 +323,15 @@ protected:
   void copyBetweenLocal(path const& from, path const& to);
   void copyBetweenDpt(path const& from, path const& to);
   void updateRevDB();
+  string localBlobId(rpath const& relpath, string const& local_md5) const;
+  void updateDptContentIndex();
+  bool inSyncDir(path const& p, rpath* relpath) const;
+  void rememberDptContent(
+    string const& local_md5,
+    shared_ptr<DNode const> const& node
+  );
+  void forgetDptContent(path const& dpt);
+  void forgetResolvedPath(path const& dpt);
 
   void updateRevForNode(
     shared_ptr<LNode const> local,
@@ -194,8 +339,33 @@ protected:
   );
 
   void computeSyncFiles();
+  void clearSyncPlan();
+  void planSyncFiles();
+  void computeSyncFilesStreaming();
+  void updateRevDBStreaming();
+  void listLocalEntries(
+    path const& local_path,
+    string const& relpath,
+    DEntrySorter& sorter
+  );
+  void listDptEntries(DEntrySorter& sorter);
+
+  /* Page through the dpt document listing, both ways of computing
+    the sync plan read the device through this. Virtual so that
+    tests can list entries without a device. */
+  virtual void forEachDptEntry(
+    std::function<void(Json const&)> const& visit
+  ) const;
+  shared_ptr<DNode> addStreamedNode(
+    DEntry const& entry,
+    path const& root,
+    shared_ptr<DArena> const& arena,
+    unordered_map<string,shared_ptr<DNode>>& nodes
+  );
   void reportComputedSyncFiles();
+  vector<rpath> syncedLocalPaths() const;
   void syncAllFiles();
+  void applySyncPlan();
   void dbOpen();
   void dbClose();
   string baseUrl() const;
@@ -203,12 +373,22 @@ protected:
   void updateDptTree();
   string git(string const& command) const;
 
+  /* Optionally, pass filesize to retrieve the size of the whole
+    file from the response */
   shared_ptr<vector<uint8_t>> readDptFileBytes(
     shared_ptr<DNode const> node,
     size_t offset,
-    size_t size
+    size_t size,
+    size_t* filesize = nullptr
   ) const;
 
+  /* Read the first size bytes and correct the filesize of node,
+    which the listing sometimes reports stale */
+  shared_ptr<vector<uint8_t>> readDptFileHead(
+    shared_ptr<DNode> node,
+    size_t size
+  );
+
   void writeDptFileBytes(
     shared_ptr<DNode const> node,
     size_t offset,
@@ -216,20 +396,60 @@ protected:
     shared_ptr<vector<uint8_t>> bytes
   ) const;
 
+  /* head is the beginning of the dpt file, already read */
   size_t bisectDptFileBytes(
     shared_ptr<DNode const> node,
-    istream& local
+    istream& local,
+    vector<uint8_t> const& head
   ) const;
 
-  size_t readDptFilesize(shared_ptr<DNode> node);
-
 private:
   string m_hostname = "digitalpaper.local";
   unsigned m_port = 8443;
-  map<string,string> m_cookies;
+  mutable HostResolver m_host_resolver;
+  bool m_pin_address = false;
+  /* Every request of this instance goes through one client: the
+    platform stack under NFHTTP keeps its connections and TLS sessions
+    to the device, so only the first request pays for a full
+    handshake. NFHTTP exposes nothing of TLS, so sessions do not
+    outlive the process. */
+  shared_ptr<nativeformat::http::Client> m_client =
+    nativeformat::http::createClient(
+      nativeformat::http::standardCacheLocation(),
+      "NFHTTP-" + nativeformat::http::version()
+    );
+  /* held by the operations that read or modify the trees below */
+  mutable std::recursive_mutex m_operation_mutex;
+  mutable std::mutex m_listing_mutex;
+  shared_ptr<ListingSnapshot const> m_dpt_listing;
+  shared_ptr<ListingSnapshot const> m_local_listing;
+  mutable std::mutex m_cancellation_mutex;
+  shared_ptr<CancellationToken> m_cancellation
+    = make_shared<CancellationToken>();
+  size_t m_operations = 0; /* nested OperationScope */
+  /* the session can be renewed from const requests, by whichever
+    thread sees it expire first */
+  mutable map<string,string> m_cookies;
+  mutable std::recursive_mutex m_auth_mutex;
+  mutable shared_ptr<HttpSigner> m_signer;
   shared_ptr<LNode> m_local_tree = make_shared<DNode>();
   shared_ptr<DNode> m_dpt_tree = make_shared<DNode>();
+  /* the scanned trees are allocated here, a rescan starts a new
+    arena and the old one goes away with the last of its nodes */
+  shared_ptr<DArena> m_local_arena;
+  shared_ptr<DArena> m_dpt_arena;
+  size_t m_diff_memory_budget = 0;
+  SnapshotBackend m_snapshot_backend = GitSnapshots;
+  shared_ptr<Snapshot> m_snapshot;
+  /* the same object as m_snapshot with the git backend, null
+    otherwise; enables the git-only shortcuts */
   shared_ptr<Git> m_git;
+  /* without git, the dpt files a sync deletes or overwrites are
+    kept in snapshots of their own */
+  shared_ptr<Snapshot> m_dpt_snapshot;
+  /* serializes m_snapshot between syncs and background maintenance */
+  mutable std::mutex m_git_mutex;
+  std::thread m_maintenance;
   path m_sync_dir;
   path m_client_id_path;
   path m_private_key_path;
@@ -241,6 +461,22 @@ private:
   unordered_map<string,shared_ptr<DNode>> m_dpt_revision_nodes;
   unordered_map<string,shared_ptr<LNode>> m_local_revision_nodes;
 
+  /* dpt path -> node found by resolveDptPath, not part of m_dpt_tree */
+  LruCache<string,shared_ptr<DNode>> m_resolved_nodes{DptResolveCacheSize};
+
+  /* directories found empty by updateLocalTree */
+  vector<rpath> m_local_empty_dirs;
+
+  /* blobs of the files downloaded during the current sync,
+    computed while transferring so that git need not hash them */
+  vector<pair<rpath,git_oid>> m_transferred_blobs;
+
+  /* local md5 -> dpt document with that content, covering the
+    device tree and the files uploaded during the current sync */
+  unordered_map<string,shared_ptr<DNode const>> m_dpt_content_nodes;
+  /* dpt path -> its key in m_dpt_content_nodes */
+  map<string,string> m_dpt_content_paths;
+
   std::function<void(string const&)>
     m_messager = [](string const&) { };
 
@@ -253,6 +489,10 @@ private:
   vector<pair<shared_ptr<LNode const>,shared_ptr<DNode const>>>
     m_moved_nodes;
 
+  /* (from,to) local files moved by the user since the last sync,
+    as known from RevDB */
+  vector<pair<rpath,rpath>> m_local_renames;
+
   vector<pair<shared_ptr<LNode const>,shared_ptr<DNode const>>>
     m_modified_nodes;
 
@@ -274,19 +514,26 @@ private:
   vector<shared_ptr<DNode const>> m_prepared_dpt_delete;
 };
 
+/* Signs auth nonces, loading the private key once */
 class HttpSigner {
 private:
-  path m_private_key_path;
+  evp_pkey_st* m_pkey = nullptr;
 
 public:
   HttpSigner(path const& private_key_path);
-  string sign(string nonce);
+  ~HttpSigner();
+  HttpSigner(HttpSigner const& other) = delete;
+  HttpSigner& operator=(HttpSigner const& other) = delete;
+  string sign(string const& nonce) const;
 };
 
 bool syncable(path const& path);
 
 size_t readLocalFilesize(istream& infile);
 
+/* The total of a Content-Range header value, false if malformed */
+bool parseContentRange(string const& value, size_t* filesize);
+
 shared_ptr<vector<uint8_t>> readLocalFileBytes(
   istream& infile,
   size_t offset,
@@ -6,6 +6,7 @@
 #include <chrono>
 #include <boost/date_time.hpp>
 #include <boost/filesystem.hpp>
+#include <cstdint>
 
 /* Document Tree */
 
@@ -21,6 +22,47 @@ using boost::filesystem::path;
 
 typedef boost::filesystem::path rpath; /* a relative path */
 
+/* Bump allocator for the nodes of one scanned tree. Nodes and their
+  shared_ptr control blocks are carved out of large chunks, so a walk
+  touches contiguous memory and the tree is released in one go once
+  the last node is gone. Not thread-safe. */
+class DArena {
+public:
+  explicit DArena(size_t chunk_size = 64 * 1024);
+  DArena(DArena const& other) = delete;
+  DArena& operator=(DArena const& other) = delete;
+  void* allocate(size_t size, size_t align);
+  size_t bytesAllocated() const noexcept { return m_bytes; }
+
+private:
+  vector<std::unique_ptr<char[]>> m_chunks;
+  size_t m_chunk_size;
+  size_t m_used = 0;
+  size_t m_bytes = 0;
+};
+
+template<class T>
+struct DArenaAllocator {
+  typedef T value_type;
+  shared_ptr<DArena> arena;
+  DArenaAllocator(shared_ptr<DArena> a) : arena(std::move(a)) {}
+  template<class U>
+  DArenaAllocator(DArenaAllocator<U> const& other) : arena(other.arena) {}
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+  /* memory goes back with the whole arena */
+  void deallocate(T*, size_t) noexcept {}
+  template<class U>
+  bool operator==(DArenaAllocator<U> const& other) const noexcept {
+    return arena == other.arena;
+  }
+  template<class U>
+  bool operator!=(DArenaAllocator<U> const& other) const noexcept {
+    return arena != other.arena;
+  }
+};
+
 class DNode {
 public:
   inline void setFilesize(size_t s) noexcept { m_filesize = s; }
@@ -29,37 +71,57 @@ public:
   inline void setIsNote(bool v) noexcept { m_is_note = v; }
   time_t lastModifiedTime() const;
   void setLastModifiedTime(time_t const& time);
-  vector<shared_ptr<DNode>> children() const;
+  vector<shared_ptr<DNode>> const& children() const noexcept;
   void addChild(shared_ptr<DNode> child);
+
+  /* Sort children by filename, recursively. Trees are sorted once
+    built so that symmetricDiff can merge them. */
+  void sortChildren();
   bool isDir() const;
   void setIsDir(bool);
   string const& id() const;
   void setId(string const& id);
   string const& filename() const;
   void setFilename(string const&);
-  string const& rev() const;
+  /* md5 revisions are kept as 16 raw bytes, so rev() formats them
+    anew on every call; compare with hasRev() in loops */
+  string rev() const;
+  bool hasRev(string const& rev) const noexcept;
   void setRev(string const&);
+  /* keeps a relative path set before */
   void setPath(boost::filesystem::path const&);
+  /* cheapest when the relative path is a suffix of path() */
   void setRelPath(boost::filesystem::path const&);
   boost::filesystem::path const& path() const;
-  rpath const& relPath() const;
+  rpath relPath() const;
   vector<shared_ptr<DNode>> allFiles() const;
 
 private:
   vector<shared_ptr<DNode>> m_children;
-  time_t m_last_modified_time;
+  boost::filesystem::path m_path;
   string m_filename;
   string m_id;
-  string m_rev;
+  time_t m_last_modified_time = 0;
+  size_t m_filesize = 0;
+  std::unique_ptr<string> m_rev; /* only when m_digest can't hold it */
+  std::unique_ptr<rpath> m_rel_path; /* only when not a suffix */
+  /* relPath() is this many trailing chars of m_path, or
+    m_rel_path when UINT32_MAX */
+  uint32_t m_rel_path_size = UINT32_MAX;
+  uint8_t m_digest[16];
+  bool m_has_digest = false;
+  bool m_digest_upper = false;
   bool m_is_dir = false;
   bool m_is_note = false;
-  boost::filesystem::path m_path;
-  rpath m_rel_path;
-  size_t m_filesize;
 };
 
 typedef DNode LNode;
 
+/* Create a node in arena */
+shared_ptr<DNode> makeNode(shared_ptr<DArena> const& arena);
+
+/* Merge two child lists sorted by filename. The outputs are cleared
+  first, pass the same buffers again to reuse their capacity. */
 void symmetricDiff(
   vector<shared_ptr<DNode>> const& a,
   vector<shared_ptr<DNode>> const& b,
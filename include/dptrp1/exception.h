@@ -1,5 +1,10 @@
+#ifndef exception_h
+#define exception_h
+
 namespace dpt {
   class SyncInterrupted {
 
   };
 };
+
+#endif
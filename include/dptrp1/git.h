@@ -2,7 +2,10 @@
 
 #include <boost/filesystem.hpp>
 #include <memory>
+#include <functional>
 #include <git2.h>
+#include <sqlite3.h>
+#include <dptrp1/snapshot.h>
 
 namespace dpt {
 
@@ -13,7 +16,7 @@ using namespace std;
 
 template<class git_type>
 class gptr {
-  git_type* m_ptr;
+  git_type* m_ptr = nullptr;
 public:
   explicit gptr(git_type* other); // constructor from raw ptr
   explicit gptr(gptr&& other); // move construct
@@ -21,17 +24,36 @@ public:
   ~gptr(); // destructor
   gptr(gptr const& other) = delete; // no copy construct
   gptr& operator=(gptr const& other) = delete; // no assignment
+  gptr& operator=(gptr&& other); // move assignment
   git_type* get();
   git_type const* get() const;
   operator git_type*();
   operator git_type**();
 };
 
-class Git {
+/* Streams content into the object database as a blob */
+class GitBlobStream {
+public:
+  GitBlobStream(git_repository* repo);
+  ~GitBlobStream();
+  GitBlobStream(GitBlobStream const& other) = delete;
+  GitBlobStream& operator=(GitBlobStream const& other) = delete;
+  void write(void const* data, size_t size);
+  /* Finish writing and return the id of the new blob */
+  git_oid commit();
+
+private:
+  git_writestream* m_stream = nullptr;
+};
+
+class Git : public Snapshot {
 public:
   Git(path const& dirpath);
+  ~Git();
   void commit(string const& msg);
   void tag(string const& tagname);
+  void tag(string const& tagname, git_oid const& target);
+  git_oid revparse(string const& refish);
   void checkout(string const& msg);
   void branch(string const& name);
   bool hasChanges();
@@ -39,14 +61,124 @@ public:
   string status();
   string status(gptr<git_reference>& head, gptr<git_status_list>& stats);
   void addAll();
+
+  /* Stage all changes and commit them with a summary, scanning the
+    working tree only once. Returns the summary. Renames are not
+    detected by content, known ones (from, to) can be passed in. */
+  string checkpoint(
+    string const& title,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) override;
+
+  /* Same as above, but only the given paths are staged and
+    summarized. Directories are staged recursively and paths that
+    no longer exist are removed. */
+  string checkpoint(
+    string const& title,
+    vector<rpath> const& paths,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) override;
+
+  /* Check out master and discard everything since HEAD */
+  void rollback() override;
   path dir() const;
   void insertGitKeepFiles();
+
+  /* Insert .gitkeep only into the given empty directories */
+  void insertGitKeepFiles(vector<rpath> const& dirs);
+
+  /* By default status() walks the whole tree for empty directories.
+    Callers who already know them turn this off and report them with
+    insertGitKeepFiles(dirs) instead. */
+  void setScanEmptyDirs(bool scan);
   vector<gptr<git_commit>> history(size_t limit);
 
+  /* Commits reachable from any ref, newest first, served from an
+    on-disk cache. Pass the last commit of the previous page as
+    after to continue from there. Commits made elsewhere show up
+    when the first page is asked for again. */
+  vector<GitCommitRecord> historyPage(
+    size_t limit,
+    string const& after = ""
+  ) override;
+
+  /* The id the content of file has as a blob, without writing it */
+  string blobId(path const& file) const;
+
+  /* Whether the object database has the blob of the given hex id */
+  bool hasBlob(string const& id, git_oid* oid);
+
+  /* Write the content of a blob to a file */
+  void extractBlob(git_oid const& oid, path const& dest);
+
+  /* List every version of a file, newest first. Versions are kept
+    in an index that is updated with every commit. */
+  vector<GitFileVersion> versions(rpath const& relpath) override;
+
+  /* Squash checkpoints on master that the policy does not keep,
+    rewrite the dpt_<sha> backup tags accordingly, and repack all
+    objects into a single delta-compressed pack. */
+  MaintenanceReport maintain(
+    RetentionPolicy const& policy,
+    time_t now = time(nullptr)
+  ) override;
+
+  /* Write one version of a file to dest */
+  void restoreVersion(
+    GitFileVersion const& version,
+    path const& dest
+  ) override;
+
+  /* Write the tree of a commit to dest without touching the working
+    tree or HEAD. Files identical to the working tree are reflinked
+    where the filesystem supports it. */
+  void exportTree(string const& refish, path const& dest) override;
+
+  /* Write content straight into the object database */
+  unique_ptr<GitBlobStream> blobStream();
+  git_oid writeBlob(void const* data, size_t size);
+
+  /* Stage blobs whose ids are already known. The files at the
+    given paths must hold exactly that content, their stat data is
+    recorded so that status does not need to hash them again. */
+  void stage(vector<pair<rpath,git_oid>> const& blobs);
+
+  /* Commit base's tree with blobs placed at the given paths onto
+    branch, without touching the index or the working tree.
+    The branch is created or reset to point to the new commit. */
+  git_oid commitBlobs(
+    string const& branch,
+    string const& base,
+    vector<pair<rpath,git_oid>> const& blobs,
+    string const& msg
+  );
+
 private:
+  string commitCheckpoint(
+    string const& title,
+    vector<pair<string,string>>& changes,
+    vector<pair<rpath,rpath>> const& renames
+  );
+  void openVersionIndex();
+  void indexVersions(git_oid const& commit_oid);
+  void cacheCommit(git_commit* commit);
+  void repack();
+  /* what every ref points to, symbolic refs resolved */
+  vector<git_oid> refTargets();
+  /* whether the pack at idx alone holds everything reachable from
+    roots and the index */
+  bool packComplete(
+    path const& idx,
+    vector<git_oid> const& roots,
+    git_index* index
+  );
+  uintmax_t size() const;
+  void updateHistoryCache();
   static int m_initializer;
   gptr<git_repository> m_repo;
+  sqlite3* m_versions_db = nullptr;
   path m_repo_path;
+  bool m_scan_empty_dirs = true;
 };
 
 };
@@ -0,0 +1,102 @@
+#ifndef hostresolver_h
+#define hostresolver_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <boost/asio/ip/address.hpp>
+
+/* Caches the addresses of devices on the LAN. Resolving a .local
+  name goes through mDNS and may take hundreds of milliseconds, so it
+  is done once per TTL, optionally ahead of time on a background
+  thread, rather than on every request. */
+
+namespace dpt {
+
+using std::string;
+using std::vector;
+
+/* A device that answered under hostname */
+struct DeviceAddress {
+  string hostname;
+  boost::asio::ip::address address;
+};
+
+class HostResolver {
+public:
+  explicit HostResolver(
+    std::chrono::seconds ttl = std::chrono::seconds(300)
+  );
+  ~HostResolver();
+  HostResolver(HostResolver const& other) = delete;
+  HostResolver& operator=(HostResolver const& other) = delete;
+
+  /* The address of hostname, resolved again once the cached one
+    expires. false when hostname does not resolve. */
+  bool resolve(
+    string const& hostname,
+    unsigned port,
+    boost::asio::ip::address* addr = nullptr
+  );
+
+  /* The cached address without resolving, even if expired, as
+    the background refresh replaces it soon */
+  bool cached(
+    string const& hostname,
+    boost::asio::ip::address* addr
+  ) const;
+
+  /* Forget hostname, eg, when its address stopped answering */
+  void invalidate(string const& hostname);
+
+  /* Resolve hostname again on a background thread every half TTL,
+    so that resolve() never waits on mDNS. Replaces the previously
+    refreshed hostname, if another. Thread-safe. */
+  void startRefresh(string const& hostname, unsigned port);
+  void stopRefresh();
+
+  /* Every device answering hostname or, as mDNS renames devices
+    that share a name, hostname with -2, -3, ... up to max_devices.
+    The names are looked up concurrently. */
+  vector<DeviceAddress> discover(
+    string const& hostname,
+    unsigned port,
+    size_t max_devices = 4
+  );
+
+  /* Blocking lookup through the system resolver */
+  static bool lookup(
+    string const& hostname,
+    unsigned port,
+    boost::asio::ip::address* addr
+  );
+
+private:
+  struct Entry {
+    boost::asio::ip::address address;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  void store(string const& hostname, boost::asio::ip::address const& addr);
+  void refreshLoop(string hostname, unsigned port);
+  /* with m_refresh_mutex held */
+  void joinRefresh();
+
+  std::chrono::seconds m_ttl;
+  mutable std::mutex m_mutex;
+  std::unordered_map<string,Entry> m_entries;
+  std::condition_variable m_refresh_cv;
+  bool m_refresh_stop = false; /* guarded by m_mutex */
+  /* serialises startRefresh and stopRefresh, guards the two below */
+  std::mutex m_refresh_mutex;
+  string m_refresh_target;
+  std::thread m_refresh;
+};
+
+};
+
+#endif
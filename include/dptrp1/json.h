@@ -0,0 +1,216 @@
+#ifndef json_h
+#define json_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <charconv>
+#include <type_traits>
+
+/* A small JSON document for the device API. Parsing keeps strings
+  and numbers as views into the parsed bytes, so reading a response
+  costs one vector per object or array and nothing per value. */
+
+namespace dpt {
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::pair;
+using std::shared_ptr;
+
+enum class JsonKind {
+  Null,
+  Bool,
+  Number,
+  String,
+  Array,
+  Object,
+};
+
+/* Events of a document in order of appearance. Keys and string
+  values come unescaped; the views are only valid during the call. */
+class JsonHandler {
+public:
+  virtual ~JsonHandler() = default;
+  virtual void startObject() {}
+  virtual void endObject() {}
+  virtual void startArray() {}
+  virtual void endArray() {}
+  virtual void key(string_view /* key */) {}
+  virtual void value(JsonKind /* kind */, string_view /* text */) {}
+};
+
+class Json {
+public:
+  /* Array elements have an empty key, like in ptree */
+  typedef pair<string_view,Json> value_type;
+  typedef vector<value_type>::const_iterator const_iterator;
+
+  /* An empty object */
+  Json() = default;
+
+  /* Parse a copy of the bytes */
+  static Json fromString(string const& body);
+  static Json fromBytes(char const* body, size_t size);
+
+  /* Parse the bytes in place, owner keeps them alive for as long
+    as the document is */
+  static Json fromBuffer(
+    shared_ptr<void const> owner,
+    char const* body,
+    size_t size
+  );
+
+  /* SAX mode, throws on malformed input */
+  static void parse(char const* body, size_t size, JsonHandler& handler);
+
+  /* Hand each element of the top level array under key to visit as
+    soon as it is parsed, instead of building the whole array. An
+    element is only valid during the call. Returns the rest of the
+    document, where key is an empty array. */
+  static Json forEachElement(
+    shared_ptr<void const> owner,
+    char const* body,
+    size_t size,
+    string_view key,
+    std::function<void(Json const&)> const& visit
+  );
+
+  /* Typed read of the value at a dot separated path, an empty path
+    is this node. Throws when there is no such value or it does not
+    convert. */
+  template<class T>
+  T get(string_view path) const
+  {
+    Json const* node = findChild(path);
+    if (! node) {
+      throw "missing json field";
+    }
+    T rtv;
+    if (! convert(node->m_data, &rtv)) {
+      throw "bad json field";
+    }
+    return rtv;
+  }
+
+  /* Same, but default_value when missing or not convertible */
+  template<class T>
+  T get(string_view path, T const& default_value) const
+  {
+    Json const* node = findChild(path);
+    T rtv;
+    if (! node || ! convert(node->m_data, &rtv)) {
+      return default_value;
+    }
+    return rtv;
+  }
+
+  /* Throws when missing */
+  Json const& get_child(string_view path) const;
+
+  /* Null when missing */
+  Json const* findChild(string_view path) const noexcept;
+
+  /* Set a member of this object, replacing one with the same key.
+    Strings are written as strings, numbers and bools as such. */
+  template<class T>
+  void put(string_view key, T const& value)
+  {
+    if constexpr (std::is_same_v<T,bool>) {
+      putValue(key, JsonKind::Bool, value ? "true" : "false", true);
+    } else if constexpr (std::is_arithmetic_v<T>) {
+      putValue(key, JsonKind::Number, numberText(value), true);
+    } else {
+      putValue(key, JsonKind::String, string_view(value), true);
+    }
+  }
+
+  /* Append a member, the child is copied */
+  void add_child(string_view key, Json const& child);
+
+  /* An empty array */
+  static Json array();
+
+  /* Append an element to this array, a scalar or a copied Json */
+  template<class T>
+  void push_back(T const& value)
+  {
+    if constexpr (std::is_same_v<T,Json>) {
+      add_child("", value);
+    } else if constexpr (std::is_same_v<T,bool>) {
+      putValue("", JsonKind::Bool, value ? "true" : "false", false);
+    } else if constexpr (std::is_arithmetic_v<T>) {
+      putValue("", JsonKind::Number, numberText(value), false);
+    } else {
+      putValue("", JsonKind::String, string_view(value), false);
+    }
+  }
+
+  string toString() const;
+
+  JsonKind kind() const noexcept { return m_kind; }
+
+  /* Text of a scalar, unescaped for strings */
+  string_view data() const noexcept { return m_data; }
+
+  /* Members or elements */
+  bool empty() const noexcept { return m_children.empty(); }
+  size_t size() const noexcept { return m_children.size(); }
+  const_iterator begin() const noexcept { return m_children.begin(); }
+  const_iterator end() const noexcept { return m_children.end(); }
+
+private:
+  struct Storage;
+  friend class JsonBuilder;
+
+  void putValue(
+    string_view key,
+    JsonKind kind,
+    string_view text,
+    bool replace
+  );
+  Storage& storage();
+  void write(string& out) const;
+
+  static bool convert(string_view text, string* out);
+  static bool convert(string_view text, bool* out);
+  static bool convert(string_view text, double* out);
+  static bool convert(string_view text, float* out);
+
+  template<class T>
+  static std::enable_if_t<std::is_integral_v<T>,bool> convert(
+    string_view text,
+    T* out
+  )
+  {
+    auto const end = text.data() + text.size();
+    auto const r = std::from_chars(text.data(), end, *out);
+    return r.ec == std::errc() && r.ptr == end;
+  }
+
+  template<class T>
+  static string numberText(T value)
+  {
+    if constexpr (std::is_integral_v<T>) {
+      return std::to_string(value);
+    } else {
+      return doubleText(value);
+    }
+  }
+  static string doubleText(double value);
+
+  JsonKind m_kind = JsonKind::Object;
+  string_view m_data;
+  vector<value_type> m_children;
+
+  /* What the views point into. Set on documents and on children
+    added with add_child, null on nodes inside a parsed document. */
+  shared_ptr<Storage> m_storage;
+};
+
+};
+
+#endif
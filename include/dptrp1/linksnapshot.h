@@ -0,0 +1,82 @@
+#pragma once
+
+#include <dptrp1/snapshot.h>
+#include <map>
+#include <set>
+
+namespace dpt {
+
+/* Snapshots as plain file trees next to a small manifest. A file
+  unchanged since the previous snapshot is hardlinked to it, a
+  changed one is reflinked from the sync dir where the filesystem
+  supports it (btrfs, xfs, apfs) and copied otherwise. Nothing is
+  hashed or compressed. Store files are never written to after
+  creation, so the links are safe. */
+class LinkSnapshot : public Snapshot {
+public:
+  /* Snapshots of dir are kept under dir/.snapshots */
+  LinkSnapshot(path const& dir);
+
+  /* The store must be on the same filesystem as dir */
+  LinkSnapshot(path const& dir, path const& store);
+
+  string checkpoint(
+    string const& title,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) override;
+  string checkpoint(
+    string const& title,
+    vector<rpath> const& paths,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) override;
+  void rollback() override;
+  vector<GitCommitRecord> historyPage(
+    size_t limit,
+    string const& after = ""
+  ) override;
+  vector<GitFileVersion> versions(rpath const& relpath) override;
+  void restoreVersion(
+    GitFileVersion const& version,
+    path const& dest
+  ) override;
+
+  /* An empty id or HEAD means the latest snapshot */
+  void exportTree(string const& id, path const& dest) override;
+  MaintenanceReport maintain(
+    RetentionPolicy const& policy,
+    time_t now = time(nullptr)
+  ) override;
+  path dir() const;
+
+  /* Hidden files are left out like the local tree does, except the
+    ones tracked here, eg, sync state that has to roll back along
+    with the files */
+  void trackHidden(rpath const& relpath);
+
+private:
+  struct Entry {
+    uintmax_t size;
+    time_t mtime;
+  };
+  /* generic relative path -> stat of the file when recorded */
+  typedef map<string,Entry> Manifest;
+
+  vector<string> ids() const; /* oldest first */
+  string latest() const;
+  Manifest readManifest(string const& id, time_t* time = nullptr) const;
+  void scan(path const& p, Manifest& manifest) const;
+  bool ignored(string const& relpath) const;
+  string commitSnapshot(
+    string const& title,
+    Manifest const& manifest,
+    vector<pair<rpath,rpath>> const& renames
+  );
+  void copyOut(path const& from, path const& to, time_t mtime) const;
+  uintmax_t size() const;
+
+  path m_dir;
+  path m_store;
+  set<string> m_tracked_hidden;
+};
+
+};
@@ -0,0 +1,87 @@
+#ifndef lrucache_h
+#define lrucache_h
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/* A small map that forgets the least recently used entry once it
+  holds capacity entries */
+
+namespace dpt {
+
+template<class K, class V>
+class LruCache {
+public:
+  explicit LruCache(size_t capacity) : m_capacity(capacity) {}
+
+  /* Copies the value to *value and marks it as recently used,
+    false when there is no such key */
+  bool get(K const& key, V* value)
+  {
+    auto const i = m_index.find(key);
+    if (i == m_index.end()) {
+      return false;
+    }
+    m_items.splice(m_items.begin(), m_items, i->second);
+    *value = i->second->second;
+    return true;
+  }
+
+  void put(K const& key, V value)
+  {
+    auto const i = m_index.find(key);
+    if (i != m_index.end()) {
+      i->second->second = std::move(value);
+      m_items.splice(m_items.begin(), m_items, i->second);
+      return;
+    }
+    m_items.emplace_front(key, std::move(value));
+    m_index[key] = m_items.begin();
+    if (m_items.size() > m_capacity) {
+      m_index.erase(m_items.back().first);
+      m_items.pop_back();
+    }
+  }
+
+  void erase(K const& key)
+  {
+    auto const i = m_index.find(key);
+    if (i != m_index.end()) {
+      m_items.erase(i->second);
+      m_index.erase(i);
+    }
+  }
+
+  /* Drop every entry whose key satisfies pred */
+  template<class Pred>
+  void eraseIf(Pred pred)
+  {
+    for (auto i = m_items.begin(); i != m_items.end();) {
+      if (pred(i->first)) {
+        m_index.erase(i->first);
+        i = m_items.erase(i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  void clear() noexcept
+  {
+    m_items.clear();
+    m_index.clear();
+  }
+
+  size_t size() const noexcept { return m_items.size(); }
+
+private:
+  typedef std::list<std::pair<K,V>> Items;
+  size_t m_capacity;
+  Items m_items;
+  std::unordered_map<K,typename Items::iterator> m_index;
+};
+
+};
+
+#endif
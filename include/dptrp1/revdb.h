@@ -2,6 +2,9 @@
 #define revdb_h
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 #include <boost/filesystem.hpp>
 #include <sqlite3.h>
 
@@ -15,22 +18,45 @@ namespace dpt {
     RelPath = 0,
     LocalRev = 1,
     DptRev = 2,
+    /* blob of the local file in the backup repository, empty when
+      not known */
+    GitOid = 3,
+  };
+
+  /* Walks all rows of RevDB, see RevDB::sorted() */
+  class RevCursor {
+    private:
+      sqlite3_stmt* m_stmt = nullptr;
+    public:
+      RevCursor(sqlite3* db);
+      ~RevCursor();
+      RevCursor(RevCursor const& other) = delete;
+      RevCursor& operator=(RevCursor const& other) = delete;
+      bool next(vector<string>* row);
   };
 
   class RevDB {
     private:
-      sqlite3* m_db;
+      sqlite3* m_db = nullptr;
     public:
       void open(path const& db);
       vector<string> getByRelPath(rpath const& relpath) const;
       vector<string> getByDptRev(string const& relpath) const;
       vector<string> getByLocalRev(string const& relpath) const;
-      void putRev(rpath const& relpath, string const& local_md5, string const& dpt_rev) const;
+      /* local_md5 of every dpt_rev, in one query */
+      unordered_map<string,string> localRevsByDptRev() const;
+      void putRev(rpath const& relpath, string const& local_md5, string const& dpt_rev, string const& git_oid = "") const;
       void reset();
+      /* The git_oid of relpath before the last reset(), if its
+        content was local_md5 then, else empty */
+      string previousGitOid(rpath const& relpath, string const& local_md5) const;
+      /* All rows in pathLess order of rel_path */
+      unique_ptr<RevCursor> sorted() const;
       void close();
   };
 
   string md5(path const& file);
+  string md5(void const* data, size_t size);
 };
 
 #endif
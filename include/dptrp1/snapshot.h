@@ -0,0 +1,115 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <string>
+#include <vector>
+#include <ctime>
+
+namespace dpt {
+
+using boost::filesystem::path;
+
+typedef boost::filesystem::path rpath; /* a relative path */
+
+using namespace std;
+
+/* One historical version of a file */
+struct GitFileVersion {
+  string commit;
+  string blob;
+  size_t size;
+  time_t time;
+};
+
+/* A commit as kept in the history cache */
+struct GitCommitRecord {
+  string commit;
+  time_t time;
+  string message;
+};
+
+/* Which checkpoints survive maintenance: every checkpoint younger
+  than keep_all_days, the last one of each day younger than
+  keep_daily_days, and the last one of each week beyond that. */
+struct RetentionPolicy {
+  unsigned keep_all_days = 7;
+  unsigned keep_daily_days = 60;
+};
+
+struct MaintenanceReport {
+  size_t commits_before = 0;
+  size_t commits_after = 0;
+  uintmax_t size_before = 0; /* size of the backup store in bytes */
+  uintmax_t size_after = 0;
+};
+
+/* Point-in-time backups of the sync dir. Git keeps them in a
+  repository, LinkSnapshot as reflinked or hardlinked file trees. */
+class Snapshot {
+public:
+  virtual ~Snapshot() = default;
+
+  /* Record the whole sync dir and return a summary of what changed
+    since the last checkpoint. Known renames (from, to) are reported
+    as such instead of a deletion and a new file. */
+  virtual string checkpoint(
+    string const& title,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) = 0;
+
+  /* Same as above, but only the given paths are looked at */
+  virtual string checkpoint(
+    string const& title,
+    vector<rpath> const& paths,
+    vector<pair<rpath,rpath>> const& renames = {}
+  ) = 0;
+
+  /* Put the sync dir back to the last checkpoint */
+  virtual void rollback() = 0;
+
+  /* Checkpoints, newest first. Pass the last one of the previous
+    page as after to continue from there. */
+  virtual vector<GitCommitRecord> historyPage(
+    size_t limit,
+    string const& after = ""
+  ) = 0;
+
+  /* List every version of a file, newest first */
+  virtual vector<GitFileVersion> versions(rpath const& relpath) = 0;
+
+  /* Write one version of a file to dest */
+  virtual void restoreVersion(
+    GitFileVersion const& version,
+    path const& dest
+  ) = 0;
+
+  /* Write the files of a checkpoint to dest */
+  virtual void exportTree(string const& id, path const& dest) = 0;
+
+  /* Drop the checkpoints the policy does not keep */
+  virtual MaintenanceReport maintain(
+    RetentionPolicy const& policy,
+    time_t now = time(nullptr)
+  ) = 0;
+
+protected:
+  /* Copy-on-write clone of a file, false if not supported */
+  static bool reflink(path const& from, path const& to);
+
+  /* Collapse (kind, path) deleted/new pairs that are known renames.
+    A rename of a directory covers every file under it. */
+  static void applyRenames(
+    vector<pair<string,string>>& changes,
+    vector<pair<rpath,rpath>> const& renames
+  );
+
+  /* Given checkpoint times oldest first, which ones the policy
+    keeps. The first and the last are always kept. */
+  static vector<bool> retained(
+    vector<time_t> const& times,
+    RetentionPolicy const& policy,
+    time_t now
+  );
+};
+
+};
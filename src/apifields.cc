@@ -0,0 +1,101 @@
+#include <dptrp1/apifields.h>
+#include <dptrp1/dptrp1.h>
+
+using namespace std;
+using namespace dpt;
+
+void dpt::readApi(Json const& js, string* out)
+{
+  *out = js.get<string>("", "");
+}
+
+void dpt::readApi(Json const& js, int64_t* out)
+{
+  *out = js.get<int64_t>("", 0);
+}
+
+void dpt::readApi(Json const& js, double* out)
+{
+  *out = js.get<double>("", 0);
+}
+
+void dpt::readApi(Json const& js, bool* out)
+{
+  *out = js.get<bool>("", false);
+}
+
+string dpt::urlEncode(string_view s)
+{
+  static char const hex[] = "0123456789ABCDEF";
+  string rtv;
+  rtv.reserve(s.size());
+  for (char const c : s) {
+    bool const unreserved =
+      (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9')
+        || c == '-' || c == '_' || c == '.' || c == '~';
+    if (unreserved) {
+      rtv += c;
+    } else {
+      unsigned char const u = c;
+      rtv += '%';
+      rtv += hex[u >> 4];
+      rtv += hex[u & 0xF];
+    }
+  }
+  return rtv;
+}
+
+ApiTransport::ApiTransport(Dpt const& dpt)
+  : m_dpt(dpt)
+{
+}
+
+shared_ptr<DptResponse> ApiTransport::send(
+  char const* method,
+  string const& url,
+  Json const* body
+) const
+{
+  auto request = m_dpt.httpRequest(url);
+  request->setMethod(method);
+  if (body) {
+    string const json = body->toString();
+    request->setData(
+      reinterpret_cast<unsigned char const*>(json.data()),
+      json.size()
+    );
+    request->headerMap()["Content-Type"] = "application/json";
+  }
+  return m_dpt.sendRequest(request);
+}
+
+shared_ptr<DptResponse> ApiTransport::sendFile(
+  char const* method,
+  string const& url,
+  vector<uint8_t> const& file
+) const
+{
+  auto request = m_dpt.httpRequest(url);
+  request->setMethod(method);
+  request->headerMap()["Content-Type"]
+    = "multipart/form-data; boundary=DptAirBound";
+  string message =
+    "--DptAirBound\r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"file\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n";
+  message.append(file.begin(), file.end());
+  message += "\r\n--DptAirBound--\r\n";
+  request->setData(
+    reinterpret_cast<unsigned char const*>(message.data()),
+    message.size()
+  );
+  return m_dpt.sendRequest(request);
+}
+
+Json ApiTransport::parse(shared_ptr<DptResponse> const& response)
+{
+  size_t len;
+  unsigned char const* data = response->data(len);
+  return Json::fromBuffer(response, reinterpret_cast<char const*>(data), len);
+}
@@ -0,0 +1,209 @@
+#include <dptrp1/dlisting.h>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+using namespace std;
+using dpt::DEntry;
+using dpt::DEntrySorter;
+using boost::filesystem::path;
+
+bool dpt::pathLess(string const& a, string const& b)
+{
+  /* '/' sorts before every other byte */
+  size_t const n = min(a.size(), b.size());
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] == b[i]) {
+      continue;
+    }
+    if (a[i] == '/') {
+      return true;
+    }
+    if (b[i] == '/') {
+      return false;
+    }
+    return static_cast<unsigned char>(a[i]) < static_cast<unsigned char>(b[i]);
+  }
+  return a.size() < b.size();
+}
+
+DEntry const* dpt::ListingSnapshot::find(string const& rel_path) const
+{
+  auto const i = lower_bound(
+    entries.begin(),
+    entries.end(),
+    rel_path,
+    [](DEntry const& e, string const& p) { return pathLess(e.rel_path, p); }
+  );
+  if (i == entries.end() || i->rel_path != rel_path) {
+    return nullptr;
+  }
+  return &*i;
+}
+
+namespace {
+  void writeString(ostream& out, string const& s)
+  {
+    uint32_t const size = s.size();
+    out.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    out.write(s.data(), size);
+  }
+
+  bool readString(istream& in, string* s)
+  {
+    uint32_t size;
+    if (! in.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+      return false;
+    }
+    s->resize(size);
+    return static_cast<bool>(in.read(&(*s)[0], size));
+  }
+
+  void writeEntry(ostream& out, DEntry const& e)
+  {
+    writeString(out, e.rel_path);
+    writeString(out, e.rev);
+    writeString(out, e.id);
+    uint64_t const filesize = e.filesize;
+    int64_t const mtime = e.last_modified_time;
+    uint8_t const flags = (e.is_dir ? 1 : 0) | (e.is_note ? 2 : 0);
+    out.write(reinterpret_cast<char const*>(&filesize), sizeof(filesize));
+    out.write(reinterpret_cast<char const*>(&mtime), sizeof(mtime));
+    out.write(reinterpret_cast<char const*>(&flags), sizeof(flags));
+  }
+
+  bool readEntry(istream& in, DEntry* e)
+  {
+    uint64_t filesize;
+    int64_t mtime;
+    uint8_t flags;
+    if (
+      ! readString(in, &e->rel_path)
+        || ! readString(in, &e->rev)
+        || ! readString(in, &e->id)
+        || ! in.read(reinterpret_cast<char*>(&filesize), sizeof(filesize))
+        || ! in.read(reinterpret_cast<char*>(&mtime), sizeof(mtime))
+        || ! in.read(reinterpret_cast<char*>(&flags), sizeof(flags))
+    )
+    {
+      return false;
+    }
+    e->filesize = filesize;
+    e->last_modified_time = mtime;
+    e->is_dir = flags & 1;
+    e->is_note = flags & 2;
+    return true;
+  }
+
+  /* rough heap footprint of a buffered entry */
+  size_t entryBytes(DEntry const& e)
+  {
+    return sizeof(DEntry) + e.rel_path.capacity() + e.rev.capacity()
+      + e.id.capacity();
+  }
+
+  bool entryLess(DEntry const& a, DEntry const& b)
+  {
+    return dpt::pathLess(a.rel_path, b.rel_path);
+  }
+}
+
+DEntrySorter::DEntrySorter(size_t memory_budget, path const& spill_dir)
+{
+  m_memory_budget = memory_budget;
+  m_spill_dir = spill_dir;
+}
+
+DEntrySorter::~DEntrySorter()
+{
+  for (auto& run : m_runs) {
+    run.in.reset();
+    boost::system::error_code ec;
+    boost::filesystem::remove(run.file, ec);
+  }
+}
+
+void DEntrySorter::push(DEntry entry)
+{
+  assert(! m_merging && "push after next");
+  m_buffered_bytes += entryBytes(entry);
+  m_buffer.push_back(std::move(entry));
+  if (m_buffered_bytes > m_memory_budget) {
+    spill();
+  }
+}
+
+void DEntrySorter::spill()
+{
+  std::sort(m_buffer.begin(), m_buffer.end(), entryLess);
+  Run run;
+  run.file = m_spill_dir / boost::filesystem::unique_path("dpt-run-%%%%-%%%%-%%%%");
+  {
+    ofstream out(run.file.string(), ios_base::binary|ios_base::trunc);
+    for (auto const& e : m_buffer) {
+      writeEntry(out, e);
+    }
+    if (! out) {
+      throw "failed to spill sorted entries";
+    }
+  }
+  m_runs.push_back(std::move(run));
+  m_buffer.clear();
+  m_buffer.shrink_to_fit();
+  m_buffered_bytes = 0;
+}
+
+bool DEntrySorter::readHead(Run& run)
+{
+  run.has_head = readEntry(*run.in, &run.head);
+  return run.has_head;
+}
+
+void DEntrySorter::startMerge()
+{
+  m_merging = true;
+  if (m_runs.empty()) {
+    /* everything fit in memory */
+    std::sort(m_buffer.begin(), m_buffer.end(), entryLess);
+    return;
+  }
+  if (! m_buffer.empty()) {
+    spill();
+  }
+  for (auto& run : m_runs) {
+    run.in.reset(new ifstream(run.file.string(), ios_base::binary));
+    readHead(run);
+  }
+}
+
+bool DEntrySorter::next(DEntry* entry)
+{
+  if (! m_merging) {
+    startMerge();
+  }
+  if (m_runs.empty()) {
+    if (m_buffer_pos == m_buffer.size()) {
+      return false;
+    }
+    *entry = std::move(m_buffer[m_buffer_pos++]);
+    return true;
+  }
+  /* there are few runs, a linear scan for the smallest head is
+    cheaper than keeping a heap */
+  Run* smallest = nullptr;
+  for (auto& run : m_runs) {
+    if (
+      run.has_head
+        && (! smallest || entryLess(run.head, smallest->head))
+    )
+    {
+      smallest = &run;
+    }
+  }
+  if (! smallest) {
+    return false;
+  }
+  *entry = std::move(smallest->head);
+  readHead(*smallest);
+  return true;
+}
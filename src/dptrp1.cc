@@ -1,5 +1,4 @@
 #include <dptrp1/dptrp1.h>
-#include <boost/property_tree/json_parser.hpp>
 #include <NFHTTP/NFHTTP.h>
 #include <sstream>
 #include <iostream>
@@ -19,7 +18,11 @@
 #include <unordered_set>
 #include <git2.h>
 #include <csignal>
+#include <future>
+#include <charconv>
+#include <boost/algorithm/string/predicate.hpp>
 #include <dptrp1/exception.h>
+#include <condition_variable>
 
 using namespace dpt;
 using namespace std;
@@ -39,28 +42,33 @@ using nativeformat::http::Response;
 
 bool Dpt::resolveHost(boost::asio::ip::address* addr) const
 {
-  try {
-    boost::asio::io_service svc;
-    boost::asio::io_context ctx;
-    using resolver = boost::asio::ip::tcp::resolver;
-    resolver res(ctx);
-    resolver::query query(hostname(), to_string(port()));
-    resolver::iterator iter = res.resolve(query);
-    resolver::iterator end;
-    if (end == iter)
-    {
-      return false;
-    }
-    if (addr)
-    {
-      *addr = iter->endpoint().address();
-    }
-    return true;
-  }
-  catch (boost::wrapexcept<boost::system::system_error> err)
-  {
+  if (! m_host_resolver.resolve(hostname(), port(), addr)) {
     return false;
   }
+  /* pinned requests go to the address, keep it current; otherwise
+    nothing reads it between calls */
+  if (m_pin_address) {
+    m_host_resolver.startRefresh(hostname(), port());
+  }
+  return true;
+}
+
+vector<DeviceAddress> Dpt::discoverDevices(size_t max_devices) const
+{
+  return m_host_resolver.discover(hostname(), port(), max_devices);
+}
+
+void Dpt::setHostname(string const& hostname)
+{
+  m_hostname = hostname;
+}
+
+void Dpt::setPinAddress(bool pin)
+{
+  m_pin_address = pin;
+  if (! pin) {
+    m_host_resolver.stopRefresh();
+  }
 }
 
 void Dpt::authenticate()
@@ -74,32 +82,55 @@ void Dpt::authenticate()
       && "don't forget to set client id"
   );
   try {
-  m_cookies.clear();
+  std::lock_guard<std::recursive_mutex> lock(m_auth_mutex);
+  /* a credential from an earlier process saves the handshake */
+  if (credential().empty()) {
+    loadCredential();
+  }
+  if (credential().empty()) {
+    handshake();
+    return;
+  }
+  /* check it with a cheap request that needs authentication,
+    sendRequest authenticates again if the device no longer accepts
+    it */
+  auto request = httpRequest("/documents2?limit=1");
+  request->setMethod("GET");
+  sendRequest(request);
+  } catch(...) {
+  m_messager("Failed to Connect DPT-RP1");
+  throw;
+  }
+}
+
+void Dpt::handshake() const
+{
+  std::lock_guard<std::recursive_mutex> lock(m_auth_mutex);
+  /* requests without a credential are not retried on 401 */
+  m_cookies.erase("Credentials");
   string client_id;
   ifstream inf(m_client_id_path.string(), std::ios_base::in);
   inf >> client_id;
   #if DEBUG_AUTH
     logger() << "using client_id: " << client_id << endl;
   #endif
-  using boost::property_tree::ptree;
-  using boost::property_tree::write_json;
   /* prepare signature */
-  HttpSigner signer(m_private_key_path);
+  if (! m_signer) {
+    m_signer = make_shared<HttpSigner>(m_private_key_path);
+  }
   string nonce = getNonce(client_id);
   #if DEBUG_AUTH
     logger() << "received nonce: " << nonce << endl;
   #endif
-  string nonce_signed = signer.sign(nonce);
+  string nonce_signed = m_signer->sign(nonce);
   /* write data to send */
-  ptree data;
+  Json data;
   data.put("client_id", client_id);
   data.put("nonce_signed", nonce_signed);
   #if DEBUG_AUTH
     logger() << "using nonce_signed: " << nonce_signed << endl;
   #endif
-  ostringstream buf;
-  write_json(buf, data, false);
-  string json = buf.str();
+  string json = data.toString();
   /* send request */
   auto request = httpRequest("/auth");
   request->setMethod("PUT");
@@ -113,28 +144,69 @@ void Dpt::authenticate()
     logger() << "using credential: " << credentials << endl;
   #endif
   m_cookies["Credentials"] = credentials;
-  } catch(...) {
-  m_messager("Failed to Connect DPT-RP1");
-  throw;
+  saveCredential();
+}
+
+void Dpt::reauthenticate(string const& stale) const
+{
+  std::lock_guard<std::recursive_mutex> lock(m_auth_mutex);
+  /* only the first of the requests that failed together does the
+    handshake, the others retry with its credential */
+  if (credential() == stale) {
+    handshake();
+  }
+}
+
+string Dpt::credential() const
+{
+  std::lock_guard<std::recursive_mutex> lock(m_auth_mutex);
+  auto const i = m_cookies.find("Credentials");
+  return i == m_cookies.end() ? "" : i->second;
+}
+
+path Dpt::credentialCachePath() const
+{
+  return m_private_key_path.parent_path() / "dptrp1-credential";
+}
+
+void Dpt::loadCredential() const
+{
+  /* one line of hostname and credential */
+  ifstream inf(credentialCachePath().string(), std::ios_base::in);
+  string host;
+  string credentials;
+  if (inf >> host >> credentials && host == hostname()) {
+    m_cookies["Credentials"] = credentials;
   }
 }
 
+void Dpt::saveCredential() const
+{
+  /* the credential is as good as the private key, so it gets the
+    same permissions before anything is written to it */
+  path const cache = credentialCachePath();
+  boost::system::error_code error;
+  auto const key_status = boost::filesystem::status(m_private_key_path, error);
+  if (error) {
+    return;
+  }
+  ofstream(cache.string(), ios_base::out|ios_base::trunc).close();
+  boost::filesystem::permissions(cache, key_status.permissions(), error);
+  if (error) {
+    return;
+  }
+  ofstream of(cache.string(), ios_base::out|ios_base::trunc);
+  of << hostname() << " " << credential() << endl;
+}
+
 unsigned Dpt::port() const noexcept { return m_port; }
 string Dpt::hostname() const noexcept { return m_hostname; }
 
-string HttpSigner::sign(string nonce)
+string HttpSigner::sign(string const& nonce) const
 {
   int error = 0;
-  /* get rsa key */
-  RSA* rsa = nullptr;
-  FILE* fp = fopen(m_private_key_path.c_str(), "r");
-  assert(fp && "Cannot open file if fails.");
-  PEM_read_RSAPrivateKey(fp, &rsa, nullptr, nullptr);
-  fclose(fp);
   /* sign with rsa-sha256 */
   EVP_MD_CTX* mdctx = EVP_MD_CTX_create();
-  EVP_PKEY* evp_pkey = EVP_PKEY_new();
-  EVP_PKEY_set1_RSA(evp_pkey, rsa);
   EVP_MD const* md = EVP_sha256();
   EVP_PKEY_CTX* pkey_ctx;
   error = EVP_DigestSignInit(
@@ -142,19 +214,19 @@ string HttpSigner::sign(string nonce)
     &pkey_ctx,
     md,
     NULL,
-  evp_pkey);
+  m_pkey);
   error = EVP_DigestSignUpdate(
     mdctx,
     nonce.c_str(),
     nonce.length()
   );
   unsigned char sig[256];
-  size_t siglen;
+  size_t siglen = sizeof(sig);
   error = EVP_DigestSignFinal(mdctx, sig, &siglen);
-  assert(sig);
-  assert(siglen == 256);
-  EVP_PKEY_free(evp_pkey);
   EVP_MD_CTX_destroy(mdctx);
+  if (error != 1 || siglen != sizeof(sig)) {
+    throw "failed to sign nonce";
+  }
   /* conver to base 64 string */
   unsigned char encoded[512];
   error = EVP_EncodeBlock(encoded, sig, siglen);
@@ -164,19 +236,47 @@ string HttpSigner::sign(string nonce)
 
 HttpSigner::HttpSigner(path const& private_key_path)
 {
-  m_private_key_path = private_key_path;
+  /* parsing the pem is the costly part, do it once */
+  FILE* fp = fopen(private_key_path.c_str(), "r");
+  if (! fp) {
+    throw "cannot open private key";
+  }
+  m_pkey = PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr);
+  fclose(fp);
+  if (! m_pkey) {
+    throw "cannot read private key";
+  }
+}
+
+HttpSigner::~HttpSigner()
+{
+  EVP_PKEY_free(m_pkey);
 }
 
 shared_ptr<DptRequest> Dpt::httpRequest(string const& url) const
 {
+  /* connect to the cached address, skipping mDNS, but still
+    address the device by name */
+  boost::asio::ip::address addr;
+  bool const pinned =
+    m_pin_address && m_host_resolver.cached(hostname(), &addr);
+  string base = baseUrl();
+  if (pinned) {
+    string const host =
+      addr.is_v6() ? "[" + addr.to_string() + "]" : addr.to_string();
+    base = "https://" + host + ":" + std::to_string(port());
+  }
   auto request = nativeformat::http::createRequest(
-  baseUrl() + url,
+  base + url,
   std::unordered_map<std::string, std::string>()
   );
-  if (m_cookies.find("Credentials") != m_cookies.end())
+  if (pinned) {
+  request->headerMap()["Host"] = hostname() + ":" + std::to_string(port());
+  }
+  string const credentials = credential();
+  if (! credentials.empty())
   {
-  request->headerMap()["Cookie"] =
-    "Credentials=" + m_cookies.at("Credentials");
+  request->headerMap()["Cookie"] = "Credentials=" + credentials;
   }
   return static_pointer_cast<DptRequest>(request);
 }
@@ -184,6 +284,73 @@ shared_ptr<DptRequest> Dpt::httpRequest(string const& url) const
 shared_ptr<DptResponse> Dpt::sendRequest(
   shared_ptr<DptRequest> request
 ) const
+{
+  auto resp = performRequest(request);
+  if (resp->statusCode() / 100 != 2) {
+  logger()
+    << "Received error response: "
+    << resp->serialise()
+    << endl;
+  logger()
+    << "Request responsible for the error was: "
+    << request->serialise()
+    << endl;
+  throw "request failure";
+  }
+  return resp;
+}
+
+namespace {
+  /* Like performRequestSynchronously, but stops waiting and cancels
+    the request once cancellation is */
+  shared_ptr<DptResponse> performCancellable(
+    nativeformat::http::Client& client,
+    shared_ptr<DptRequest> const& request,
+    CancellationToken const& cancellation
+  )
+  {
+    cancellation.throwIfCancelled();
+    /* outlives this call if the request is cancelled */
+    struct Pending {
+      std::mutex mutex;
+      std::condition_variable cv;
+      shared_ptr<Response> response;
+      bool done = false;
+    };
+    auto const pending = make_shared<Pending>();
+    auto const token = client.performRequest(
+      request,
+      [pending](shared_ptr<Response> const& response) {
+        {
+          std::lock_guard<std::mutex> lock(pending->mutex);
+          pending->response = response;
+          pending->done = true;
+        }
+        pending->cv.notify_all();
+      }
+    );
+    std::unique_lock<std::mutex> lock(pending->mutex);
+    while (
+      ! pending->cv.wait_for(
+        lock,
+        CancelPollInterval,
+        [&pending] { return pending->done; }
+      )
+    )
+    {
+      if (cancellation.cancelled()) {
+        lock.unlock();
+        token->cancel();
+        throw SyncInterrupted();
+      }
+    }
+    return static_pointer_cast<DptResponse>(pending->response);
+  }
+}
+
+shared_ptr<DptResponse> Dpt::performRequest(
+  shared_ptr<DptRequest> request
+) const
 {
   #if DEBUG_REQUEST
   logger()
@@ -196,14 +363,34 @@ shared_ptr<DptResponse> Dpt::sendRequest(
     << request->body().substr(0,1000)
     << endl;
   #endif
-  static auto client =
-  nativeformat::http::createClient(
-    nativeformat::http::standardCacheLocation(),
-    "NFHTTP-" + nativeformat::http::version()
-  );
-  auto resp = static_pointer_cast<DptResponse>(
-  client->performRequestSynchronously(request)
-  );
+  auto const cancellation = this->cancellation();
+  auto resp = performCancellable(*m_client, request, *cancellation);
+  /* no connection, the device may have a new address */
+  if (resp->statusCode() == nativeformat::http::StatusCodeInvalid) {
+    m_host_resolver.invalidate(hostname());
+    /* a pinned request goes to the hostname again */
+    auto const host = request->headerMap().find("Host");
+    if (host != request->headerMap().end()) {
+      request->headerMap().erase(host);
+      string const url = request->url();
+      size_t const path = url.find('/', strlen("https://"));
+      request->setUrl(baseUrl() + (path == string::npos ? "" : url.substr(path)));
+      resp = performCancellable(*m_client, request, *cancellation);
+    }
+  }
+  /* the credential expired, eg, during a long sync: authenticate
+    again and retry once */
+  auto const cookie = request->headerMap().find("Cookie");
+  if (
+    resp->statusCode() == nativeformat::http::StatusCodeUnauthorised
+      && cookie != request->headerMap().end()
+  )
+  {
+    string const stale = cookie->second.substr(strlen("Credentials="));
+    reauthenticate(stale);
+    request->headerMap()["Cookie"] = "Credentials=" + credential();
+    resp = performCancellable(*m_client, request, *cancellation);
+  }
   #if DEBUG_REQUEST
   logger() << "response: " << resp->serialise() << endl;
   #endif
@@ -213,17 +400,6 @@ shared_ptr<DptResponse> Dpt::sendRequest(
     << resp->body().substr(0,1000)
     << endl;
   #endif
-  if (resp->statusCode() / 100 != 2) {
-  logger()
-    << "Received error response: "
-    << resp->serialise()
-    << endl;
-  logger()
-    << "Request responsible for the error was: "
-    << request->serialise()
-    << endl;
-  throw "request failure";
-  }
   return resp;
 }
 
@@ -244,20 +420,14 @@ Json Dpt::sendJson(
   }
   request->headerMap()["Content-Type"] = "application/json";
   auto response = sendRequest(request);
-  string body = readResponse(response);
-  return Json::fromString(body);
-}
-
-Json Json::fromString(string const& json)
-{
-  if (json.empty()) {
-  return Json();
-  }
-  std::istringstream ss(json);
-  Json data;
-  ptree* ptr = &data;
-  boost::property_tree::read_json(ss, *ptr);
-  return data;
+  size_t len;
+  unsigned char const* data = response->data(len);
+  /* parsed in place, the document keeps the response alive */
+  return Json::fromBuffer(
+    response,
+    reinterpret_cast<char const*>(data),
+    len
+  );
 }
 
 string Dpt::readResponse(shared_ptr<DptResponse> response) const
@@ -268,10 +438,14 @@ string Dpt::readResponse(shared_ptr<DptResponse> response) const
   return rtv;
 }
 
-string Dpt::getNonce(string client_id)
+string Dpt::getNonce(string const& client_id) const
 {
-  Json json = sendJson("GET", "/auth/nonce/" + client_id);
-  return json.get<string>("nonce");
+  return api().authNonceClientIdGet(client_id).nonce;
+}
+
+DptApi Dpt::api() const
+{
+  return DptApi(*this);
 }
 
 string Dpt::baseUrl() const
@@ -279,19 +453,96 @@ string Dpt::baseUrl() const
   return "https://" + hostname() + ":" + std::to_string(port());
 }
 
-void Dpt::dptOpenDocument(path const& p)
+shared_ptr<DNode> Dpt::resolveDptPath(path const& dpt)
+{
+  std::lock_guard<std::recursive_mutex> operation(m_operation_mutex);
+  shared_ptr<DNode> node;
+  if (m_resolved_nodes.get(dpt.string(), &node)) {
+    return node;
+  }
+  auto request = httpRequest(
+    "/resolve/entry/path/" + urlEncode(dpt.generic_string())
+  );
+  request->setMethod("GET");
+  auto response = performRequest(request);
+  if (response->statusCode() == 404) {
+    return nullptr;
+  }
+  if (response->statusCode() / 100 != 2) {
+    logger()
+      << "Received error response: "
+      << response->serialise()
+      << endl;
+    throw "request failure";
+  }
+  size_t len;
+  unsigned char const* data = response->data(len);
+  CommonEntryObjectResult2 entry;
+  readApi(
+    Json::fromBuffer(response, reinterpret_cast<char const*>(data), len),
+    &entry
+  );
+  node = make_shared<DNode>();
+  node->setId(entry.entry_id);
+  node->setFilename(entry.entry_name);
+  node->setIsDir(entry.entry_type == "folder");
+  node->setPath(entry.entry_path);
+  if (node->isDir()) {
+    node->setRev("folder");
+  } else {
+    node->setFilesize(stoull(entry.file_size.value_or("0")));
+    node->setRev(entry.file_revision.value_or(""));
+    node->setIsNote(entry.document_type.value_or("") == "note");
+  }
+  /* get relpath */
+  path::iterator p = node->path().begin();
+  path relpath;
+  for (p++; p != node->path().end(); p++) {
+    relpath /= *p;
+  }
+  node->setRelPath(relpath);
+  m_resolved_nodes.put(dpt.string(), node);
+  return node;
+}
+
+void Dpt::forgetResolvedPath(path const& dpt)
 {
-  string const document_id = m_dpt_path_nodes[p.string()]->id();
-  Json ptree;
-  ptree.put("document_id", document_id);
-  sendJson("PUT", "/viewer/controls/open2", ptree);
+  string const prefix = dpt.string() + "/";
+  m_resolved_nodes.eraseIf([&dpt, &prefix](string const& p) {
+    return p == dpt.string() || p.compare(0, prefix.size(), prefix) == 0;
+  });
 }
 
-string Json::toString() const
+void Dpt::dptOpenDocument(path const& p)
 {
-  ostringstream os;
-  boost::property_tree::write_json(os, *this, false);
-  return os.str();
+  std::lock_guard<std::recursive_mutex> operation(m_operation_mutex);
+  auto const known = m_dpt_path_nodes.find(p.string());
+  shared_ptr<DNode> node =
+    known == m_dpt_path_nodes.end() ? resolveDptPath(p) : known->second;
+  if (! node) {
+    throw "no such document";
+  }
+  ViewerControlsOpenPutRequest2 open;
+  open.document_id = node->id();
+  try {
+    api().viewerControlsOpen2Put(open);
+  } catch (char const*) {
+    /* the node may be from the last sync or the resolve cache and the
+      document replaced on the device since; look again and retry once
+      if it now has another id */
+    m_dpt_path_nodes.erase(p.string());
+    forgetResolvedPath(p);
+    shared_ptr<DNode> const current = resolveDptPath(p);
+    if (! current) {
+      throw "no such document";
+    }
+    m_dpt_path_nodes[p.string()] = current;
+    if (current->id() == open.document_id) {
+      throw;
+    }
+    open.document_id = current->id();
+    api().viewerControlsOpen2Put(open);
+  }
 }
 
 void Dpt::syncTime() const
@@ -302,9 +553,9 @@ void Dpt::syncTime() const
   // "2019-05-23T01:07:03Z";
   os << std::put_time(std::gmtime(&now), "%FT%TZ");
   /* set time on DPT-RP1 */
-  Json js;
-  js.put("value", os.str());
-  sendJson("PUT", "/system/configs/datetime", js);
+  CommonValueObject datetime;
+  datetime.value = os.str();
+  api().systemConfigsDatetimePut(datetime);
 }
 
 string DptResponse::body() const
@@ -321,74 +572,203 @@ string DptRequest::body() const
   return string(reinterpret_cast<char const*>(body), len);
 }
 
+void Dpt::forEachDptEntry(
+  std::function<void(Json const&)> const& visit
+) const
+{
+  /* only what the trees need, the device would otherwise send
+    author, title, page counts and reading dates too */
+  string const query =
+    "/documents2?entry_type=all"
+    "&fields=entry_path,entry_id,entry_name,entry_type,"
+    "file_size,file_revision,document_type"
+    /* pages only line up when the order is fixed */
+    "&order_type=entry_name_asc"
+    "&limit=" + to_string(DptListingPageSize) + "&offset=";
+  auto fetch = [this, query](size_t offset) {
+    auto request = httpRequest(query + to_string(offset));
+    request->setMethod("GET");
+    return sendRequest(request);
+  };
+  auto response = fetch(0);
+  size_t offset = 0;
+  size_t total = 0;
+  /* a listing that changed between pages would skip or repeat
+    entries, and the sync would then delete what it did not see */
+  unordered_set<string> ids;
+  while (true) {
+    std::future<shared_ptr<DptResponse>> next;
+    if (offset + DptListingPageSize < total) {
+      /* the device said there is more, fetch the next page while
+        this one is turned into nodes */
+      next = std::async(std::launch::async, fetch, offset + DptListingPageSize);
+    }
+    /* entries are visited as they are parsed, a page never becomes
+      a tree of its own */
+    size_t entries = 0;
+    size_t len;
+    unsigned char const* data = response->data(len);
+    Json const rest = Json::forEachElement(
+      response,
+      reinterpret_cast<char const*>(data),
+      len,
+      "entry_list",
+      [&visit, &entries, &ids](Json const& entry) {
+        if (! ids.insert(entry.get<string>("entry_id")).second) {
+          throw "inconsistent dpt listing";
+        }
+        entries++;
+        visit(entry);
+      }
+    );
+    size_t const count = rest.get<size_t>("count", 0);
+    if (offset > 0 && count != total) {
+      throw "inconsistent dpt listing";
+    }
+    total = count;
+    offset += entries;
+    /* a full page means there may be more, unless the device
+      already said how many there are */
+    bool const more =
+      entries == DptListingPageSize && (total == 0 || offset < total);
+    if (! more) {
+      break;
+    }
+    response = next.valid() ? next.get() : fetch(offset);
+  }
+  if (total != 0 && offset != total) {
+    throw "inconsistent dpt listing";
+  }
+}
+
+namespace {
+  /* Copy the nodes, which the sync goes on to modify */
+  shared_ptr<ListingSnapshot const> takeListing(
+    unordered_map<string,shared_ptr<DNode>> const& nodes
+  )
+  {
+    auto listing = make_shared<ListingSnapshot>();
+    listing->taken = std::time(nullptr);
+    listing->entries.reserve(nodes.size());
+    for (auto const& kv : nodes) {
+      DNode const& node = *kv.second;
+      string rel_path = node.relPath().generic_string();
+      if (rel_path.empty()) {
+        continue;
+      }
+      DEntry entry;
+      entry.rel_path = std::move(rel_path);
+      entry.rev = node.rev();
+      entry.id = node.id();
+      entry.filesize = node.filesize();
+      entry.last_modified_time = node.lastModifiedTime();
+      entry.is_dir = node.isDir();
+      entry.is_note = node.isNote();
+      listing->entries.push_back(std::move(entry));
+    }
+    sort(
+      listing->entries.begin(),
+      listing->entries.end(),
+      [](DEntry const& a, DEntry const& b) {
+        return pathLess(a.rel_path, b.rel_path);
+      }
+    );
+    return listing;
+  }
+}
+
 void Dpt::updateDptTree()
 {
-  Json js = sendJson("GET", "/documents2?entry_type=all");
   m_dpt_path_nodes.clear();
-  for (auto const& kv : js.get_child("entry_list")) {
-  auto const& val = kv.second;
-  string parent_path = path(
-    val.get<string>("entry_path")
-  ).parent_path().string();
-  if (m_dpt_path_nodes.find(parent_path)
-      == m_dpt_path_nodes.end())
-  {
-    m_dpt_path_nodes[parent_path] = make_shared<DNode>();
+  m_resolved_nodes.clear();
+  m_dpt_arena = make_shared<DArena>();
+  m_dpt_content_nodes.clear();
+  m_dpt_content_paths.clear();
+  forEachDptEntry([this](Json const& val) {
+    string parent_path = path(
+      val.get<string>("entry_path")
+    ).parent_path().string();
+    if (m_dpt_path_nodes.find(parent_path)
+        == m_dpt_path_nodes.end())
+    {
+      m_dpt_path_nodes[parent_path] = makeNode(m_dpt_arena);
+      auto parent = m_dpt_path_nodes[parent_path];
+      assert(parent);
+    }
     auto parent = m_dpt_path_nodes[parent_path];
     assert(parent);
-  }
-  auto parent = m_dpt_path_nodes[parent_path];
-  assert(parent);
-  string self_path = val.get<string>("entry_path");
-  if (m_dpt_path_nodes.find(self_path) == m_dpt_path_nodes.end()) {
-    m_dpt_path_nodes[self_path] = make_shared<DNode>();
-  }
-  auto self = m_dpt_path_nodes[self_path];
-  parent->addChild(self);
-  /* must set all self's properties here */
-  self->setId(val.get<string>("entry_id"));
-  self->setFilename(val.get<string>("entry_name"));
-  self->setIsDir(val.get<string>("entry_type") == "folder");
-  self->setPath(val.get<string>("entry_path"));
-  if (self->isDir()) {
-    self->setRev("folder");
-  } else {
-    self->setFilesize(val.get<size_t>("file_size"));
-    self->setRev(val.get<string>("file_revision"));
-    self->setIsNote(val.get<string>("document_type") == "note");
-  }
-  /* get relpath */
-  path::iterator p = self->path().begin();
-  path relpath;
-  for (p++; p != self->path().end(); p++) {
-    relpath /= *p;
-  }
-  self->setRelPath(relpath);
-  }
+    string self_path = val.get<string>("entry_path");
+    if (m_dpt_path_nodes.find(self_path) == m_dpt_path_nodes.end()) {
+      m_dpt_path_nodes[self_path] = makeNode(m_dpt_arena);
+    }
+    auto self = m_dpt_path_nodes[self_path];
+    parent->addChild(self);
+    /* must set all self's properties here */
+    self->setId(val.get<string>("entry_id"));
+    self->setFilename(val.get<string>("entry_name"));
+    self->setIsDir(val.get<string>("entry_type") == "folder");
+    self->setPath(val.get<string>("entry_path"));
+    if (self->isDir()) {
+      self->setRev("folder");
+    } else {
+      self->setFilesize(val.get<size_t>("file_size"));
+      self->setRev(val.get<string>("file_revision"));
+      self->setIsNote(val.get<string>("document_type") == "note");
+    }
+    /* get relpath */
+    path::iterator p = self->path().begin();
+    path relpath;
+    for (p++; p != self->path().end(); p++) {
+      relpath /= *p;
+    }
+    self->setRelPath(relpath);
+  });
   m_dpt_tree = m_dpt_path_nodes["Document"];
   m_dpt_tree->setIsDir(true);
   m_dpt_tree->setId("root");
   m_dpt_tree->setFilename("Document");
   m_dpt_tree->setPath("Document");
   m_dpt_tree->setRelPath("");
+  m_dpt_tree->sortChildren();
   /* build revision node map */
   m_dpt_revision_nodes.clear();
   for (auto const& kv : m_dpt_path_nodes) {
   m_dpt_revision_nodes[kv.second->rev()] = kv.second;
   }
+  auto listing = takeListing(m_dpt_path_nodes);
+  std::lock_guard<std::mutex> lock(m_listing_mutex);
+  m_dpt_listing = std::move(listing);
 }
 
 void Dpt::updateLocalTree()
 {
   assert(is_directory(m_sync_dir));
   m_local_path_nodes.clear();
-  m_local_tree = make_shared<DNode>();
+  m_local_empty_dirs.clear();
+  m_local_arena = make_shared<DArena>();
+  m_local_tree = makeNode(m_local_arena);
   updateLocalNode(m_local_tree, m_sync_dir);
+  m_local_tree->sortChildren();
   /* build revision node map */
   m_local_revision_nodes.clear();
   for (auto const& kv : m_local_path_nodes) {
   m_local_revision_nodes[kv.second->rev()] = kv.second;
   }
+  auto listing = takeListing(m_local_path_nodes);
+  std::lock_guard<std::mutex> lock(m_listing_mutex);
+  m_local_listing = std::move(listing);
+}
+
+shared_ptr<ListingSnapshot const> Dpt::dptListing() const
+{
+  std::lock_guard<std::mutex> lock(m_listing_mutex);
+  return m_dpt_listing;
+}
+
+shared_ptr<ListingSnapshot const> Dpt::localListing() const
+{
+  std::lock_guard<std::mutex> lock(m_listing_mutex);
+  return m_local_listing;
 }
 
 void Dpt::updateLocalNode(
@@ -418,6 +798,9 @@ void Dpt::updateLocalNode(
   node->setRev(dpt::md5(node->path()));
   if (is_directory(local_path)) {
     node->setIsDir(true);
+    if (directory_iterator(local_path) == directory_iterator()) {
+      m_local_empty_dirs.push_back(relpath);
+    }
     for (auto const& i : directory_iterator(local_path)) {
       /* ignore hidden files */
       if (i.path().filename().string()[0] == '.') {
@@ -427,7 +810,7 @@ void Dpt::updateLocalNode(
       if (is_regular_file(i) && i.path().extension() != ".pdf") {
         continue;
       }
-      auto child = make_shared<DNode>();
+      auto child = makeNode(m_local_arena);
       ifstream inf(i.path().c_str(), ios_base::binary|ios_base::in);
       child->setFilesize(readLocalFilesize(inf));
       node->addChild(child);
@@ -453,27 +836,22 @@ void Dpt::moveBetweenDpt(path const& source, path const& dest)
     << "moving dpt~>dpt: "
     << source << " ~> " << dest << endl;
   #endif
+  forgetResolvedPath(source);
+  forgetResolvedPath(dest);
   shared_ptr<DNode const> source_node =
     m_dpt_path_nodes[source.string()];
   shared_ptr<DNode const> dest_parent_node =
     m_dpt_path_nodes[dest.parent_path().string()];
   if (source_node->isDir()) {
-    Json js;
-    js.put("parent_folder_id", dest_parent_node->id());
-    js.put("folder_name", dest.filename().string());
-    auto resp = sendJson("PUT",
-      "/folder2/" + source_node->id(),
-      js
-    );
+    FoldersFolderIdPutRequest2 update;
+    update.parent_folder_id = dest_parent_node->id();
+    update.folder_name = dest.filename().string();
+    api().folders2FolderIdPut(source_node->id(), update);
   } else {
-    Json js;
-    js.put("parent_folder_id", dest_parent_node->id());
-    js.put("file_name", dest.filename().string());
-    auto resp = sendJson(
-      "PUT",
-      "/documents2/" + source_node->id(),
-      js
-    );
+    DocumentsDocumentIdPutRequest2 update;
+    update.parent_folder_id = dest_parent_node->id();
+    update.file_name = dest.filename().string();
+    api().documents2DocumentIdPut(source_node->id(), update);
   }
 }
 
@@ -528,30 +906,21 @@ void Dpt::copyBetweenDpt(path const& source, path const& dest)
       #if DEBUG_FILE_IO
       logger() << "creating dpt directory: " << n_dest_path << endl;
       #endif
-      Json js;
-      Json doc_copy_info;
-      js.put("parent_folder_id", dest_parent_node->id());
-      doc_copy_info.put("parent_folder_id", dest_parent_node->id());
-      js.add_child("doc_copy_info", doc_copy_info);
-      auto resp = sendJson("POST", "folders2", js);
+      FoldersPostRequest2 folder;
+      folder.parent_folder_id = dest_parent_node->id();
+      folder.folder_name = n_dest_path.filename().string();
+      auto resp = api().folders2Post(folder);
       shared_ptr<DNode> new_node = make_shared<DNode>();
-      new_node->setId(resp.get<string>("folder_id"));
+      new_node->setId(resp.folder_id);
       m_dpt_path_nodes[n_dest_path.string()] = new_node;
     } else {
       /* process file */
       #if DEBUG_FILE_IO
       logger() << "copying dpt file: " << n_dest_path << endl;
       #endif
-      Json js;
-      Json doc_copy_info;
-      js.put("parent_folder_id", dest_parent_node->id());
-      doc_copy_info.put("parent_folder_id", dest_parent_node->id());
-      js.add_child("doc_copy_info", doc_copy_info);
-      auto resp = sendJson(
-        "POST",
-        "/documents/" + n->id() + "/copy",
-        js
-      );
+      DocumentsDocumentIdCopyPostRequest copy;
+      copy.parent_folder_id = dest_parent_node->id();
+      api().documentsDocumentIdCopyPost(n->id(), copy);
     }
   }
 }
@@ -604,21 +973,16 @@ void Dpt::copyBetweenLocal(path const& source, path const& dest)
 
 vector<path> Dpt::dptOpenDocuments() const
 {
-  auto resp = sendJson("GET", "/viewer/status/current_viewing");
+  auto resp = api().viewerStatusCurrentViewingGet();
   vector<path> rtv;
-  for (auto js : resp.get_child("views")) {
-    rtv.push_back(path(js.second.get<string>("entry_path")));
+  for (auto const& view : resp.views) {
+    rtv.push_back(path(view.entry_path));
   }
   return rtv;
 }
 
-void Dpt::computeSyncFiles()
+void Dpt::clearSyncPlan()
 {
-  /* The following conditions must hold:
-    - revision must be unique for each different file
-    - revision must change if the file is modified
-    - revision must stay the same when the file is moved
-  */
   m_prepared_overwrite_to_dpt.clear();
   m_prepared_overwrite_from_dpt.clear();
   m_prepared_local_delete.clear();
@@ -631,7 +995,23 @@ void Dpt::computeSyncFiles()
   m_dpt_only_nodes.clear();
   m_moved_nodes.clear();
   m_modified_nodes.clear();
+  m_local_renames.clear();
+}
+
+void Dpt::computeSyncFiles()
+{
+  clearSyncPlan();
   computeSyncFilesInNode(m_local_tree, m_dpt_tree);
+  planSyncFiles();
+}
+
+void Dpt::planSyncFiles()
+{
+  /* The following conditions must hold:
+    - revision must be unique for each different file
+    - revision must change if the file is modified
+    - revision must stay the same when the file is moved
+  */
   /* now try to match some only_local and only_dpt nodes */
   vector<shared_ptr<DNode const>> unmatchable_local_nodes;
   vector<shared_ptr<DNode const>> unmatchable_dpt_nodes;
@@ -643,6 +1023,11 @@ void Dpt::computeSyncFiles()
     if (! db_row.empty()) {
       rpath prevpath = db_row[RelPath];
       prevpaths__nodes[prevpath.string()] = local_node;
+      if (prevpath != local_node->relPath()) {
+        m_local_renames.push_back(
+          make_pair(prevpath, local_node->relPath())
+        );
+      }
     }
   }
   for (auto const dpt_node : m_dpt_only_nodes) {
@@ -691,7 +1076,7 @@ void Dpt::computeSyncFiles()
       /* if local file was not seen before */
       m_prepared_local_new.push_back(local);
     } else {
-      if (db_row[LocalRev] == local->rev()) {
+      if (local->hasRev(db_row[LocalRev])) {
         /* if local file was seen before, unmodified,
           and dpt file is not found */
         m_prepared_local_delete.push_back(local);
@@ -718,7 +1103,7 @@ void Dpt::computeSyncFiles()
       /* if dpt file was not seen before */
       m_prepared_dpt_new.push_back(dpt);
     } else {
-      if (db_row[DptRev] == dpt->rev()) {
+      if (dpt->hasRev(db_row[DptRev])) {
         /* if dpt file was seen before, unmodified,
           and dpt file is not found*/
         m_prepared_dpt_delete.push_back(dpt);
@@ -778,12 +1163,12 @@ void Dpt::computeSyncFiles()
       #if DEBUG_CONFLICT
         logger() << "relpath found in db" << endl;
       #endif
-      if (db_row[LocalRev] == local->rev())
+      if (local->hasRev(db_row[LocalRev]))
       {
         #if DEBUG_CONFLICT
           logger() << "local version unchanged" << endl;
         #endif
-        if (db_row[DptRev] == dpt->rev())
+        if (dpt->hasRev(db_row[DptRev]))
         {
           #if DEBUG_CONFLICT
             logger() << "dpt version unchanged" << endl;
@@ -837,7 +1222,7 @@ void Dpt::computeSyncFiles()
         #if DEBUG_CONFLICT
           logger() << "local version has been modified" << endl;
         #endif
-        if (db_row[DptRev] == dpt->rev())
+        if (dpt->hasRev(db_row[DptRev]))
         {
           #if DEBUG_CONFLICT
             logger() << "dpt version unchanged" << endl;
@@ -892,54 +1277,299 @@ void Dpt::computeSyncFiles()
   }
 }
 
-void Dpt::updateRevDB()
+void Dpt::setDiffMemoryBudget(size_t bytes) noexcept
 {
-  m_rev_db.reset();
-  updateRevForNode(m_local_tree, m_dpt_tree);
+  m_diff_memory_budget = bytes;
 }
 
-void Dpt::updateRevForNode(
-  shared_ptr<DNode const> local,
-  shared_ptr<DNode const> dpt
+void Dpt::listLocalEntries(
+  path const& local_path,
+  string const& relpath,
+  DEntrySorter& sorter
 )
 {
-  assert(local->isDir() == dpt->isDir());
-  assert(local->relPath() == dpt->relPath());
-  m_rev_db.putRev(local->relPath(), local->rev(), dpt->rev());
-  if (local->isDir()) {
-    vector<shared_ptr<DNode>> only_local;
-    vector<shared_ptr<DNode>> only_dpt;
-    vector<pair<shared_ptr<DNode>,shared_ptr<DNode>>> both;
-    symmetricDiff(
-      local->children(),
-      dpt->children(),
-      only_local,
-      only_dpt,
-    both);
-    if (! (only_local.empty() && only_dpt.empty())) {
-      logger() << "only_local: ";
-      for (auto const& i : only_local) {
-        logger() << "(" << i->filename() << ") ";
-      }
-      logger() << endl;
-      logger() << "only_dpt: ";
-      for (auto const& i : only_dpt) {
-        logger() << "(" << i->filename() << ") ";
-        }
-      logger() << endl;
-      logger() << "both: ";
-      for (auto const& i : both) {
-        logger() << "(" << i.first->filename() << ") ";
-      }
-      logger() << endl;
-      throw "local tree and dpt tree are not identical";
-    }
-    /* for dirs & files that exist at both ends */
-    for (auto const& i : both) {
-      auto const& local_node = i.first;
-      auto const& dpt_node = i.second;
-      updateRevForNode(local_node, dpt_node);
-    }
+  /* same files as updateLocalNode looks at */
+  if (directory_iterator(local_path) == directory_iterator()) {
+    m_local_empty_dirs.push_back(relpath);
+  }
+  for (auto const& i : directory_iterator(local_path)) {
+    string const name = i.path().filename().string();
+    if (name[0] == '.') {
+      continue;
+    }
+    bool const is_dir = is_directory(i.path());
+    if (! is_dir && i.path().extension() != ".pdf") {
+      continue;
+    }
+    DEntry entry;
+    entry.rel_path = relpath.empty() ? name : relpath + "/" + name;
+    entry.is_dir = is_dir;
+    entry.rev = dpt::md5(i.path());
+    entry.last_modified_time = last_write_time(i.path());
+    if (! is_dir) {
+      ifstream inf(i.path().c_str(), ios_base::binary|ios_base::in);
+      entry.filesize = readLocalFilesize(inf);
+    }
+    string const child_relpath = entry.rel_path;
+    sorter.push(std::move(entry));
+    if (is_dir) {
+      listLocalEntries(i.path(), child_relpath, sorter);
+    }
+  }
+}
+
+void Dpt::listDptEntries(DEntrySorter& sorter)
+{
+  forEachDptEntry([&sorter](Json const& val) {
+    path const entry_path = val.get<string>("entry_path");
+    /* strip Document/ */
+    path relpath;
+    for (auto p = ++entry_path.begin(); p != entry_path.end(); p++) {
+      relpath /= *p;
+    }
+    if (relpath.empty()) {
+      return;
+    }
+    DEntry entry;
+    entry.rel_path = relpath.generic_string();
+    entry.id = val.get<string>("entry_id");
+    entry.is_dir = val.get<string>("entry_type") == "folder";
+    if (entry.is_dir) {
+      entry.rev = "folder";
+    } else {
+      entry.filesize = val.get<size_t>("file_size");
+      entry.rev = val.get<string>("file_revision");
+      entry.is_note = val.get<string>("document_type") == "note";
+    }
+    sorter.push(std::move(entry));
+  });
+}
+
+shared_ptr<DNode> Dpt::addStreamedNode(
+  DEntry const& entry,
+  path const& root,
+  shared_ptr<DArena> const& arena,
+  unordered_map<string,shared_ptr<DNode>>& nodes
+)
+{
+  path const p = root / entry.rel_path;
+  auto node = makeNode(arena);
+  node->setPath(p);
+  node->setRelPath(entry.rel_path);
+  node->setFilename(p.filename().string());
+  node->setId(entry.id);
+  node->setRev(entry.rev);
+  node->setIsDir(entry.is_dir);
+  node->setIsNote(entry.is_note);
+  node->setFilesize(entry.filesize);
+  node->setLastModifiedTime(entry.last_modified_time);
+  nodes[p.string()] = node;
+  /* folders are always kept and come before their contents */
+  auto const parent = nodes.find(p.parent_path().string());
+  assert(parent != nodes.end());
+  parent->second->addChild(node);
+  return node;
+}
+
+void Dpt::computeSyncFilesStreaming()
+{
+  clearSyncPlan();
+  path const spill_dir = m_sync_dir / ".app";
+  DEntrySorter local(m_diff_memory_budget / 2, spill_dir);
+  DEntrySorter dpt(m_diff_memory_budget / 2, spill_dir);
+  m_local_empty_dirs.clear();
+  listLocalEntries(m_sync_dir, "", local);
+  listDptEntries(dpt);
+  /* keep only the roots, folders and what differs */
+  m_local_path_nodes.clear();
+  m_dpt_path_nodes.clear();
+  m_dpt_content_nodes.clear();
+  m_dpt_content_paths.clear();
+  m_local_arena = make_shared<DArena>();
+  m_dpt_arena = make_shared<DArena>();
+  m_local_tree = makeNode(m_local_arena);
+  m_local_tree->setIsDir(true);
+  m_local_tree->setPath(m_sync_dir);
+  m_local_tree->setRelPath("");
+  m_local_tree->setFilename(m_sync_dir.filename().string());
+  m_local_path_nodes[m_sync_dir.string()] = m_local_tree;
+  m_dpt_tree = makeNode(m_dpt_arena);
+  m_dpt_tree->setIsDir(true);
+  m_dpt_tree->setId("root");
+  m_dpt_tree->setFilename("Document");
+  m_dpt_tree->setPath("Document");
+  m_dpt_tree->setRelPath("");
+  m_dpt_path_nodes["Document"] = m_dpt_tree;
+  /* three-way merge join of local, dpt and RevDB by path */
+  auto db = m_rev_db.sorted();
+  DEntry l, d;
+  vector<string> r;
+  bool has_l = local.next(&l);
+  bool has_d = dpt.next(&d);
+  bool has_r = db->next(&r);
+  while (has_l || has_d) {
+    string const key =
+      ! has_d || (has_l && ! pathLess(d.rel_path, l.rel_path))
+        ? l.rel_path
+        : d.rel_path;
+    while (has_r && pathLess(r[RelPath], key)) {
+      has_r = db->next(&r);
+    }
+    bool const in_l = has_l && l.rel_path == key;
+    bool const in_d = has_d && d.rel_path == key;
+    bool const in_r = has_r && r[RelPath] == key;
+    if (in_l && in_d) {
+      assert(l.is_dir == d.is_dir);
+      bool const unchanged =
+        in_r && r[LocalRev] == l.rev && r[DptRev] == d.rev;
+      if (l.is_dir || ! unchanged) {
+        auto local_node =
+          addStreamedNode(l, m_sync_dir, m_local_arena, m_local_path_nodes);
+        auto dpt_node =
+          addStreamedNode(d, "Document", m_dpt_arena, m_dpt_path_nodes);
+        if (! l.is_dir) {
+          m_modified_nodes.push_back(make_pair(local_node, dpt_node));
+        }
+      }
+    } else if (in_l) {
+      auto local_node =
+        addStreamedNode(l, m_sync_dir, m_local_arena, m_local_path_nodes);
+      /* only the topmost node of a local-only subtree is reported */
+      path const dpt_parent = ("Document" / path(key)).parent_path();
+      if (m_dpt_path_nodes.count(dpt_parent.string())) {
+        m_local_only_nodes.push_back(local_node);
+      }
+    } else {
+      auto dpt_node =
+        addStreamedNode(d, "Document", m_dpt_arena, m_dpt_path_nodes);
+      path const local_parent = (m_sync_dir / key).parent_path();
+      if (m_local_path_nodes.count(local_parent.string())) {
+        m_dpt_only_nodes.push_back(dpt_node);
+      }
+    }
+    if (in_l) {
+      has_l = local.next(&l);
+    }
+    if (in_d) {
+      has_d = dpt.next(&d);
+    }
+  }
+  planSyncFiles();
+}
+
+void Dpt::updateRevDBStreaming()
+{
+  path const spill_dir = m_sync_dir / ".app";
+  DEntrySorter local(m_diff_memory_budget / 2, spill_dir);
+  DEntrySorter dpt(m_diff_memory_budget / 2, spill_dir);
+  m_local_empty_dirs.clear();
+  listLocalEntries(m_sync_dir, "", local);
+  listDptEntries(dpt);
+  m_rev_db.reset();
+  DEntry l, d;
+  bool has_l = local.next(&l);
+  bool has_d = dpt.next(&d);
+  vector<string> only_local;
+  vector<string> only_dpt;
+  while (has_l || has_d) {
+    if (has_l && has_d && l.rel_path == d.rel_path) {
+      m_rev_db.putRev(
+        l.rel_path,
+        l.rev,
+        d.rev,
+        l.is_dir ? "" : localBlobId(l.rel_path, l.rev)
+      );
+      has_l = local.next(&l);
+      has_d = dpt.next(&d);
+    } else if (! has_d || (has_l && pathLess(l.rel_path, d.rel_path))) {
+      only_local.push_back(l.rel_path);
+      has_l = local.next(&l);
+    } else {
+      only_dpt.push_back(d.rel_path);
+      has_d = dpt.next(&d);
+    }
+  }
+  if (! (only_local.empty() && only_dpt.empty())) {
+    logger() << "only_local: ";
+    for (auto const& i : only_local) {
+      logger() << "(" << i << ") ";
+    }
+    logger() << endl;
+    logger() << "only_dpt: ";
+    for (auto const& i : only_dpt) {
+      logger() << "(" << i << ") ";
+    }
+    logger() << endl;
+    throw "local tree and dpt tree are not identical";
+  }
+}
+
+string Dpt::localBlobId(rpath const& relpath, string const& local_md5) const
+{
+  if (! m_git) {
+    return "";
+  }
+  /* only files that changed since the last sync are hashed */
+  string rtv = m_rev_db.previousGitOid(relpath, local_md5);
+  if (rtv.empty()) {
+    rtv = m_git->blobId(m_sync_dir / relpath);
+  }
+  return rtv;
+}
+
+void Dpt::updateRevDB()
+{
+  m_rev_db.reset();
+  updateRevForNode(m_local_tree, m_dpt_tree);
+}
+
+void Dpt::updateRevForNode(
+  shared_ptr<DNode const> local,
+  shared_ptr<DNode const> dpt
+)
+{
+  assert(local->isDir() == dpt->isDir());
+  assert(local->relPath() == dpt->relPath());
+  m_rev_db.putRev(
+    local->relPath(),
+    local->rev(),
+    dpt->rev(),
+    local->isDir() ? "" : localBlobId(local->relPath(), local->rev())
+  );
+  if (local->isDir()) {
+    vector<shared_ptr<DNode>> only_local;
+    vector<shared_ptr<DNode>> only_dpt;
+    vector<pair<shared_ptr<DNode>,shared_ptr<DNode>>> both;
+    symmetricDiff(
+      local->children(),
+      dpt->children(),
+      only_local,
+      only_dpt,
+    both);
+    if (! (only_local.empty() && only_dpt.empty())) {
+      logger() << "only_local: ";
+      for (auto const& i : only_local) {
+        logger() << "(" << i->filename() << ") ";
+      }
+      logger() << endl;
+      logger() << "only_dpt: ";
+      for (auto const& i : only_dpt) {
+        logger() << "(" << i->filename() << ") ";
+        }
+      logger() << endl;
+      logger() << "both: ";
+      for (auto const& i : both) {
+        logger() << "(" << i.first->filename() << ") ";
+      }
+      logger() << endl;
+      throw "local tree and dpt tree are not identical";
+    }
+    /* for dirs & files that exist at both ends */
+    for (auto const& i : both) {
+      auto const& local_node = i.first;
+      auto const& dpt_node = i.second;
+      updateRevForNode(local_node, dpt_node);
+    }
   }
 }
 
@@ -985,7 +1615,8 @@ void Dpt::computeSyncFilesInNode(
 
 size_t Dpt::bisectDptFileBytes(
   shared_ptr<DNode const> node,
-  istream& local
+  istream& local,
+  vector<uint8_t> const& head
 ) const
 {
   #if DEBUG_FILE_IO
@@ -999,9 +1630,10 @@ size_t Dpt::bisectDptFileBytes(
   while (i < j) {
     int k = (i+j)/2;
     auto const local_bytes = readLocalFileBytes(local, k, 1);
-    auto const dpt_bytes = readDptFileBytes(node, k, 1);
     char b1 = local_bytes->operator[](0);
-    char b2 = dpt_bytes->operator[](0);
+    char b2 = static_cast<size_t>(k) < head.size()
+      ? head[k]
+      : readDptFileBytes(node, k, 1)->operator[](0);
     if (b1 == b2) {
       if (k <= i) {
         break;
@@ -1056,8 +1688,11 @@ void Dpt::overwriteFromDpt(path const& source, path const& dest)
       create_directory(n_dest_path);
     } else {
       /* process file */
-      size_t const dpt_filesize = readDptFilesize(n);
       size_t const KB = 1024; // 1MB in bytes
+      /* the first range tells the size, and saves the bisection
+        below requests for the bytes it covers */
+      auto const head = readDptFileHead(n, 128*KB);
+      size_t const dpt_filesize = n->filesize();
       /* if local file exists, then bisect for the first byte two
         files diverse, and only download the different part */
       shared_ptr<LNode> local_node;
@@ -1087,7 +1722,7 @@ void Dpt::overwriteFromDpt(path const& source, path const& dest)
       if (! n->isNote()) {
         // get where the difference starts
         // doesn't quite work with notes
-        offset = bisectDptFileBytes(n, iof);
+        offset = bisectDptFileBytes(n, iof, *head);
       }
       #if DEBUG_FILE_IO
         logger()
@@ -1096,12 +1731,29 @@ void Dpt::overwriteFromDpt(path const& source, path const& dest)
           << std::hex << offset << std::dec
           << "): " << n_dest_path << endl;
       #endif
+      /* hash the file for git while writing it */
+      unique_ptr<GitBlobStream> blob;
+      rpath relpath;
+      if (m_git && inSyncDir(n_dest_path, &relpath)) {
+        blob = m_git->blobStream();
+        /* the unchanged prefix is not downloaded, take it from disk */
+        for (size_t i = 0; i < offset; i += 128*KB) {
+          auto const prefix =
+            readLocalFileBytes(iof, i, min(128*KB, offset - i));
+          blob->write(prefix->data(), prefix->size());
+        }
+      }
 
       iof.seekp(offset, ios_base::beg);
       while (offset < dpt_filesize) {
-        auto const data = readDptFileBytes(n, offset, 128*KB);
+        auto const data = offset < head->size()
+          ? make_shared<vector<uint8_t>>(head->begin() + offset, head->end())
+          : readDptFileBytes(n, offset, 128*KB);
         size_t const bytes = data->size();
         iof.write(reinterpret_cast<char*>(data->data()), bytes);
+        if (blob) {
+          blob->write(data->data(), bytes);
+        }
         offset = min(offset+bytes, dpt_filesize);
         int percentage = (offset*100)/dpt_filesize;
         m_messager(
@@ -1123,11 +1775,18 @@ void Dpt::overwriteFromDpt(path const& source, path const& dest)
         #if DEBUG_FILE_IO
           logger() << "padding zeros..." << endl;
         #endif
+        if (blob) {
+          vector<char> const zeros(local_filesize - offset, '\0');
+          blob->write(zeros.data(), zeros.size());
+        }
         while (offset < local_filesize) {
           iof.put('\0');
           offset++;
         }
       }
+      if (blob) {
+        m_transferred_blobs.push_back(make_pair(relpath, blob->commit()));
+      }
       #if DEBUG_FILE_IO
         logger() << "done writing file" << endl;
       #endif
@@ -1135,25 +1794,238 @@ void Dpt::overwriteFromDpt(path const& source, path const& dest)
   }
 }
 
+void Dpt::backupFromDpt(
+  shared_ptr<DNode const> source,
+  vector<pair<rpath,git_oid>>& blobs
+)
+{
+  /* collect the blobs of all files under source, files whose
+    content is already in git are not downloaded again */
+  std::queue<shared_ptr<DNode const>> que;
+  que.push(source);
+  while (! que.empty()) {
+    shared_ptr<DNode const> n = que.front();
+    que.pop();
+    if (n->isDir()) {
+      for (shared_ptr<DNode> c : n->children()) {
+        que.push(c);
+      }
+      if (n->children().empty()) {
+        /* git does not track emtpy dirs */
+        string const keep = "1\n";
+        blobs.push_back(make_pair(
+          n->relPath() / ".gitkeep",
+          m_git->writeBlob(keep.data(), keep.size())
+        ));
+      }
+      continue;
+    }
+    /* RevDB knows the blob of a dpt revision seen before, which
+      the post-sync checkpoint committed */
+    vector<string> db_row = m_rev_db.getByDptRev(n->rev());
+    git_oid oid;
+    if (! db_row.empty() && m_git->hasBlob(db_row[GitOid], &oid))
+    {
+      #if DEBUG_FILE_IO
+        logger()
+          << "reusing git blob "
+          << git_oid_tostr_s(&oid) << ": " << n->relPath() << endl;
+      #endif
+    } else {
+      oid = downloadDptBlob(m_dpt_path_nodes[n->path().string()]);
+    }
+    blobs.push_back(make_pair(n->relPath(), oid));
+  }
+}
+
+git_oid Dpt::downloadDptBlob(shared_ptr<DNode> n)
+{
+  #if DEBUG_FILE_IO
+    logger() << "downloading dpt file into git: " << n->path() << endl;
+  #endif
+  auto blob = m_git->blobStream();
+  downloadDptFile(n, [&blob](uint8_t const* data, size_t size) {
+    blob->write(data, size);
+  });
+  return blob->commit();
+}
+
+void Dpt::downloadDptFile(
+  shared_ptr<DNode> n,
+  std::function<void(uint8_t const*, size_t)> const& write
+)
+{
+  size_t const KB = 1024;
+  /* the first range tells the size */
+  auto data = readDptFileHead(n, 128*KB);
+  size_t const dpt_filesize = n->filesize();
+  size_t offset = 0;
+  while (offset < dpt_filesize) {
+    if (offset > 0) {
+      data = readDptFileBytes(n, offset, 128*KB);
+    }
+    write(data->data(), data->size());
+    offset = min(offset+data->size(), dpt_filesize);
+    int percentage = (offset*100)/dpt_filesize;
+    m_messager(
+      "Backing up "
+        + n->filename()
+        + " " + to_string(percentage) + "%"
+    );
+  }
+}
+
+namespace {
+  /* where dpt files wait to be recorded by Dpt::m_dpt_snapshot */
+  path dptBackupStaging(path const& sync_dir)
+  {
+    return sync_dir / ".app" / "dpt-backup";
+  }
+}
+
+void Dpt::backupToDptSnapshot(vector<shared_ptr<DNode const>> const& sources)
+{
+  /* download into a staging dir, which the snapshot then records;
+    only the downloaded paths are looked at, the rest is carried
+    over from earlier backups */
+  path const staging = dptBackupStaging(m_sync_dir);
+  boost::filesystem::remove_all(staging);
+  boost::filesystem::create_directories(staging);
+  vector<rpath> paths;
+  ostringstream status;
+  std::queue<shared_ptr<DNode const>> que;
+  for (auto const& source : sources) {
+    que.push(source);
+  }
+  while (! que.empty()) {
+    shared_ptr<DNode const> n = que.front();
+    que.pop();
+    if (n->isDir()) {
+      for (shared_ptr<DNode> c : n->children()) {
+        que.push(c);
+      }
+      continue;
+    }
+    path const dest = staging / n->relPath();
+    boost::filesystem::create_directories(dest.parent_path());
+    ofstream of(dest.string(), ios_base::binary|ios_base::out|ios_base::trunc);
+    downloadDptFile(
+      m_dpt_path_nodes[n->path().string()],
+      [&of](uint8_t const* data, size_t size) {
+        of.write(reinterpret_cast<char const*>(data), size);
+      }
+    );
+    of.close();
+    if (! of) {
+      throw "cannot write dpt backup";
+    }
+    paths.push_back(n->relPath());
+    status << "backup: " << n->relPath().generic_string() << endl;
+  }
+  if (! paths.empty()) {
+    m_dpt_snapshot->checkpoint(
+      "<dpt pre-sync checkpoint>\n\n" + status.str(),
+      paths
+    );
+  }
+  boost::filesystem::remove_all(staging);
+}
+
+namespace {
+  /* header names are case insensitive */
+  string responseHeader(DptResponse const& response, string const& name)
+  {
+    for (auto const& kv : response.headerMap()) {
+      if (boost::iequals(kv.first, name)) {
+        return kv.second;
+      }
+    }
+    return "";
+  }
+}
+
 shared_ptr<vector<uint8_t>> Dpt::readDptFileBytes(
   shared_ptr<DNode const> n,
   size_t offset,
-  size_t size
+  size_t size,
+  size_t* filesize
 ) const
 {
   /* handle interrupt for lengthy operation */
-  if (dpt::interrupt_flag) {
-    throw SyncInterrupted();
-  }
+  cancellation()->throwIfCancelled();
   auto request = httpRequest("/documents/" + n->id() + "/file");
   request->setMethod("GET");
   request->headerMap()["Range"] =
     "bytes=" + to_string(offset) + "-" + to_string(offset+size-1);
-  auto response = sendRequest(request);
+  auto response = performRequest(request);
+  auto const status = response->statusCode();
+  /* a range past the end, eg, of an empty file, still tells the
+    size of the file */
+  if (
+    filesize
+      && status == nativeformat::http::StatusCodeRequestRangeUnsatisfied
+  )
+  {
+    if (
+      ! parseContentRange(
+        responseHeader(*response, "Content-Range"),
+        filesize
+      )
+    )
+    {
+      throw "bad content range";
+    }
+    return make_shared<vector<uint8_t>>();
+  }
+  if (status / 100 != 2) {
+    logger()
+      << "Received error response: "
+      << response->serialise()
+      << endl;
+    throw "request failure";
+  }
   size_t bytes;
   unsigned char const* data = response->data(bytes);
-  auto const rtv = make_shared<vector<uint8_t>>(data, data+bytes);
-  assert(rtv->size() == bytes);
+  if (status == nativeformat::http::StatusCodePartialContent) {
+    if (
+      filesize
+        && ! parseContentRange(
+          responseHeader(*response, "Content-Range"),
+          filesize
+        )
+    )
+    {
+      throw "bad content range";
+    }
+    auto const rtv = make_shared<vector<uint8_t>>(data, data+bytes);
+    assert(rtv->size() == bytes);
+    return rtv;
+  }
+  /* the whole file, the range was ignored */
+  if (filesize) {
+    *filesize = bytes;
+  }
+  size_t const begin = min(offset, bytes);
+  size_t const end = min(offset + size, bytes);
+  return make_shared<vector<uint8_t>>(data + begin, data + end);
+}
+
+shared_ptr<vector<uint8_t>> Dpt::readDptFileHead(
+  shared_ptr<DNode> node,
+  size_t size
+)
+{
+  size_t filesize;
+  auto const rtv = readDptFileBytes(node, 0, size, &filesize);
+  if (filesize != node->filesize()) {
+    /* Sometimes DPT-RP1 lists a wrong filesize. Reading the file
+      forces it to update, so the revision is fetched again too. */
+    auto const doc = api().documentsDocumentIdGet(node->id());
+    if (doc.file_revision) {
+      node->setRev(*doc.file_revision);
+    }
+  }
+  node->setFilesize(filesize);
   return rtv;
 }
 
@@ -1175,15 +2047,17 @@ size_t dpt::readLocalFilesize(istream& inf)
   return inf.tellg();
 }
 
-size_t Dpt::readDptFilesize(shared_ptr<DNode> node)
+bool dpt::parseContentRange(string const& value, size_t* filesize)
 {
-  /* Sometimes DPT-RP1 reports wrong filesize initially. This looks
-    like a bug on DPT-RP1. We can force DPT-RP1 to update the file by
-    reading a random byte of the file */
-  readDptFileBytes(node, 0, 1);
-  Json json = sendJson("GET", "/documents/" + node->id());
-  node->setFilesize(json.get<size_t>("file_size"));
-  return node->filesize();
+  /* eg, bytes 0-99/1234, the range is an asterisk on a 416 */
+  size_t const slash = value.rfind('/');
+  if (value.compare(0, 6, "bytes ") != 0 || slash == string::npos) {
+    return false;
+  }
+  char const* begin = value.data() + slash + 1;
+  char const* end = value.data() + value.size();
+  auto const r = std::from_chars(begin, end, *filesize);
+  return r.ec == std::errc() && r.ptr == end && r.ptr != begin;
 }
 
 shared_ptr<vector<uint8_t>> dpt::readLocalFileBytes(
@@ -1243,27 +2117,56 @@ void Dpt::overwriteToDpt(path const& source, path const& dest) {
       new_node->setFilename(n_dest_path.filename().string());
       new_node->setIsDir(true);
       m_dpt_path_nodes[n_dest_path.string()] = new_node;
-      Json js;
-      js.put(
-        "parent_folder_id",
-        m_dpt_path_nodes[n_dest_path.parent_path().string()]->id()
-      );
-      js.put(
-        "folder_name",
-        n_dest_path.filename().string()
-      );
-      Json resp = sendJson("POST", "/folders2", js);
-      string new_id = resp.get<string>("folder_id");
-      new_node->setId(new_id);
+      FoldersPostRequest2 folder;
+      folder.parent_folder_id =
+        m_dpt_path_nodes[n_dest_path.parent_path().string()]->id();
+      folder.folder_name = n_dest_path.filename().string();
+      new_node->setId(api().folders2Post(folder).folder_id);
     } else {
       /* process file */
       ifstream infile(n.string(), ios_base::binary|ios_base::in);
       size_t const local_filesize = readLocalFilesize(infile);
       size_t const KB = 1024;
+      /* reuse the md5 computed by updateLocalTree if possible */
+      auto const local_node = m_local_path_nodes.find(n.string());
+      string const local_md5 =
+        local_node == m_local_path_nodes.end()
+          ? dpt::md5(n)
+          : local_node->second->rev();
       /* if local file exists, then bisect for the first byte two
         files diverse, and only download the different part */
       shared_ptr<DNode> dpt_node;
+      auto const same_content = m_dpt_content_nodes.find(local_md5);
       // if file exists
+      if (
+        m_dpt_path_nodes.find(n_dest_path.string())
+          == m_dpt_path_nodes.end()
+        && same_content != m_dpt_content_nodes.end()
+      )
+      {
+        /* the same content is already on dpt, duplicate it there
+          instead of uploading it again */
+        shared_ptr<DNode const> source_node = same_content->second;
+        #if DEBUG_FILE_IO
+          logger()
+            << "copying identical dpt file: "
+            << source_node->path() << " ~> " << n_dest_path << endl;
+        #endif
+        m_messager("Copying " + n_dest_path.filename().string());
+        DocumentsDocumentIdCopyPostRequest copy;
+        copy.parent_folder_id =
+          m_dpt_path_nodes[n_dest_path.parent_path().string()]->id();
+        copy.file_name = n_dest_path.filename().string();
+        auto resp = api().documentsDocumentIdCopyPost(source_node->id(), copy);
+        dpt_node = make_shared<DNode>();
+        dpt_node->setPath(n_dest_path.string());
+        dpt_node->setFilename(n_dest_path.filename().string());
+        dpt_node->setId(resp.document_id);
+        dpt_node->setIsDir(false);
+        dpt_node->setFilesize(source_node->filesize());
+        m_dpt_path_nodes[n_dest_path.string()] = dpt_node;
+        continue;
+      }
       if (
         m_dpt_path_nodes.find(n_dest_path.string())
         == m_dpt_path_nodes.end()
@@ -1273,24 +2176,22 @@ void Dpt::overwriteToDpt(path const& source, path const& dest) {
           logger()
             << "creating file on dpt: " << n_dest_path << endl;
         #endif
-        Json js;
-        js.put(
-          "parent_folder_id",
-          m_dpt_path_nodes[n_dest_path.parent_path().string()]->id()
-        );
-        js.put("file_name",
-          n_dest_path.filename().string()
-        );
-        Json resp = sendJson("POST", "/documents2", js);
+        DocumentsPostRequest2 doc;
+        doc.parent_folder_id =
+          m_dpt_path_nodes[n_dest_path.parent_path().string()]->id();
+        doc.file_name = n_dest_path.filename().string();
+        auto resp = api().documents2Post(doc);
         dpt_node = make_shared<DNode>();
         dpt_node->setPath(n_dest_path.string());
         dpt_node->setFilename(n_dest_path.filename().string());
-        dpt_node->setId(resp.get<string>("document_id"));
+        dpt_node->setId(resp.document_id);
         dpt_node->setIsDir(false);
         dpt_node->setFilesize(0);
         m_dpt_path_nodes[n_dest_path.string()] = dpt_node;
       }
       dpt_node = m_dpt_path_nodes[n_dest_path.string()];
+      /* the old content of dpt_node is about to be replaced */
+      forgetDptContent(dpt_node->path());
       /* partially write to file is not supported on DPT */
       size_t offset = 0;
       size_t const new_filesize = local_filesize;
@@ -1333,6 +2234,8 @@ void Dpt::overwriteToDpt(path const& source, path const& dest) {
         }
       }
       */
+      dpt_node->setFilesize(local_filesize);
+      rememberDptContent(local_md5, dpt_node);
       #if DEBUG_FILE_IO
         logger() << "done writing file" << endl;
       #endif
@@ -1348,9 +2251,7 @@ void Dpt::writeDptFileBytes(
 ) const
 {
   /* handle interrupt for lengthy operation */
-  if (dpt::interrupt_flag) {
-    throw SyncInterrupted();
-  }
+  cancellation()->throwIfCancelled();
   assert(total);
   assert(bytes->size());
   assert(offset + bytes->size() <= total);
@@ -1394,6 +2295,22 @@ void Dpt::syncAllFiles()
 {
   m_messager("Syncing Device Time...");
   syncTime();
+  updateDptContentIndex();
+  /* the index is only good for this sync, later uploads, eg,
+    dptQuickUploadAndOpen, must not copy documents deleted since */
+  try {
+    applySyncPlan();
+  } catch (...) {
+    m_dpt_content_nodes.clear();
+    m_dpt_content_paths.clear();
+    throw;
+  }
+  m_dpt_content_nodes.clear();
+  m_dpt_content_paths.clear();
+}
+
+void Dpt::applySyncPlan()
+{
   for (auto const& i : m_prepared_dpt_delete) {
     m_messager("Syncing " + i->filename()+ "...");
     deleteFromDpt(i->path());
@@ -1434,13 +2351,89 @@ void Dpt::syncAllFiles()
   }
 }
 
+bool Dpt::inSyncDir(path const& p, rpath* relpath) const
+{
+  if (m_sync_dir.empty()) {
+    return false;
+  }
+  auto i = p.begin();
+  for (auto const& c : m_sync_dir) {
+    if (i == p.end() || *i != c) {
+      return false;
+    }
+    i++;
+  }
+  relpath->clear();
+  while (i != p.end()) {
+    *relpath /= *i;
+    i++;
+  }
+  return ! relpath->empty();
+}
+
+void Dpt::updateDptContentIndex()
+{
+  /* RevDB remembers the local md5 of every dpt revision seen
+    in the last sync, so unchanged dpt files have known content */
+  m_dpt_content_nodes.clear();
+  m_dpt_content_paths.clear();
+  auto const local_revs = m_rev_db.localRevsByDptRev();
+  for (auto const& kv : m_dpt_path_nodes) {
+    auto const& node = kv.second;
+    if (node->isDir() || node->isNote() || node->rev().empty()) {
+      continue;
+    }
+    auto const local_rev = local_revs.find(node->rev());
+    if (local_rev != local_revs.end()) {
+      rememberDptContent(local_rev->second, node);
+    }
+  }
+}
+
+void Dpt::rememberDptContent(
+  string const& local_md5,
+  shared_ptr<DNode const> const& node
+)
+{
+  auto& indexed = m_dpt_content_nodes[local_md5];
+  if (indexed) {
+    m_dpt_content_paths.erase(indexed->path().string());
+  }
+  indexed = node;
+  m_dpt_content_paths[node->path().string()] = local_md5;
+}
+
+void Dpt::forgetDptContent(path const& dpt)
+{
+  auto forget = [this](map<string,string>::iterator i) {
+    m_dpt_content_nodes.erase(i->second);
+    return m_dpt_content_paths.erase(i);
+  };
+  auto const self = m_dpt_content_paths.find(dpt.string());
+  if (self != m_dpt_content_paths.end()) {
+    forget(self);
+  }
+  /* and everything under it */
+  string const prefix = dpt.string() + "/";
+  auto i = m_dpt_content_paths.lower_bound(prefix);
+  while (
+    i != m_dpt_content_paths.end()
+      && i->first.compare(0, prefix.size(), prefix) == 0
+  )
+  {
+    i = forget(i);
+  }
+}
+
 void Dpt::deleteFromDpt(path const& dpt)
 {
+  forgetDptContent(dpt);
+  forgetResolvedPath(dpt);
   auto const& node = m_dpt_path_nodes[dpt.string()];
   if (node->isDir()) {
-    sendJson("DELETE", "/folders/" + node->id());
+    api().foldersFolderIdDelete(node->id());
   } else {
-    sendJson("DELETE", "/documents/" + node->id());
+    api().documentsDocumentIdDelete(node->id());
   }
 }
 
@@ -1562,15 +2555,78 @@ void Dpt::reportComputedSyncFiles()
   }
 }
 
+vector<rpath> Dpt::syncedLocalPaths() const
+{
+  vector<rpath> paths;
+  for (auto const& i : m_prepared_local_delete) {
+    paths.push_back(i->relPath());
+  }
+  for (auto const& i : m_prepared_dpt_new) {
+    paths.push_back(i->relPath());
+  }
+  for (auto const& i : m_prepared_overwrite_from_dpt) {
+    paths.push_back(i->relPath());
+  }
+  for (auto const& i : m_prepared_local_move) {
+    paths.push_back(i.first->relPath());
+    paths.push_back(i.second->relPath());
+  }
+  for (auto const& d : m_local_empty_dirs) {
+    paths.push_back(d / ".gitkeep");
+  }
+  /* updateRevDB rewrites the database */
+  paths.push_back(".rev");
+  return paths;
+}
+
+namespace {
+  /* the token SIGINT cancels, a plain pointer so that the handler
+    only does lock free atomic operations */
+  std::atomic<CancellationToken*> sigint_token = nullptr;
+
+  /* Route SIGINT to a token while in scope */
+  class SigintCancels {
+  public:
+    SigintCancels(CancellationToken* token) : m_token(token)
+    {
+      sigint_token = token;
+      signal(SIGINT, [](int sig) {
+        if (SIGINT == sig) {
+          if (CancellationToken* t = sigint_token.load()) {
+            t->cancel();
+          }
+        }
+      });
+    }
+    ~SigintCancels()
+    {
+      /* unless another sync took over */
+      CancellationToken* expected = m_token;
+      sigint_token.compare_exchange_strong(expected, nullptr);
+    }
+    SigintCancels(SigintCancels const& other) = delete;
+    SigintCancels& operator=(SigintCancels const& other) = delete;
+  private:
+    CancellationToken* m_token;
+  };
+}
+
 void Dpt::safeSyncAllFiles(DryRunFlag dryrun)
 {
-  dpt::interrupt_flag = 0;
+  std::lock_guard<std::recursive_mutex> operation(m_operation_mutex);
+  std::lock_guard<std::mutex> lock(m_git_mutex);
+  OperationScope const scope(*this);
+  auto const cancellation = scope.token();
   {
     m_messager("Computing Differences...");
     dbOpen();
-    updateLocalTree();
-    updateDptTree();
-    computeSyncFiles();
+    if (m_diff_memory_budget) {
+      computeSyncFilesStreaming();
+    } else {
+      updateLocalTree();
+      updateDptTree();
+      computeSyncFiles();
+    }
     reportComputedSyncFiles();
     dbClose(); // git checkout would invalidate db connection
     // do not write to db if there's not change
@@ -1601,58 +2657,76 @@ void Dpt::safeSyncAllFiles(DryRunFlag dryrun)
         because otherwise if error happens git reset will cause
         user to lose data!
     */
-    m_git->checkout("master");
-    m_git->addAll();
-    string status = m_git->status();
-    m_git->commit("<local pre-sync checkpoint>\n\n" + status);
+    if (m_git) {
+      m_git->checkout("master");
+      /* git does not track empty dirs, mark the ones the listing
+        found; not before, a dry run leaves the folders alone */
+      m_git->insertGitKeepFiles(m_local_empty_dirs);
+    }
+    m_snapshot->checkpoint("<local pre-sync checkpoint>", m_local_renames);
   }
+  /* ctrl-c stops this sync, and no other */
+  SigintCancels sigint(cancellation.get());
   try {
-      signal(SIGINT, [](int sig) {
-        if (SIGINT == sig) {
-          dpt::interrupt_flag = 1;
-        }
-      });
       {
         m_messager("Creating Backup...");
         /* backup files about to be changed on dpt */
-        gptr<git_status_list> stats;
-        gptr<git_reference> head;
-        m_git->status(head, stats);
-        m_git->branch("dpt");
-        m_git->checkout("dpt");
-        for (auto const& dpt : m_prepared_dpt_delete) {
-          overwriteFromDpt(dpt->path(), m_sync_dir / dpt->relPath());
-        }
+        vector<shared_ptr<DNode const>> sources(
+          m_prepared_dpt_delete.begin(),
+          m_prepared_dpt_delete.end()
+        );
         for (auto const& local : m_prepared_overwrite_to_dpt) {
           path dptpath = "Document" / local->relPath();
           auto dpt = m_dpt_path_nodes.find(dptpath.string());
           if (dpt != m_dpt_path_nodes.end()) {
-            overwriteFromDpt(dpt->second->path(), local->path());
+            sources.push_back(dpt->second);
           }
         }
         // TO-do: handle move
-        m_git->addAll();
-        string status = m_git->status();
-        std::replace(status.begin(),status.end(), '\'', '\"');
-        m_git->commit("<dpt pre-sync checkpoint>\n\n" + status);
-        m_git->tag(
-          "dpt_" + string(
-            git_oid_tostr_s(
-              git_reference_target(head))
-            )
-            .substr(0,7)
-        );
+        if (m_git) {
+          /* the commit is built in memory so the working tree is
+            left alone */
+          vector<pair<rpath,git_oid>> blobs;
+          dbOpen();
+          for (auto const& dpt : sources) {
+            backupFromDpt(dpt, blobs);
+          }
+          dbClose();
+          ostringstream status;
+          status << "on branch: refs/heads/dpt" << endl;
+          status << "total changes: " << blobs.size() << endl;
+          for (auto const& blob : blobs) {
+            status << "backup: " << blob.first.generic_string() << endl;
+          }
+          git_oid const head = m_git->revparse("master");
+          git_oid const backup = m_git->commitBlobs(
+            "dpt",
+            "master",
+            blobs,
+            "<dpt pre-sync checkpoint>\n\n" + status.str()
+          );
+          m_git->tag(
+            "dpt_" + string(git_oid_tostr_s(&head)).substr(0,7),
+            backup
+          );
+        } else {
+          backupToDptSnapshot(sources);
+        }
       }
       {
         m_messager("Syncing...");
         /* start syncing */
-        m_git->checkout("master");
         logger() << "Syncing started. Do not disconnect!" << endl;
         dbOpen();
+        m_transferred_blobs.clear();
         syncAllFiles();
-        updateLocalTree();
-        updateDptTree();
-        updateRevDB();
+        if (m_diff_memory_budget) {
+          updateRevDBStreaming();
+        } else {
+          updateLocalTree();
+          updateDptTree();
+          updateRevDB();
+        }
         dbClose(); // git checkout would invalidate db connection
         logger() << "All files are synced." << endl;
         m_messager("All Up-to-Date");
@@ -1660,23 +2734,34 @@ void Dpt::safeSyncAllFiles(DryRunFlag dryrun)
   } catch(SyncInterrupted) {
     m_messager("Sync Stopped");
     logger() << "interrupted" << endl;
-    m_git->checkout("master");
-    m_git->addAll();
-    m_git->resetHard();
+    m_snapshot->rollback();
     throw;
   } catch (...) {
     logger() << "An error happend during syncing, "
       << "changes will be reverted." << endl;
     m_messager("Sync Failed");
-    m_git->checkout("master");
-    m_git->addAll();
-    m_git->resetHard();
+    m_snapshot->rollback();
     throw;
   }
   {
-    m_git->addAll();
-    string status = m_git->status();
-    m_git->commit("<local post-sync checkpoint>\n\n" + status);
+    /* downloaded files were hashed on the fly */
+    if (m_git) {
+      m_git->insertGitKeepFiles(m_local_empty_dirs);
+      m_git->stage(m_transferred_blobs);
+    }
+    m_transferred_blobs.clear();
+    /* only what the sync touched can have changed */
+    vector<pair<rpath,rpath>> renames;
+    for (auto const& i : m_prepared_local_move) {
+      renames.push_back(
+        make_pair(i.first->relPath(), i.second->relPath())
+      );
+    }
+    m_snapshot->checkpoint(
+      "<local post-sync checkpoint>",
+      syncedLocalPaths(),
+      renames
+    );
   }
 }
 
@@ -1684,7 +2769,9 @@ void Dpt::setPrivateKeyPath(path const& key) {
   #if DEBUG_AUTH
   logger() << "using private key: " << key << endl;
   #endif
+  std::lock_guard<std::recursive_mutex> lock(m_auth_mutex);
   m_private_key_path = key;
+  m_signer.reset();
 }
 
 void Dpt::setClientIdPath(path const& id) {
@@ -1775,6 +2862,9 @@ string Dpt::git(string const& command) const
 
 Dpt::~Dpt()
 {
+  if (m_maintenance.joinable()) {
+    m_maintenance.join();
+  }
   dbClose();
 }
 
@@ -1796,7 +2886,28 @@ void Dpt::setupSyncDir()
   if (! filesystem::exists(rev_db)) {
     filesystem::copy_file("rev_db", rev_db);
   }
+  if (m_snapshot_backend == LinkSnapshots) {
+    m_git.reset();
+    auto snapshot = make_shared<LinkSnapshot>(m_sync_dir);
+    /* the sync state rolls back with the files, as it does in git */
+    snapshot->trackHidden(".rev");
+    m_snapshot = snapshot;
+    m_dpt_snapshot = make_shared<LinkSnapshot>(
+      dptBackupStaging(m_sync_dir),
+      m_sync_dir / ".dpt-snapshots"
+    );
+    return;
+  }
+  m_dpt_snapshot.reset();
   m_git = make_shared<Git>(m_sync_dir);
+  /* updateLocalTree reports empty dirs, no need to walk again */
+  m_git->setScanEmptyDirs(false);
+  m_snapshot = m_git;
+}
+
+void Dpt::setSnapshotBackend(SnapshotBackend backend) noexcept
+{
+  m_snapshot_backend = backend;
 }
 
 void Dpt::setMessager(
@@ -1815,24 +2926,35 @@ ostream& Dpt::logger() const { return *m_logger; }
 
 void Dpt::dptQuickUploadAndOpen(path const& local)
 {
+  std::lock_guard<std::recursive_mutex> operation(m_operation_mutex);
+  OperationScope const scope(*this);
   try {
-    // TODO: make this code faster
-    updateDptTree();
-    if (
-      m_dpt_path_nodes.find("Document/Received")
-        == m_dpt_path_nodes.end()
-    )
-    {
-      Json js;
-      js.put("parent_folder_id", "root");
-      js.put("folder_name", "Received");
-      Json resp = sendJson("POST", "/folders2", js);
-      string new_id = resp.get<string>("folder_id");
-      updateDptTree();
+    /* resolve the two paths involved instead of listing the whole
+      library */
+    path const received_path = "Document/Received";
+    /* whether to upload is decided by what is on the device now, a
+      cached node may have been deleted or replaced there */
+    forgetResolvedPath(received_path);
+    shared_ptr<DNode> received = resolveDptPath(received_path);
+    if (! received) {
+      FoldersPostRequest2 folder;
+      folder.parent_folder_id = "root";
+      folder.folder_name = "Received";
+      received = make_shared<DNode>();
+      received->setId(api().folders2Post(folder).folder_id);
+      received->setIsDir(true);
+      received->setFilename("Received");
+      received->setPath(received_path);
+      received->setRelPath("Received");
+      m_resolved_nodes.put(received_path.string(), received);
     }
-    path p = "Document/Received" / local.filename();
-    if (m_dpt_path_nodes.find(p.string()) == m_dpt_path_nodes.end())
-    {
+    m_dpt_path_nodes[received_path.string()] = received;
+    path p = received_path / local.filename();
+    if (shared_ptr<DNode> uploaded = resolveDptPath(p)) {
+      m_dpt_path_nodes[p.string()] = uploaded;
+    } else {
+      /* a node left by an earlier sync is gone from the device */
+      m_dpt_path_nodes.erase(p.string());
       m_messager("Uploading " + local.filename().string() + "...");
       overwriteToDpt(local, p);
     }
@@ -1856,27 +2978,20 @@ vector<shared_ptr<GitCommit>> Dpt::listGitCommits(
   );
 }
 
-void Dpt::updateGitCommits()
-{
-  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
-  m_git_commits.clear();
-  auto&& list = m_git->history(100);
-  cerr << list.size() << endl;
-  for (auto& gptr_commit : list)
+namespace {
+  shared_ptr<GitCommit> makeGitCommit(GitCommitRecord const& record)
   {
     shared_ptr<GitCommit> commit = make_shared<GitCommit>();
-    git_oid const* oid = git_commit_id(gptr_commit);
-    commit->commit = git_oid_tostr_s(oid);
-    commit->message = git_commit_message(gptr_commit);
+    commit->commit = record.commit;
+    commit->message = record.message;
     size_t newline_pos = commit->message.find('\n', 0);
     if (newline_pos == string::npos) {
       commit->title = commit->message;
     } else {
       commit->title = commit->message.substr(0,newline_pos);
     }
-    time_t commit_time = git_commit_time(gptr_commit);
     char time_str[26];
-    commit->time = *std::gmtime(&commit_time);
+    commit->time = *std::gmtime(&record.time);
     std::strftime(
       time_str,
       sizeof(time_str),
@@ -1884,26 +2999,59 @@ void Dpt::updateGitCommits()
       &commit->time
     );
     commit->iso8601_time = std::move(time_str);
-    m_git_commits.push_back(commit);
+    return commit;
   }
 }
 
-void Dpt::extractGitCommit(string const& commit, path const& dest)
+void Dpt::updateGitCommits()
 {
+  std::lock_guard<std::mutex> lock(m_git_mutex);
   assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  m_git_commits.clear();
+  for (auto const& record : m_snapshot->historyPage(100))
   {
-    m_git->addAll();
-    string status = m_git->status();
-    m_git->commit("<pre-extraction-sync checkpoint>\n\n" + status);
+    m_git_commits.push_back(makeGitCommit(record));
   }
-  try {
-    m_git->checkout(commit);
-    copyBetweenLocal(m_sync_dir, dest);
-  } catch (...) {
-    m_git->checkout("master");
-    throw;
+}
+
+vector<shared_ptr<GitCommit>> Dpt::listGitCommits(
+  string const& after,
+  size_t limit
+) const
+{
+  std::lock_guard<std::mutex> lock(m_git_mutex);
+  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  vector<shared_ptr<GitCommit>> rtv;
+  for (auto const& record : m_snapshot->historyPage(limit, after))
+  {
+    rtv.push_back(makeGitCommit(record));
   }
-  m_git->checkout("master");
+  return rtv;
+}
+
+void Dpt::extractGitCommit(string const& commit, path const& dest)
+{
+  std::lock_guard<std::mutex> lock(m_git_mutex);
+  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  /* the sync dir and HEAD are left alone, no checkpoint needed */
+  m_snapshot->exportTree(commit, dest);
+}
+
+vector<GitFileVersion> Dpt::listFileVersions(rpath const& relpath) const
+{
+  std::lock_guard<std::mutex> lock(m_git_mutex);
+  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  return m_snapshot->versions(relpath);
+}
+
+void Dpt::restoreFileVersion(
+  GitFileVersion const& version,
+  path const& dest
+)
+{
+  std::lock_guard<std::mutex> lock(m_git_mutex);
+  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  m_snapshot->restoreVersion(version, dest);
 }
 
 ostream& dpt::operator<<(ostream& out, GitCommit& commit)
@@ -1915,18 +3063,73 @@ ostream& dpt::operator<<(ostream& out, GitCommit& commit)
     << commit.message << endl;
 }
 
+void Dpt::startMaintenance(RetentionPolicy const& policy)
+{
+  assert(! m_sync_dir.empty() && "don't forget to set sync dir");
+  if (m_maintenance.joinable()) {
+    m_maintenance.join();
+  }
+  m_maintenance = std::thread([this, policy]() {
+    std::lock_guard<std::mutex> lock(m_git_mutex);
+    try {
+      m_messager("Compacting Backup...");
+      MaintenanceReport report = m_snapshot->maintain(policy);
+      logger()
+        << "maintenance: " << report.commits_before << " -> "
+        << report.commits_after << " checkpoints, "
+        << report.size_before << " -> " << report.size_after
+        << " bytes" << endl;
+      m_messager("Backup Compacted");
+    } catch (char const* err) {
+      logger() << "maintenance failed: " << err << endl;
+    } catch (std::exception const& err) {
+      logger() << "maintenance failed: " << err.what() << endl;
+    }
+  });
+}
+
 void Dpt::stop() {
   m_messager("Stopping...");
-  dpt::interrupt_flag = 1;
+  std::lock_guard<std::mutex> lock(m_cancellation_mutex);
+  m_cancellation->cancel();
+  /* nothing to stop after the requests in flight */
+  if (m_operations == 0) {
+    m_cancellation = make_shared<CancellationToken>();
+  }
+}
+
+shared_ptr<CancellationToken> Dpt::cancellation() const
+{
+  std::lock_guard<std::mutex> lock(m_cancellation_mutex);
+  return m_cancellation;
+}
+
+Dpt::OperationScope::OperationScope(Dpt& dpt)
+  : m_dpt(dpt)
+{
+  std::lock_guard<std::mutex> lock(m_dpt.m_cancellation_mutex);
+  if (m_dpt.m_operations++ == 0) {
+    m_dpt.m_cancellation = make_shared<CancellationToken>();
+  }
+  m_token = m_dpt.m_cancellation;
+}
+
+Dpt::OperationScope::~OperationScope()
+{
+  std::lock_guard<std::mutex> lock(m_dpt.m_cancellation_mutex);
+  /* a stop() that came too late must not hold up later requests */
+  if (--m_dpt.m_operations == 0) {
+    m_dpt.m_cancellation = make_shared<CancellationToken>();
+  }
 }
 
 Battery Dpt::battery() const
 {
-  Json response = sendJson("GET","/system/status/battery");
+  auto const response = api().systemStatusBatteryGet();
   Battery battery;
-  battery.level = response.get<float>("level");
-  battery.pen = response.get<float>("pen");
-  string status = response.get<string>("status");
+  battery.level = stof(response.level);
+  battery.pen = stof(response.pen);
+  string const& status = response.status;
   if (status == "charging") {
     battery.status = Battery::Status::Charging;
   } else if (status == "full") {
@@ -1,6 +1,8 @@
 #include <dptrp1/dtree.h>
 #include <iostream>
-#include <unordered_map>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 
 using namespace std;
 using std::shared_ptr;
@@ -9,9 +11,33 @@ using std::string;
 using std::chrono::time_point;
 using std::chrono::system_clock;
 using dpt::DNode;
+using dpt::DArena;
 using boost::filesystem::path;
 
-vector<shared_ptr<DNode>> DNode::children() const {
+DArena::DArena(size_t chunk_size)
+{
+  m_chunk_size = chunk_size;
+}
+
+void* DArena::allocate(size_t size, size_t align)
+{
+  size_t offset = (m_used + align - 1) & ~(align - 1);
+  if (m_chunks.empty() || offset + size > m_chunk_size) {
+    /* oversized requests get a chunk of their own */
+    m_chunks.emplace_back(new char[max(size, m_chunk_size)]);
+    offset = 0;
+  }
+  m_used = offset + size;
+  m_bytes += size;
+  return m_chunks.back().get() + offset;
+}
+
+shared_ptr<DNode> dpt::makeNode(shared_ptr<DArena> const& arena)
+{
+  return std::allocate_shared<DNode>(DArenaAllocator<DNode>(arena));
+}
+
+vector<shared_ptr<DNode>> const& DNode::children() const noexcept {
   return m_children;
 }
 
@@ -19,6 +45,21 @@ void DNode::addChild(shared_ptr<DNode> child) {
   m_children.push_back(child);
 }
 
+void DNode::sortChildren() {
+  std::sort(
+    m_children.begin(),
+    m_children.end(),
+    [](shared_ptr<DNode> const& a, shared_ptr<DNode> const& b) {
+      return a->filename() < b->filename();
+    }
+  );
+  for (auto const& c : m_children) {
+    if (c->isDir()) {
+      c->sortChildren();
+    }
+  }
+}
+
 time_t DNode::lastModifiedTime() const
 {
   return m_last_modified_time;
@@ -51,16 +92,78 @@ string const& DNode::filename() const {
   return m_filename;
 }
 
+namespace {
+  int hexValue(char c, char ten)
+  {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= ten && c <= ten + 5) {
+      return c - ten + 10;
+    }
+    return -1;
+  }
+}
+
 void DNode::setRev(string const& n) {
-  m_rev = n;
+  /* local revisions are md5 digests in hex, uppercase as md5()
+    writes them; the case is kept so that rev() gives back n */
+  m_has_digest = n.size() == 2 * sizeof(m_digest);
+  m_digest_upper = n.find_first_of("ABCDEF") != string::npos;
+  char const ten = m_digest_upper ? 'A' : 'a';
+  for (size_t i = 0; m_has_digest && i < sizeof(m_digest); i++) {
+    int const hi = hexValue(n[2*i], ten);
+    int const lo = hexValue(n[2*i+1], ten);
+    m_has_digest = hi >= 0 && lo >= 0;
+    m_digest[i] = (hi << 4) | lo;
+  }
+  if (m_has_digest) {
+    m_rev.reset();
+  } else {
+    m_rev.reset(n.empty() ? nullptr : new string(n));
+  }
+}
+
+string DNode::rev() const {
+  if (! m_has_digest) {
+    return m_rev ? *m_rev : string();
+  }
+  char const* const hex =
+    m_digest_upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  string rtv(2 * sizeof(m_digest), '0');
+  for (size_t i = 0; i < sizeof(m_digest); i++) {
+    rtv[2*i] = hex[m_digest[i] >> 4];
+    rtv[2*i+1] = hex[m_digest[i] & 0xf];
+  }
+  return rtv;
 }
 
-string const& DNode::rev() const {
-  return m_rev;
+bool DNode::hasRev(string const& rev) const noexcept {
+  if (! m_has_digest) {
+    return m_rev ? *m_rev == rev : rev.empty();
+  }
+  if (rev.size() != 2 * sizeof(m_digest)) {
+    return false;
+  }
+  char const* const hex =
+    m_digest_upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  for (size_t i = 0; i < sizeof(m_digest); i++) {
+    if (rev[2*i] != hex[m_digest[i] >> 4]
+        || rev[2*i+1] != hex[m_digest[i] & 0xf]) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void DNode::setPath(boost::filesystem::path const& p) {
+  if (m_rel_path_size == UINT32_MAX || m_path.empty()) {
+    m_path = p;
+    return;
+  }
+  rpath const rel = relPath();
   m_path = p;
+  setRelPath(rel);
 }
 
 path const& DNode::path() const {
@@ -68,11 +171,24 @@ path const& DNode::path() const {
 }
 
 void DNode::setRelPath(boost::filesystem::path const& p) {
-  m_rel_path = p;
+  auto const& full = m_path.native();
+  auto const& rel = p.native();
+  if (full.size() >= rel.size()
+      && full.compare(full.size() - rel.size(), rel.size(), rel) == 0) {
+    m_rel_path_size = rel.size();
+    m_rel_path.reset();
+  } else {
+    m_rel_path_size = UINT32_MAX;
+    m_rel_path.reset(new rpath(p));
+  }
 }
 
-path const& DNode::relPath() const {
-  return m_rel_path;
+path DNode::relPath() const {
+  auto const& full = m_path.native();
+  if (m_rel_path_size > full.size()) {
+    return m_rel_path ? *m_rel_path : rpath();
+  }
+  return rpath(full.substr(full.size() - m_rel_path_size));
 }
 
 void DNode::setIsDir(bool d) {
@@ -82,14 +198,17 @@ void DNode::setIsDir(bool d) {
 vector<shared_ptr<DNode>> DNode::allFiles() const {
   assert(isDir());
   vector<shared_ptr<DNode>> rtv;
-  vector<shared_ptr<DNode>> stack = children();
+  /* walk with raw pointers, only the results are refcounted */
+  vector<DNode const*> stack(1, this);
   while (! stack.empty()) {
-    shared_ptr<DNode> n = stack.back();
+    DNode const* n = stack.back();
     stack.pop_back();
-    if (n->isDir()) {
-      stack.insert(stack.end(), n->children().begin(), n->children().end());
-    } else {
-      rtv.push_back(n);
+    for (auto const& c : n->m_children) {
+      if (c->isDir()) {
+        stack.push_back(c.get());
+      } else {
+        rtv.push_back(c);
+      }
     }
   }
   return rtv;
@@ -105,30 +224,18 @@ void dpt::symmetricDiff(vector<shared_ptr<DNode>> const& a,
   only_b.clear();
   both.clear();
 
-  std::unordered_map<string, shared_ptr<DNode>> hash_a;
-  std::unordered_map<string, shared_ptr<DNode>> hash_b;
-
-  // hash a
-  for (auto const& p : a) {
-    hash_a[p->filename()] = p;
-  }
-
-  // hash b
-  for (auto const& p : b) {
-    hash_b[p->filename()] = p;
-    auto const i = hash_a.find(p->filename());
-    if (i != hash_a.end()) {
-      // if also found in a
-      both.push_back(make_pair(i->second, p));
+  auto i = a.begin();
+  auto j = b.begin();
+  while (i != a.end() && j != b.end()) {
+    int const order = (*i)->filename().compare((*j)->filename());
+    if (order < 0) {
+      only_a.push_back(*i++);
+    } else if (order > 0) {
+      only_b.push_back(*j++);
     } else {
-      // else only in b
-      only_b.push_back(p);
-    }
-  }
-
-  for (auto const& p : a) {
-    if (hash_b.find(p->filename()) == hash_b.end()) {
-      only_a.push_back(p);
+      both.emplace_back(*i++, *j++);
     }
   }
+  only_a.insert(only_a.end(), i, a.end());
+  only_b.insert(only_b.end(), j, b.end());
 }
@@ -2,6 +2,16 @@
 #include <iostream>
 #include <sstream>
 #include <queue>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <cctype>
+#include <cassert>
+#include <sys/stat.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 using namespace std;
 using namespace dpt;
@@ -20,6 +30,14 @@ gptr<git_type>::gptr(gptr&& other)
   other.m_ptr = nullptr;
 }
 
+template<class git_type>
+gptr<git_type>& gptr<git_type>::operator=(gptr&& other)
+{
+  /* other's destructor frees what we used to hold */
+  std::swap(m_ptr, other.m_ptr);
+  return *this;
+}
+
 template<class git_type>
 gptr<git_type>::operator git_type*() { return m_ptr; }
 
@@ -45,6 +63,13 @@ make_gptr(git_reference)
 make_gptr(git_index)
 make_gptr(git_annotated_commit)
 make_gptr(git_revwalk)
+make_gptr(git_tree)
+make_gptr(git_tree_entry)
+make_gptr(git_blob)
+make_gptr(git_diff)
+make_gptr(git_odb)
+make_gptr(git_reference_iterator)
+make_gptr(git_packbuilder)
 
 Git::Git(path const& dir)
 {
@@ -61,6 +86,13 @@ Git::Git(path const& dir)
 
 int Git::m_initializer = git_libgit2_init();
 
+Git::~Git()
+{
+  if (m_versions_db) {
+    sqlite3_close_v2(m_versions_db);
+  }
+}
+
 void Git::commit(string const& msg)
 {
   gptr<git_index> index;
@@ -80,10 +112,12 @@ void Git::commit(string const& msg)
     git_oid commit_id;
     git_commit_create(&commit_id, m_repo, "HEAD", sig, sig, "UTF-8", msg.c_str(), tree, 1, parents);
     cerr << "new commit: " << git_oid_tostr_s(&commit_id) << endl;
+    indexVersions(commit_id);
   } else {
     git_oid commit_id;
     git_commit_create(&commit_id, m_repo, "HEAD", sig, sig, "UTF-8", msg.c_str(), tree, 0, nullptr);
     cerr << "root commit: " << git_oid_tostr_s(&commit_id) << endl;
+    indexVersions(commit_id);
   }
 }
 
@@ -133,8 +167,16 @@ void Git::addAll()
   gptr<git_reference> head_ref;
   status(head_ref, stats);
   auto callback = [](char const* path, unsigned flag, void* index) -> int {
+    unsigned const wt_flags =
+      GIT_STATUS_WT_NEW
+      | GIT_STATUS_WT_MODIFIED
+      | GIT_STATUS_WT_DELETED
+      | GIT_STATUS_WT_TYPECHANGE
+      | GIT_STATUS_WT_RENAMED;
     if (flag & GIT_STATUS_IGNORED) {
       cerr << "ignoring " << path << endl;
+    } else if (! (flag & wt_flags)) {
+      /* already staged and identical to the working tree */
     } else if (flag & GIT_STATUS_WT_DELETED) {
       git_index_remove_bypath(static_cast<git_index*>(index), path);
       cerr << "removing " << path << endl;
@@ -148,6 +190,168 @@ void Git::addAll()
   git_index_write(index);
 }
 
+string Git::commitCheckpoint(
+  string const& title,
+  vector<pair<string,string>>& changes,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  applyRenames(changes, renames);
+  gptr<git_reference> head;
+  git_repository_head(head, m_repo);
+  ostringstream oss;
+  oss << "on branch: " << (head.get() ? git_reference_name(head) : "") << endl;
+  if (changes.empty()) {
+    oss << "nothing new" << endl;
+  } else {
+    oss << "total changes: " << changes.size() << endl;
+  }
+  for (auto const& change : changes) {
+    oss << "staged: " << change.first << ": " << change.second << endl;
+  }
+  string summary = oss.str();
+  commit(title + "\n\n" + summary);
+  return summary;
+}
+
+string Git::checkpoint(
+  string const& title,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  gptr<git_index> index;
+  git_repository_index(index, m_repo);
+  gptr<git_status_list> stats;
+  gptr<git_reference> head;
+  status(head, stats);
+  /* stage the same entries that are summarized */
+  vector<pair<string,string>> changes;
+  size_t const count = git_status_list_entrycount(stats);
+  for (size_t i = 0; i < count; i++) {
+    git_status_entry const* entry = git_status_byindex(stats, i);
+    if (entry->status & GIT_STATUS_IGNORED) {
+      continue;
+    }
+    git_diff_delta const* delta = entry->index_to_workdir;
+    if (delta) {
+      if (entry->status & GIT_STATUS_WT_DELETED) {
+        git_index_remove_bypath(index, delta->old_file.path);
+      } else {
+        git_index_add_bypath(index, delta->new_file.path);
+      }
+    } else {
+      delta = entry->head_to_index;
+    }
+    string kind;
+    if (entry->status & (GIT_STATUS_INDEX_NEW|GIT_STATUS_WT_NEW)) {
+      kind = "new";
+    } else if (entry->status & (GIT_STATUS_INDEX_DELETED|GIT_STATUS_WT_DELETED)) {
+      kind = "deleted";
+    } else if (entry->status & (GIT_STATUS_INDEX_TYPECHANGE|GIT_STATUS_WT_TYPECHANGE)) {
+      kind = "typechange";
+    } else {
+      kind = "modified";
+    }
+    changes.push_back(make_pair(kind, string(delta ? delta->old_file.path : "")));
+  }
+  git_index_write(index);
+  return commitCheckpoint(title, changes, renames);
+}
+
+string Git::checkpoint(
+  string const& title,
+  vector<rpath> const& paths,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  gptr<git_index> index;
+  git_repository_index(index, m_repo);
+  gptr<git_reference> head;
+  git_repository_head(head, m_repo);
+  /* what HEAD has is what the summary compares against */
+  gptr<git_commit> head_commit;
+  gptr<git_tree> head_tree;
+  if (head.get()) {
+    git_commit_lookup(head_commit, m_repo, git_reference_target(head));
+    git_commit_tree(head_tree, head_commit);
+  }
+  auto in_head = [&](string const& p, git_oid* oid) -> bool {
+    if (! head_tree.get()) {
+      return false;
+    }
+    gptr<git_tree_entry> entry;
+    if (git_tree_entry_bypath(entry, head_tree, p.c_str())) {
+      return false;
+    }
+    git_oid_cpy(oid, git_tree_entry_id(entry));
+    return true;
+  };
+  vector<pair<string,string>> changes;
+  auto add_file = [&](string const& p) {
+    int ignored = 0;
+    git_ignore_path_is_ignored(&ignored, m_repo, p.c_str());
+    if (ignored) {
+      return;
+    }
+    git_index_add_bypath(index, p.c_str());
+    git_index_entry const* staged = git_index_get_bypath(index, p.c_str(), 0);
+    git_oid oid;
+    if (! in_head(p, &oid)) {
+      changes.push_back(make_pair("new", p));
+    } else if (staged && ! git_oid_equal(&oid, &staged->id)) {
+      changes.push_back(make_pair("modified", p));
+    }
+  };
+  auto remove_path = [&](string const& p) {
+    git_oid oid;
+    if (git_index_get_bypath(index, p.c_str(), 0)) {
+      if (in_head(p, &oid)) {
+        changes.push_back(make_pair("deleted", p));
+      }
+      git_index_remove_bypath(index, p.c_str());
+      return;
+    }
+    /* a directory, remove everything under it */
+    string const prefix = p + "/";
+    size_t pos;
+    if (git_index_find_prefix(&pos, index, prefix.c_str()) == 0) {
+      for (; pos < git_index_entrycount(index); pos++) {
+        string const entry_path = git_index_get_byindex(index, pos)->path;
+        if (entry_path.compare(0, prefix.size(), prefix) != 0) {
+          break;
+        }
+        if (in_head(entry_path, &oid)) {
+          changes.push_back(make_pair("deleted", entry_path));
+        }
+      }
+    }
+    git_index_remove_directory(index, p.c_str(), 0);
+  };
+  for (auto const& rel : paths) {
+    string const p = rel.generic_string();
+    path const abs = m_repo_path / rel;
+    if (is_directory(abs)) {
+      for (
+        boost::filesystem::recursive_directory_iterator i(abs), end;
+        i != end;
+        i++
+      )
+      {
+        if (is_regular_file(i->path())) {
+          string f = i->path().generic_string();
+          add_file(f.substr(m_repo_path.generic_string().size() + 1));
+        }
+      }
+    } else if (exists(abs)) {
+      add_file(p);
+    } else {
+      remove_path(p);
+    }
+  }
+  git_index_write(index);
+  return commitCheckpoint(title, changes, renames);
+}
+
 bool Git::hasChanges()
 {
   gptr<git_reference> head;
@@ -155,8 +359,6 @@ bool Git::hasChanges()
   git_status_options opts = GIT_STATUS_OPTIONS_INIT;
   opts.flags |= GIT_STATUS_OPT_INCLUDE_UNTRACKED;
   opts.flags |= GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
-  opts.flags |= GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
-  opts.flags |= GIT_STATUS_OPT_RENAMES_INDEX_TO_WORKDIR;
   opts.flags |= GIT_STATUS_OPT_SORT_CASE_INSENSITIVELY;
   gptr<git_status_list> stats;
   git_status_list_new(stats, m_repo, &opts);
@@ -193,9 +395,28 @@ void Git::insertGitKeepFiles()
   }
 }
 
+void Git::insertGitKeepFiles(vector<rpath> const& dirs)
+{
+  for (auto const& d : dirs) {
+    path f = m_repo_path / d / ".gitkeep";
+    /* rewriting would change mtime and make git hash it again */
+    if (! exists(f)) {
+      ofstream of(f.string());
+      of << "1" << endl;
+    }
+  }
+}
+
+void Git::setScanEmptyDirs(bool scan)
+{
+  m_scan_empty_dirs = scan;
+}
+
 string Git::status(gptr<git_reference>& head, gptr<git_status_list>& stats)
 {
-  insertGitKeepFiles();
+  if (m_scan_empty_dirs) {
+    insertGitKeepFiles();
+  }
   // perform git status
   ostringstream oss;
   git_repository_head(head, m_repo);
@@ -203,8 +424,6 @@ string Git::status(gptr<git_reference>& head, gptr<git_status_list>& stats)
   git_status_options opts = GIT_STATUS_OPTIONS_INIT;
   opts.flags |= GIT_STATUS_OPT_INCLUDE_UNTRACKED;
   opts.flags |= GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
-  opts.flags |= GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
-  opts.flags |= GIT_STATUS_OPT_RENAMES_INDEX_TO_WORKDIR;
   opts.flags |= GIT_STATUS_OPT_SORT_CASE_INSENSITIVELY;
   git_status_list_new(stats, m_repo, &opts);
   int count = git_status_list_entrycount(stats);
@@ -257,6 +476,13 @@ string Git::status(gptr<git_reference>& head, gptr<git_status_list>& stats)
   return oss.str();
 }
 
+void Git::rollback()
+{
+  checkout("master");
+  addAll();
+  resetHard();
+}
+
 void Git::resetHard()
 {
   gptr<git_reference> head_ref;
@@ -272,6 +498,27 @@ path Git::dir() const
   return m_repo_path;
 }
 
+git_oid Git::revparse(string const& refish)
+{
+  gptr<git_object> obj;
+  if (git_revparse_single(obj, m_repo, refish.c_str())) {
+    throw "revision not found";
+  }
+  git_oid oid;
+  git_oid_cpy(&oid, git_object_id(obj));
+  return oid;
+}
+
+void Git::tag(string const& tagname, git_oid const& target)
+{
+  gptr<git_signature> sig;
+  git_signature_now(sig, "dpt", "dpt");
+  gptr<git_object> obj;
+  git_object_lookup(obj, m_repo, &target, GIT_OBJECT_COMMIT);
+  git_oid tag_oid;
+  git_tag_create(&tag_oid, m_repo, tagname.c_str(), obj, sig, "", false);
+}
+
 void Git::tag(string const& tagname)
 {
   gptr<git_signature> sig;
@@ -307,3 +554,909 @@ vector<gptr<git_commit>> Git::history(size_t limit)
   }
   return output;
 }
+
+string Git::blobId(path const& file) const
+{
+  git_oid oid;
+  if (git_odb_hashfile(&oid, file.c_str(), GIT_OBJECT_BLOB)) {
+    throw "cannot hash file";
+  }
+  return git_oid_tostr_s(&oid);
+}
+
+bool Git::hasBlob(string const& id, git_oid* oid)
+{
+  if (id.size() != GIT_OID_HEXSZ || git_oid_fromstr(oid, id.c_str())) {
+    return false;
+  }
+  gptr<git_odb> odb;
+  if (git_repository_odb(odb, m_repo)) {
+    return false;
+  }
+  return git_odb_exists(odb, oid) == 1;
+}
+
+void Git::extractBlob(git_oid const& oid, path const& dest)
+{
+  gptr<git_blob> blob;
+  if (git_blob_lookup(blob, m_repo, &oid)) {
+    throw "blob not found";
+  }
+  ofstream of(dest.string(), ios_base::binary|ios_base::out|ios_base::trunc);
+  of.write(
+    static_cast<char const*>(git_blob_rawcontent(blob)),
+    git_blob_rawsize(blob)
+  );
+}
+
+GitBlobStream::GitBlobStream(git_repository* repo)
+{
+  if (git_blob_create_from_stream(&m_stream, repo, nullptr)) {
+    throw "cannot create blob stream";
+  }
+}
+
+GitBlobStream::~GitBlobStream()
+{
+  /* not committed, discard the partial blob */
+  m_stream && (m_stream->free(m_stream),0);
+}
+
+void GitBlobStream::write(void const* data, size_t size)
+{
+  assert(m_stream && "blob stream is already committed");
+  if (m_stream->write(m_stream, static_cast<char const*>(data), size)) {
+    throw "cannot write blob";
+  }
+}
+
+git_oid GitBlobStream::commit()
+{
+  assert(m_stream && "blob stream is already committed");
+  git_oid oid;
+  /* commit frees the stream */
+  int error = git_blob_create_from_stream_commit(&oid, m_stream);
+  m_stream = nullptr;
+  if (error) {
+    throw "cannot write blob";
+  }
+  return oid;
+}
+
+unique_ptr<GitBlobStream> Git::blobStream()
+{
+  return make_unique<GitBlobStream>(m_repo);
+}
+
+git_oid Git::writeBlob(void const* data, size_t size)
+{
+  git_oid oid;
+  if (git_blob_create_from_buffer(&oid, m_repo, data, size)) {
+    throw "cannot write blob";
+  }
+  return oid;
+}
+
+git_oid Git::commitBlobs(
+  string const& branch,
+  string const& base,
+  vector<pair<rpath,git_oid>> const& blobs,
+  string const& msg
+)
+{
+  git_oid base_oid = revparse(base);
+  gptr<git_commit> base_commit;
+  gptr<git_tree> base_tree;
+  if (git_commit_lookup(base_commit, m_repo, &base_oid)
+      || git_commit_tree(base_tree, base_commit)) {
+    throw "cannot read backup base";
+  }
+  /* an in-memory index, the repository index is left alone */
+  gptr<git_index> index;
+  if (git_index_new(index) || git_index_read_tree(index, base_tree)) {
+    throw "cannot read backup base";
+  }
+  for (auto const& blob : blobs) {
+    git_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.mode = GIT_FILEMODE_BLOB;
+    git_oid_cpy(&entry.id, &blob.second);
+    string const entry_path = blob.first.generic_string();
+    entry.path = entry_path.c_str();
+    if (git_index_add(index, &entry)) {
+      throw "cannot add blob to tree";
+    }
+  }
+  git_oid tree_oid;
+  gptr<git_tree> tree;
+  if (git_index_write_tree_to(&tree_oid, index, m_repo)
+      || git_tree_lookup(tree, m_repo, &tree_oid)) {
+    throw "cannot write backup tree";
+  }
+  gptr<git_signature> sig;
+  git_signature_now(sig, "dpt", "dpt");
+  const git_commit* parents[] = { base_commit };
+  git_oid commit_oid;
+  if (git_commit_create(&commit_oid, m_repo, nullptr, sig, sig, "UTF-8", msg.c_str(), tree, 1, parents)) {
+    throw "cannot commit backup";
+  }
+  gptr<git_reference> ref;
+  if (git_reference_create(ref, m_repo, ("refs/heads/" + branch).c_str(), &commit_oid, true, msg.c_str())) {
+    throw "cannot commit backup";
+  }
+  cerr << "new commit on " << branch << ": " << git_oid_tostr_s(&commit_oid) << endl;
+  indexVersions(commit_oid);
+  return commit_oid;
+}
+
+namespace {
+  /* mtime and ctime of st the way the index keeps them */
+  void indexTimes(
+    struct stat const& st,
+    git_index_time* mtime,
+    git_index_time* ctime
+  )
+  {
+    ctime->seconds = st.st_ctime;
+    mtime->seconds = st.st_mtime;
+    #if defined(__APPLE__)
+    ctime->nanoseconds = st.st_ctimespec.tv_nsec;
+    mtime->nanoseconds = st.st_mtimespec.tv_nsec;
+    #elif defined(__linux__)
+    ctime->nanoseconds = st.st_ctim.tv_nsec;
+    mtime->nanoseconds = st.st_mtim.tv_nsec;
+    #else
+    ctime->nanoseconds = 0;
+    mtime->nanoseconds = 0;
+    #endif
+  }
+}
+
+void Git::stage(vector<pair<rpath,git_oid>> const& blobs)
+{
+  gptr<git_index> index;
+  git_repository_index(index, m_repo);
+  for (auto const& blob : blobs) {
+    string const entry_path = blob.first.generic_string();
+    struct stat st;
+    if (stat((m_repo_path / blob.first).string().c_str(), &st)) {
+      /* file is gone, let addAll deal with it */
+      continue;
+    }
+    git_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    indexTimes(st, &entry.mtime, &entry.ctime);
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.mode = GIT_FILEMODE_BLOB;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    entry.file_size = st.st_size;
+    git_oid_cpy(&entry.id, &blob.second);
+    entry.path = entry_path.c_str();
+    if (git_index_add(index, &entry)) {
+      git_error const* error = git_error_last();
+      cerr << "error: " << error->message << endl;
+      continue;
+    }
+    #if DEBUG_GIT
+    cerr << "staging " << entry_path << endl;
+    #endif
+  }
+  git_index_write(index);
+}
+
+namespace {
+  struct ExportJob {
+    string path;
+    git_oid oid;
+  };
+}
+
+void Git::exportTree(string const& refish, path const& dest)
+{
+  git_oid commit_oid = revparse(refish);
+  gptr<git_commit> commit;
+  git_commit_lookup(commit, m_repo, &commit_oid);
+  gptr<git_tree> tree;
+  git_commit_tree(tree, commit);
+  create_directories(dest);
+  /* create the directories and collect the files to write */
+  struct Payload {
+    path dest;
+    vector<ExportJob> jobs;
+  } payload;
+  payload.dest = dest;
+  auto callback = [](
+    char const* root,
+    git_tree_entry const* entry,
+    void* payload
+  ) -> int {
+    Payload* p = static_cast<Payload*>(payload);
+    string const entry_path = string(root) + git_tree_entry_name(entry);
+    if (git_tree_entry_type(entry) == GIT_OBJECT_TREE) {
+      create_directory(p->dest / entry_path);
+    } else if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB) {
+      ExportJob job;
+      job.path = entry_path;
+      git_oid_cpy(&job.oid, git_tree_entry_id(entry));
+      p->jobs.push_back(job);
+    }
+    return 0;
+  };
+  git_tree_walk(tree, GIT_TREEWALK_PRE, callback, &payload);
+  /* the index tells which working tree files still hold the blob,
+    trusted the way git does: every stat field must match, and an
+    entry no older than the index itself may have changed unseen
+    within the same second */
+  gptr<git_index> index;
+  git_repository_index(index, m_repo);
+  struct stat index_st;
+  bool const has_index =
+    git_index_path(index) && stat(git_index_path(index), &index_st) == 0;
+  auto unchanged_in_workdir = [&](ExportJob const& job) -> bool {
+    git_index_entry const* entry =
+      git_index_get_bypath(index, job.path.c_str(), 0);
+    struct stat st;
+    if (
+      ! has_index
+        || ! entry
+        || ! git_oid_equal(&entry->id, &job.oid)
+        || stat((m_repo_path / job.path).string().c_str(), &st)
+    )
+    {
+      return false;
+    }
+    git_index_time mtime, ctime;
+    indexTimes(st, &mtime, &ctime);
+    return (uint32_t)st.st_size == entry->file_size
+      && (uint32_t)st.st_ino == entry->ino
+      && mtime.seconds == entry->mtime.seconds
+      && mtime.nanoseconds == entry->mtime.nanoseconds
+      && ctime.seconds == entry->ctime.seconds
+      && ctime.nanoseconds == entry->ctime.nanoseconds
+      && entry->mtime.seconds < (int32_t)index_st.st_mtime;
+  };
+  vector<ExportJob> blob_jobs;
+  for (auto const& job : payload.jobs) {
+    if (
+      ! unchanged_in_workdir(job)
+        || ! reflink(m_repo_path / job.path, dest / job.path)
+    )
+    {
+      blob_jobs.push_back(job);
+    }
+  }
+  /* write the remaining blobs in parallel, libgit2 wants one
+    repository handle per thread */
+  std::atomic<size_t> next(0);
+  std::mutex error_mutex;
+  bool failed = false;
+  auto worker = [&]() {
+    gptr<git_repository> repo;
+    if (git_repository_open(repo, m_repo_path.c_str())) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      failed = true;
+      return;
+    }
+    for (size_t i = next++; i < blob_jobs.size(); i = next++) {
+      gptr<git_blob> blob;
+      if (git_blob_lookup(blob, repo, &blob_jobs[i].oid)) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        failed = true;
+        continue;
+      }
+      ofstream of(
+        (dest / blob_jobs[i].path).string(),
+        ios_base::binary|ios_base::out|ios_base::trunc
+      );
+      of.write(
+        static_cast<char const*>(git_blob_rawcontent(blob)),
+        git_blob_rawsize(blob)
+      );
+      of.close();
+      if (! of) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        failed = true;
+      }
+    }
+  };
+  size_t const nthreads = min<size_t>(
+    max(1u, std::thread::hardware_concurrency()),
+    blob_jobs.size()
+  );
+  vector<std::thread> threads;
+  for (size_t i = 0; i < nthreads; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (failed) {
+    throw "export failed";
+  }
+}
+
+void Git::openVersionIndex()
+{
+  if (m_versions_db) {
+    return;
+  }
+  path db = path(git_repository_path(m_repo)) / "dpt_versions";
+  bool const bootstrap = ! exists(db);
+  sqlite3_open(db.c_str(), &m_versions_db);
+  sqlite3_exec(
+    m_versions_db,
+    "CREATE TABLE IF NOT EXISTS versions ("
+    " rel_path TEXT, commit_id TEXT, blob TEXT, size INTEGER, time INTEGER,"
+    " PRIMARY KEY (rel_path, commit_id));"
+    "CREATE TABLE IF NOT EXISTS commits (commit_id TEXT PRIMARY KEY);"
+    "CREATE TABLE IF NOT EXISTS history ("
+    " commit_id TEXT PRIMARY KEY, time INTEGER, message TEXT, parents TEXT);"
+    "CREATE INDEX IF NOT EXISTS history_time ON history (time, commit_id);"
+    "CREATE TABLE IF NOT EXISTS walked (commit_id TEXT PRIMARY KEY);",
+    nullptr, nullptr, nullptr
+  );
+  if (bootstrap) {
+    /* index the history that predates the index */
+    gptr<git_revwalk> walk;
+    git_revwalk_new(walk, m_repo);
+    git_revwalk_push_glob(walk, "refs/*");
+    git_oid oid;
+    while (git_revwalk_next(&oid, walk) == 0) {
+      indexVersions(oid);
+    }
+  }
+}
+
+void Git::indexVersions(git_oid const& commit_oid)
+{
+  openVersionIndex();
+  string const commit_id = git_oid_tostr_s(&commit_oid);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(m_versions_db, "INSERT OR IGNORE INTO commits VALUES (?)", -1, &stmt, nullptr);
+  sqlite3_bind_text(stmt, 1, commit_id.c_str(), -1, SQLITE_TRANSIENT);
+  int result = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (result != SQLITE_DONE || sqlite3_changes(m_versions_db) == 0) {
+    /* already indexed */
+    return;
+  }
+  gptr<git_commit> commit;
+  git_commit_lookup(commit, m_repo, &commit_oid);
+  cacheCommit(commit);
+  gptr<git_tree> tree;
+  git_commit_tree(tree, commit);
+  gptr<git_tree> parent_tree;
+  if (git_commit_parentcount(commit) > 0) {
+    gptr<git_commit> parent;
+    git_commit_parent(parent, commit, 0);
+    git_commit_tree(parent_tree, parent);
+  }
+  /* only what changed since the first parent is a new version */
+  gptr<git_diff> diff;
+  git_diff_tree_to_tree(diff, m_repo, parent_tree, tree, nullptr);
+  gptr<git_odb> odb;
+  git_repository_odb(odb, m_repo);
+  time_t const time = git_commit_time(commit);
+  sqlite3_exec(m_versions_db, "BEGIN", nullptr, nullptr, nullptr);
+  sqlite3_prepare_v2(m_versions_db, "INSERT OR IGNORE INTO versions VALUES (?,?,?,?,?)", -1, &stmt, nullptr);
+  size_t const count = git_diff_num_deltas(diff);
+  for (size_t i = 0; i < count; i++) {
+    git_diff_delta const* delta = git_diff_get_delta(diff, i);
+    if (delta->status == GIT_DELTA_DELETED) {
+      continue;
+    }
+    size_t size = 0;
+    git_object_t type;
+    git_odb_read_header(&size, &type, odb, &delta->new_file.id);
+    string const blob = git_oid_tostr_s(&delta->new_file.id);
+    sqlite3_bind_text(stmt, 1, delta->new_file.path, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, commit_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, blob.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 4, size);
+    sqlite3_bind_int64(stmt, 5, time);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_exec(m_versions_db, "COMMIT", nullptr, nullptr, nullptr);
+}
+
+vector<GitFileVersion> Git::versions(rpath const& relpath)
+{
+  openVersionIndex();
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(
+    m_versions_db,
+    "SELECT commit_id, blob, size, time FROM versions"
+    " WHERE rel_path = ? ORDER BY time DESC, rowid DESC",
+    -1, &stmt, nullptr
+  );
+  string const q = relpath.generic_string();
+  sqlite3_bind_text(stmt, 1, q.c_str(), -1, nullptr);
+  vector<GitFileVersion> rtv;
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    GitFileVersion version;
+    version.commit = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
+    version.blob = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 1));
+    version.size = sqlite3_column_int64(stmt, 2);
+    version.time = sqlite3_column_int64(stmt, 3);
+    rtv.push_back(version);
+  }
+  sqlite3_finalize(stmt);
+  return rtv;
+}
+
+void Git::restoreVersion(GitFileVersion const& version, path const& dest)
+{
+  git_oid oid;
+  if (git_oid_fromstr(&oid, version.blob.c_str())) {
+    throw "invalid blob id";
+  }
+  extractBlob(oid, dest);
+}
+
+void Git::cacheCommit(git_commit* commit)
+{
+  string const commit_id = git_oid_tostr_s(git_commit_id(commit));
+  string parents;
+  for (unsigned i = 0; i < git_commit_parentcount(commit); i++) {
+    if (i) {
+      parents += " ";
+    }
+    parents += git_oid_tostr_s(git_commit_parent_id(commit, i));
+  }
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(m_versions_db, "INSERT OR IGNORE INTO history VALUES (?,?,?,?)", -1, &stmt, nullptr);
+  sqlite3_bind_text(stmt, 1, commit_id.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 2, git_commit_time(commit));
+  sqlite3_bind_text(stmt, 3, git_commit_message(commit), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 4, parents.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+}
+
+void Git::updateHistoryCache()
+{
+  openVersionIndex();
+  /* commits made outside of Git, eg. by the git command line, are
+    picked up from the ref tips down to the commits whose ancestry
+    an earlier walk completed. Being in history says nothing about
+    the ancestors, indexVersions caches commits one by one. */
+  vector<git_oid> stack;
+  gptr<git_reference_iterator> iter;
+  git_reference_iterator_glob_new(iter, m_repo, "refs/*");
+  git_reference* ref;
+  while (git_reference_next(&ref, iter) == 0) {
+    gptr<git_reference> owned(ref);
+    gptr<git_object> obj;
+    if (git_reference_peel(obj, owned, GIT_OBJECT_COMMIT) == 0) {
+      stack.push_back(*git_object_id(obj));
+    }
+  }
+  sqlite3_stmt* walked;
+  sqlite3_prepare_v2(m_versions_db, "SELECT 1 FROM walked WHERE commit_id = ?", -1, &walked, nullptr);
+  auto const is_walked = [walked](string const& commit_id) {
+    sqlite3_reset(walked);
+    sqlite3_bind_text(walked, 1, commit_id.c_str(), -1, SQLITE_TRANSIENT);
+    return sqlite3_step(walked) == SQLITE_ROW;
+  };
+  sqlite3_exec(m_versions_db, "BEGIN", nullptr, nullptr, nullptr);
+  unordered_set<string> visited;
+  bool complete = true;
+  while (! stack.empty()) {
+    git_oid oid = stack.back();
+    stack.pop_back();
+    string const commit_id = git_oid_tostr_s(&oid);
+    if (visited.count(commit_id) || is_walked(commit_id)) {
+      continue;
+    }
+    gptr<git_commit> commit;
+    if (git_commit_lookup(commit, m_repo, &oid)) {
+      complete = false;
+      continue;
+    }
+    visited.insert(commit_id);
+    cacheCommit(commit);
+    for (unsigned i = 0; i < git_commit_parentcount(commit); i++) {
+      stack.push_back(*git_commit_parent_id(commit, i));
+    }
+  }
+  sqlite3_finalize(walked);
+  /* everything below the visited commits is cached now */
+  if (complete) {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(m_versions_db, "INSERT OR IGNORE INTO walked VALUES (?)", -1, &stmt, nullptr);
+    for (auto const& commit_id : visited) {
+      sqlite3_reset(stmt);
+      sqlite3_bind_text(stmt, 1, commit_id.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_exec(m_versions_db, "COMMIT", nullptr, nullptr, nullptr);
+}
+
+vector<GitCommitRecord> Git::historyPage(size_t limit, string const& after)
+{
+  /* the first page refreshes, later ones page through the same
+    cache */
+  if (after.empty()) {
+    updateHistoryCache();
+  }
+  sqlite3_stmt* stmt;
+  if (after.empty()) {
+    sqlite3_prepare_v2(
+      m_versions_db,
+      "SELECT commit_id, time, message FROM history"
+      " ORDER BY time DESC, commit_id DESC LIMIT ?",
+      -1, &stmt, nullptr
+    );
+    sqlite3_bind_int64(stmt, 1, limit);
+  } else {
+    sqlite3_prepare_v2(
+      m_versions_db,
+      "SELECT h.commit_id, h.time, h.message"
+      " FROM history h, history c WHERE c.commit_id = ?"
+      " AND (h.time < c.time OR (h.time = c.time AND h.commit_id < c.commit_id))"
+      " ORDER BY h.time DESC, h.commit_id DESC LIMIT ?",
+      -1, &stmt, nullptr
+    );
+    sqlite3_bind_text(stmt, 1, after.c_str(), -1, nullptr);
+    sqlite3_bind_int64(stmt, 2, limit);
+  }
+  vector<GitCommitRecord> rtv;
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    GitCommitRecord record;
+    record.commit = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
+    record.time = sqlite3_column_int64(stmt, 1);
+    record.message = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 2));
+    rtv.push_back(record);
+  }
+  sqlite3_finalize(stmt);
+  return rtv;
+}
+
+uintmax_t Git::size() const
+{
+  uintmax_t total = 0;
+  path git_dir = m_repo_path / ".git";
+  for (
+    boost::filesystem::recursive_directory_iterator i(git_dir), end;
+    i != end;
+    i++
+  )
+  {
+    if (is_regular_file(i->path())) {
+      total += file_size(i->path());
+    }
+  }
+  return total;
+}
+
+MaintenanceReport Git::maintain(RetentionPolicy const& policy, time_t now)
+{
+  MaintenanceReport report;
+  report.size_before = size();
+  gptr<git_reference> head;
+  git_repository_head(head, m_repo);
+  if (! head.get() || git_repository_head_detached(m_repo)) {
+    throw "maintenance needs HEAD on a branch";
+  }
+  string const branch = git_reference_name(head);
+  /* first-parent chain of master, oldest first */
+  vector<gptr<git_commit>> chain;
+  {
+    vector<git_oid> ids;
+    gptr<git_commit> c;
+    git_commit_lookup(c, m_repo, git_reference_target(head));
+    while (c.get()) {
+      ids.push_back(*git_commit_id(c));
+      gptr<git_commit> parent;
+      if (git_commit_parentcount(c) > 0) {
+        git_commit_parent(parent, c, 0);
+      }
+      c = std::move(parent);
+    }
+    for (auto i = ids.rbegin(); i != ids.rend(); i++) {
+      chain.emplace_back();
+      git_commit_lookup(chain.back(), m_repo, &*i);
+    }
+  }
+  report.commits_before = chain.size();
+  vector<time_t> times;
+  for (auto& c : chain) {
+    times.push_back(git_commit_time(c));
+  }
+  vector<bool> const keep = retained(times, policy, now);
+  /* rebuild the chain, squashing dropped commits into the next kept
+    one; kept commits before the first drop keep their ids */
+  unordered_map<string,git_oid> rewritten; /* old id -> new id */
+  vector<string> squashed; /* dropped, waiting for the next kept */
+  git_oid parent_oid;
+  bool has_parent = false;
+  bool changed = false;
+  for (size_t i = 0; i < chain.size(); i++) {
+    git_oid const* old_oid = git_commit_id(chain[i]);
+    if (! keep[i]) {
+      changed = true;
+      squashed.push_back(git_oid_tostr_s(old_oid));
+      continue;
+    }
+    git_oid new_oid;
+    if (! changed) {
+      git_oid_cpy(&new_oid, old_oid);
+    } else {
+      gptr<git_tree> tree;
+      git_commit_tree(tree, chain[i]);
+      gptr<git_commit> parent;
+      if (has_parent) {
+        git_commit_lookup(parent, m_repo, &parent_oid);
+      }
+      const git_commit* parents[] = { parent };
+      git_commit_create(
+        &new_oid, m_repo, nullptr,
+        git_commit_author(chain[i]), git_commit_committer(chain[i]),
+        "UTF-8", git_commit_message(chain[i]), tree,
+        has_parent ? 1 : 0, parents
+      );
+    }
+    rewritten[git_oid_tostr_s(old_oid)] = new_oid;
+    for (auto const& id : squashed) {
+      rewritten[id] = new_oid;
+    }
+    squashed.clear();
+    git_oid_cpy(&parent_oid, &new_oid);
+    has_parent = true;
+    report.commits_after++;
+  }
+  if (changed) {
+    gptr<git_reference> ref;
+    git_reference_create(ref, m_repo, branch.c_str(), &parent_oid, true, "maintenance");
+    git_reflog_delete(m_repo, branch.c_str());
+    git_reflog_delete(m_repo, "HEAD");
+    /* backups hang off the checkpoint they were taken at, or the one
+      it was squashed into. They are the only copy of what a sync
+      overwrote on the device, so none is dropped. */
+    auto rebase_backup = [&](git_oid const& backup_oid, git_oid* out) -> bool {
+      gptr<git_commit> backup;
+      git_commit_lookup(backup, m_repo, &backup_oid);
+      if (! backup.get() || git_commit_parentcount(backup) == 0) {
+        return false;
+      }
+      auto base = rewritten.find(git_oid_tostr_s(git_commit_parent_id(backup, 0)));
+      if (base == rewritten.end()) {
+        return false;
+      }
+      if (git_oid_equal(&base->second, git_commit_parent_id(backup, 0))) {
+        git_oid_cpy(out, &backup_oid);
+        return true;
+      }
+      gptr<git_tree> tree;
+      git_commit_tree(tree, backup);
+      gptr<git_commit> parent;
+      git_commit_lookup(parent, m_repo, &base->second);
+      const git_commit* parents[] = { parent };
+      return git_commit_create(
+        out, m_repo, nullptr,
+        git_commit_author(backup), git_commit_committer(backup),
+        "UTF-8", git_commit_message(backup), tree, 1, parents
+      ) == 0;
+    };
+    vector<string> tags;
+    git_tag_foreach(m_repo, [](char const* name, git_oid*, void* payload) -> int {
+      static_cast<vector<string>*>(payload)->push_back(name);
+      return 0;
+    }, &tags);
+    vector<git_oid> backups;
+    unordered_set<string> seen;
+    for (auto const& tag : tags) {
+      string const tagname = tag.substr(string("refs/tags/").size());
+      if (tagname.compare(0, 4, "dpt_") != 0) {
+        continue;
+      }
+      gptr<git_reference> tag_ref;
+      gptr<git_object> target;
+      git_reference_lookup(tag_ref, m_repo, tag.c_str());
+      git_reference_peel(target, tag_ref, GIT_OBJECT_COMMIT);
+      git_oid backup_oid;
+      if (! target.get() || ! rebase_backup(*git_object_id(target), &backup_oid)) {
+        /* not taken on this branch, leave it as it is */
+        continue;
+      }
+      git_tag_delete(m_repo, tagname.c_str());
+      if (seen.insert(git_oid_tostr_s(&backup_oid)).second) {
+        backups.push_back(backup_oid);
+      }
+    }
+    /* tagged after their new base, which several may share now */
+    auto tag_exists = [this](string const& tagname) {
+      gptr<git_reference> ref;
+      return git_reference_lookup(ref, m_repo, ("refs/tags/" + tagname).c_str()) == 0;
+    };
+    for (auto const& backup_oid : backups) {
+      gptr<git_commit> backup;
+      git_commit_lookup(backup, m_repo, &backup_oid);
+      string const base =
+        "dpt_" + string(git_oid_tostr_s(git_commit_parent_id(backup, 0))).substr(0,7);
+      string tagname = base;
+      for (int n = 2; tag_exists(tagname); n++) {
+        tagname = base + "_" + to_string(n);
+      }
+      this->tag(tagname, backup_oid);
+    }
+    gptr<git_reference> dpt_branch;
+    if (git_reference_lookup(dpt_branch, m_repo, "refs/heads/dpt") == 0) {
+      git_oid backup_oid;
+      if (rebase_backup(*git_reference_target(dpt_branch), &backup_oid)) {
+        gptr<git_reference> ref;
+        git_reference_create(ref, m_repo, "refs/heads/dpt", &backup_oid, true, "maintenance");
+      }
+      git_reflog_delete(m_repo, "refs/heads/dpt");
+    }
+    /* the version index and history cache refer to old commits */
+    if (m_versions_db) {
+      sqlite3_close_v2(m_versions_db);
+      m_versions_db = nullptr;
+    }
+    boost::filesystem::remove(path(git_repository_path(m_repo)) / "dpt_versions");
+  }
+  repack();
+  report.size_after = size();
+  return report;
+}
+
+vector<git_oid> Git::refTargets()
+{
+  vector<git_oid> rtv;
+  gptr<git_reference_iterator> refs;
+  git_reference_iterator_new(refs, m_repo);
+  git_reference* ref;
+  while (refs.get() && git_reference_next(&ref, refs) == 0) {
+    gptr<git_reference> resolved;
+    if (git_reference_resolve(resolved, ref) == 0) {
+      rtv.push_back(*git_reference_target(resolved));
+    }
+    git_reference_free(ref);
+  }
+  return rtv;
+}
+
+bool Git::packComplete(
+  path const& idx,
+  vector<git_oid> const& roots,
+  git_index* index
+)
+{
+  gptr<git_odb> packed;
+  git_odb_backend* backend = nullptr;
+  if (git_odb_new(packed) || git_odb_backend_one_pack(&backend, idx.c_str())) {
+    return false;
+  }
+  git_odb_add_backend(packed, backend, 1);
+  gptr<git_odb> odb;
+  git_repository_odb(odb, m_repo);
+  /* walk every object from the roots; only trees, commits and tags
+    are read, blobs are just looked up */
+  vector<pair<git_oid,git_object_t>> todo;
+  for (auto const& root : roots) {
+    todo.emplace_back(root, GIT_OBJECT_ANY);
+  }
+  for (size_t i = 0; i < git_index_entrycount(index); i++) {
+    git_index_entry const* entry = git_index_get_byindex(index, i);
+    if (entry->mode != GIT_FILEMODE_COMMIT) {
+      todo.emplace_back(entry->id, GIT_OBJECT_BLOB);
+    }
+  }
+  unordered_set<string> seen;
+  while (! todo.empty()) {
+    git_oid const id = todo.back().first;
+    git_object_t type = todo.back().second;
+    todo.pop_back();
+    if (! seen.insert(git_oid_tostr_s(&id)).second) {
+      continue;
+    }
+    if (! git_odb_exists(packed, &id)) {
+      return false;
+    }
+    if (type == GIT_OBJECT_ANY) {
+      size_t len;
+      if (git_odb_read_header(&len, &type, odb, &id)) {
+        return false;
+      }
+    }
+    if (type == GIT_OBJECT_BLOB) {
+      continue;
+    }
+    gptr<git_object> obj;
+    if (git_object_lookup(obj, m_repo, &id, type)) {
+      return false;
+    }
+    if (type == GIT_OBJECT_TAG) {
+      git_tag const* t = reinterpret_cast<git_tag const*>(obj.get());
+      todo.emplace_back(*git_tag_target_id(t), git_tag_target_type(t));
+    } else if (type == GIT_OBJECT_COMMIT) {
+      git_commit const* c = reinterpret_cast<git_commit const*>(obj.get());
+      todo.emplace_back(*git_commit_tree_id(c), GIT_OBJECT_TREE);
+      for (unsigned p = 0; p < git_commit_parentcount(c); p++) {
+        todo.emplace_back(*git_commit_parent_id(c, p), GIT_OBJECT_COMMIT);
+      }
+    } else if (type == GIT_OBJECT_TREE) {
+      git_tree const* t = reinterpret_cast<git_tree const*>(obj.get());
+      for (size_t e = 0; e < git_tree_entrycount(t); e++) {
+        git_tree_entry const* entry = git_tree_entry_byindex(t, e);
+        /* submodules live in other repositories */
+        if (git_tree_entry_filemode(entry) != GIT_FILEMODE_COMMIT) {
+          todo.emplace_back(*git_tree_entry_id(entry), git_tree_entry_type(entry));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void Git::repack()
+{
+  path const objects = path(git_repository_path(m_repo)) / "objects";
+  gptr<git_packbuilder> pb;
+  git_packbuilder_new(pb, m_repo);
+  git_packbuilder_set_threads(pb, 0);
+  /* everything reachable from a ref */
+  gptr<git_revwalk> walk;
+  git_revwalk_new(walk, m_repo);
+  git_revwalk_push_glob(walk, "refs/*");
+  git_packbuilder_insert_walk(pb, walk);
+  /* the walk peels refs to commits, so add the annotated tag objects
+    and whatever a ref points to that is not a commit */
+  vector<git_oid> const roots = refTargets();
+  for (auto const& root : roots) {
+    git_oid id = root;
+    gptr<git_object> obj;
+    while (git_object_lookup(obj, m_repo, &id, GIT_OBJECT_ANY) == 0
+        && git_object_type(obj) == GIT_OBJECT_TAG) {
+      git_packbuilder_insert(pb, &id, nullptr);
+      git_oid_cpy(&id, git_tag_target_id(reinterpret_cast<git_tag const*>(obj.get())));
+    }
+    if (obj.get() && git_object_type(obj) != GIT_OBJECT_COMMIT) {
+      git_packbuilder_insert_recur(pb, &id, nullptr);
+    }
+  }
+  /* and whatever is staged but not committed yet */
+  gptr<git_index> index;
+  git_repository_index(index, m_repo);
+  for (size_t i = 0; i < git_index_entrycount(index); i++) {
+    git_index_entry const* entry = git_index_get_byindex(index, i);
+    if (entry->mode != GIT_FILEMODE_COMMIT) {
+      git_packbuilder_insert(pb, &entry->id, entry->path);
+    }
+  }
+  if (git_packbuilder_write(pb, nullptr, 0, nullptr, nullptr)) {
+    throw "repack failed";
+  }
+  string const pack = string("pack-") + git_oid_tostr_s(git_packbuilder_hash(pb));
+  /* nothing is deleted unless the new pack alone holds every object
+    the refs and the index need */
+  if (! packComplete(objects / "pack" / (pack + ".idx"), roots, index)) {
+    throw "repack left out objects";
+  }
+  vector<path> garbage;
+  for (auto const& i : directory_iterator(objects)) {
+    string const name = i.path().filename().string();
+    if (name.size() == 2 && isxdigit(name[0]) && isxdigit(name[1])) {
+      garbage.push_back(i.path());
+    }
+  }
+  for (auto const& i : directory_iterator(objects / "pack")) {
+    if (i.path().stem().string() != pack) {
+      garbage.push_back(i.path());
+    }
+  }
+  for (auto const& p : garbage) {
+    boost::filesystem::remove_all(p);
+  }
+  /* drop cached handles to the removed files */
+  gptr<git_repository> repo;
+  git_repository_open(repo, m_repo_path.c_str());
+  m_repo = std::move(repo);
+}
@@ -0,0 +1,174 @@
+#include <dptrp1/hostresolver.h>
+#include <boost/asio.hpp>
+#include <future>
+
+using namespace std;
+using dpt::HostResolver;
+using dpt::DeviceAddress;
+using boost::asio::ip::address;
+
+HostResolver::HostResolver(chrono::seconds ttl)
+  : m_ttl(ttl)
+{
+}
+
+HostResolver::~HostResolver()
+{
+  stopRefresh();
+}
+
+bool HostResolver::lookup(
+  string const& hostname,
+  unsigned port,
+  address* addr
+)
+{
+  try {
+    boost::asio::io_context ctx;
+    boost::asio::ip::tcp::resolver res(ctx);
+    auto const results = res.resolve(hostname, to_string(port));
+    if (results.empty()) {
+      return false;
+    }
+    *addr = results.begin()->endpoint().address();
+    return true;
+  } catch (boost::system::system_error const&) {
+    return false;
+  }
+}
+
+bool HostResolver::resolve(
+  string const& hostname,
+  unsigned port,
+  address* addr
+)
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    auto const i = m_entries.find(hostname);
+    if (i != m_entries.end() && i->second.expires > chrono::steady_clock::now()) {
+      if (addr) {
+        *addr = i->second.address;
+      }
+      return true;
+    }
+  }
+  /* not under the lock, it may take a while */
+  address resolved;
+  if (! lookup(hostname, port, &resolved)) {
+    invalidate(hostname);
+    return false;
+  }
+  store(hostname, resolved);
+  if (addr) {
+    *addr = resolved;
+  }
+  return true;
+}
+
+bool HostResolver::cached(string const& hostname, address* addr) const
+{
+  lock_guard<mutex> lock(m_mutex);
+  auto const i = m_entries.find(hostname);
+  if (i == m_entries.end()) {
+    return false;
+  }
+  *addr = i->second.address;
+  return true;
+}
+
+void HostResolver::invalidate(string const& hostname)
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_entries.erase(hostname);
+}
+
+void HostResolver::store(string const& hostname, address const& addr)
+{
+  lock_guard<mutex> lock(m_mutex);
+  m_entries[hostname] = Entry{addr, chrono::steady_clock::now() + m_ttl};
+}
+
+void HostResolver::startRefresh(string const& hostname, unsigned port)
+{
+  lock_guard<mutex> control(m_refresh_mutex);
+  string const target = hostname + ":" + to_string(port);
+  if (m_refresh.joinable() && m_refresh_target == target) {
+    return;
+  }
+  joinRefresh();
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_refresh_stop = false;
+  }
+  m_refresh_target = target;
+  m_refresh = thread(&HostResolver::refreshLoop, this, hostname, port);
+}
+
+void HostResolver::stopRefresh()
+{
+  lock_guard<mutex> control(m_refresh_mutex);
+  joinRefresh();
+}
+
+void HostResolver::joinRefresh()
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_refresh_stop = true;
+  }
+  m_refresh_cv.notify_all();
+  /* not under m_mutex, refreshLoop takes it to stop */
+  if (m_refresh.joinable()) {
+    m_refresh.join();
+  }
+  m_refresh_target.clear();
+}
+
+void HostResolver::refreshLoop(string hostname, unsigned port)
+{
+  unique_lock<mutex> lock(m_mutex);
+  while (! m_refresh_cv.wait_for(lock, m_ttl / 2, [this] { return m_refresh_stop; })) {
+    lock.unlock();
+    address resolved;
+    /* keep the old address if the device is briefly unreachable,
+      requests to it fail and invalidate it anyway */
+    if (lookup(hostname, port, &resolved)) {
+      store(hostname, resolved);
+    }
+    lock.lock();
+  }
+}
+
+vector<DeviceAddress> HostResolver::discover(
+  string const& hostname,
+  unsigned port,
+  size_t max_devices
+)
+{
+  /* digitalpaper.local -> digitalpaper-2.local */
+  size_t const dot = hostname.find('.');
+  string const label = hostname.substr(0, dot);
+  string const domain = dot == string::npos ? "" : hostname.substr(dot);
+  vector<future<DeviceAddress>> lookups;
+  for (size_t i = 1; i <= max_devices; i++) {
+    string const name =
+      i == 1 ? hostname : label + "-" + to_string(i) + domain;
+    lookups.push_back(async(launch::async, [name, port] {
+      DeviceAddress device;
+      if (lookup(name, port, &device.address)) {
+        device.hostname = name;
+      }
+      return device;
+    }));
+  }
+  vector<DeviceAddress> rtv;
+  for (auto& f : lookups) {
+    DeviceAddress device = f.get();
+    if (! device.hostname.empty()) {
+      store(device.hostname, device.address);
+      rtv.push_back(device);
+    }
+  }
+  return rtv;
+}
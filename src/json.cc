@@ -0,0 +1,738 @@
+#include <dptrp1/json.h>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using dpt::Json;
+using dpt::JsonKind;
+using dpt::JsonHandler;
+
+struct Json::Storage {
+  shared_ptr<void const> owner;
+  char const* begin = nullptr;
+  char const* end = nullptr;
+  /* put values and strings that had to be unescaped */
+  deque<string> strings;
+
+  string_view keep(string_view s)
+  {
+    if (s.empty() || (s.data() >= begin && s.data() + s.size() <= end)) {
+      return s;
+    }
+    strings.emplace_back(s);
+    return strings.back();
+  }
+};
+
+namespace {
+  class Parser {
+  public:
+    Parser(char const* body, size_t size, JsonHandler& handler)
+      : m_p(body), m_end(body + size), m_handler(handler)
+    {
+    }
+
+    void document()
+    {
+      space();
+      value(0);
+      space();
+      if (m_p != m_end) {
+        fail();
+      }
+    }
+
+  private:
+    /* deeper than anything the device sends */
+    static constexpr int MaxDepth = 256;
+
+    [[noreturn]] void fail() const
+    {
+      throw "malformed json";
+    }
+
+    void space()
+    {
+      while (
+        m_p != m_end
+          && (*m_p == ' ' || *m_p == '\n' || *m_p == '\r' || *m_p == '\t')
+      )
+      {
+        m_p++;
+      }
+    }
+
+    void expect(char c)
+    {
+      if (m_p == m_end || *m_p != c) {
+        fail();
+      }
+      m_p++;
+    }
+
+    void literal(char const* text, JsonKind kind)
+    {
+      size_t const n = strlen(text);
+      if (size_t(m_end - m_p) < n || memcmp(m_p, text, n) != 0) {
+        fail();
+      }
+      m_handler.value(kind, string_view(m_p, n));
+      m_p += n;
+    }
+
+    void value(int depth)
+    {
+      if (depth > MaxDepth || m_p == m_end) {
+        fail();
+      }
+      switch (*m_p) {
+        case '{':
+          object(depth);
+          break;
+        case '[':
+          array(depth);
+          break;
+        case '"':
+          m_handler.value(JsonKind::String, str());
+          break;
+        case 't':
+          literal("true", JsonKind::Bool);
+          break;
+        case 'f':
+          literal("false", JsonKind::Bool);
+          break;
+        case 'n':
+          literal("null", JsonKind::Null);
+          break;
+        default:
+          number();
+      }
+    }
+
+    void object(int depth)
+    {
+      m_p++;
+      m_handler.startObject();
+      space();
+      if (m_p != m_end && *m_p == '}') {
+        m_p++;
+        m_handler.endObject();
+        return;
+      }
+      while (true) {
+        space();
+        if (m_p == m_end || *m_p != '"') {
+          fail();
+        }
+        m_handler.key(str());
+        space();
+        expect(':');
+        space();
+        value(depth + 1);
+        space();
+        if (m_p != m_end && *m_p == ',') {
+          m_p++;
+          continue;
+        }
+        expect('}');
+        m_handler.endObject();
+        return;
+      }
+    }
+
+    void array(int depth)
+    {
+      m_p++;
+      m_handler.startArray();
+      space();
+      if (m_p != m_end && *m_p == ']') {
+        m_p++;
+        m_handler.endArray();
+        return;
+      }
+      while (true) {
+        space();
+        value(depth + 1);
+        space();
+        if (m_p != m_end && *m_p == ',') {
+          m_p++;
+          continue;
+        }
+        expect(']');
+        m_handler.endArray();
+        return;
+      }
+    }
+
+    void number()
+    {
+      char const* const start = m_p;
+      if (m_p != m_end && *m_p == '-') {
+        m_p++;
+      }
+      size_t const int_digits = digits();
+      if (int_digits == 0) {
+        fail();
+      }
+      if (m_p != m_end && *m_p == '.') {
+        m_p++;
+        if (digits() == 0) {
+          fail();
+        }
+      }
+      if (m_p != m_end && (*m_p == 'e' || *m_p == 'E')) {
+        m_p++;
+        if (m_p != m_end && (*m_p == '+' || *m_p == '-')) {
+          m_p++;
+        }
+        if (digits() == 0) {
+          fail();
+        }
+      }
+      m_handler.value(JsonKind::Number, string_view(start, m_p - start));
+    }
+
+    size_t digits()
+    {
+      char const* const start = m_p;
+      while (m_p != m_end && *m_p >= '0' && *m_p <= '9') {
+        m_p++;
+      }
+      return m_p - start;
+    }
+
+    /* A view into the input, unless the string has escapes, in
+      which case it is unescaped into m_scratch */
+    string_view str()
+    {
+      m_p++;
+      char const* const start = m_p;
+      while (m_p != m_end && *m_p != '"' && *m_p != '\\') {
+        m_p++;
+      }
+      if (m_p == m_end) {
+        fail();
+      }
+      if (*m_p == '"') {
+        return string_view(start, m_p++ - start);
+      }
+      m_scratch.assign(start, m_p);
+      while (true) {
+        if (m_p == m_end) {
+          fail();
+        }
+        char const c = *m_p++;
+        if (c == '"') {
+          return m_scratch;
+        }
+        if (c != '\\') {
+          m_scratch += c;
+          continue;
+        }
+        if (m_p == m_end) {
+          fail();
+        }
+        switch (*m_p++) {
+          case '"': m_scratch += '"'; break;
+          case '\\': m_scratch += '\\'; break;
+          case '/': m_scratch += '/'; break;
+          case 'b': m_scratch += '\b'; break;
+          case 'f': m_scratch += '\f'; break;
+          case 'n': m_scratch += '\n'; break;
+          case 'r': m_scratch += '\r'; break;
+          case 't': m_scratch += '\t'; break;
+          case 'u': codepoint(); break;
+          default: fail();
+        }
+      }
+    }
+
+    unsigned hex4()
+    {
+      if (m_end - m_p < 4) {
+        fail();
+      }
+      unsigned rtv = 0;
+      for (int i = 0; i < 4; i++) {
+        char const c = *m_p++;
+        rtv <<= 4;
+        if (c >= '0' && c <= '9') {
+          rtv |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+          rtv |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+          rtv |= c - 'A' + 10;
+        } else {
+          fail();
+        }
+      }
+      return rtv;
+    }
+
+    /* \uXXXX, possibly a surrogate pair, as utf-8 */
+    void codepoint()
+    {
+      unsigned cp = hex4();
+      if (cp >= 0xD800 && cp < 0xDC00) {
+        if (m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u') {
+          fail();
+        }
+        m_p += 2;
+        unsigned const low = hex4();
+        if (low < 0xDC00 || low >= 0xE000) {
+          fail();
+        }
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+      }
+      if (cp < 0x80) {
+        m_scratch += char(cp);
+      } else if (cp < 0x800) {
+        m_scratch += char(0xC0 | (cp >> 6));
+        m_scratch += char(0x80 | (cp & 0x3F));
+      } else if (cp < 0x10000) {
+        m_scratch += char(0xE0 | (cp >> 12));
+        m_scratch += char(0x80 | ((cp >> 6) & 0x3F));
+        m_scratch += char(0x80 | (cp & 0x3F));
+      } else {
+        m_scratch += char(0xF0 | (cp >> 18));
+        m_scratch += char(0x80 | ((cp >> 12) & 0x3F));
+        m_scratch += char(0x80 | ((cp >> 6) & 0x3F));
+        m_scratch += char(0x80 | (cp & 0x3F));
+      }
+    }
+
+    char const* m_p;
+    char const* m_end;
+    JsonHandler& m_handler;
+    string m_scratch;
+  };
+}
+
+namespace dpt {
+  /* Builds nodes from parser events */
+  class JsonBuilder : public JsonHandler {
+  public:
+    JsonBuilder(Json::Storage& storage) : m_storage(storage) {}
+
+    /* Start over with root as the node to fill */
+    void reset(Json* root)
+    {
+      m_root = root;
+      m_root->m_kind = JsonKind::Null;
+      m_root->m_data = string_view();
+      /* keeps the capacity for the next element */
+      m_root->m_children.clear();
+      m_stack.clear();
+    }
+
+    bool done() const noexcept { return m_stack.empty(); }
+
+    void startObject() override { open(JsonKind::Object); }
+    void endObject() override { m_stack.pop_back(); }
+    void startArray() override { open(JsonKind::Array); }
+    void endArray() override { m_stack.pop_back(); }
+
+    void key(string_view key) override
+    {
+      m_key = m_storage.keep(key);
+    }
+
+    void value(JsonKind kind, string_view text) override
+    {
+      Json* node = next();
+      node->m_kind = kind;
+      node->m_data = m_storage.keep(text);
+    }
+
+  private:
+    void open(JsonKind kind)
+    {
+      Json* node = next();
+      node->m_kind = kind;
+      m_stack.push_back(node);
+    }
+
+    Json* next()
+    {
+      if (m_stack.empty()) {
+        return m_root;
+      }
+      Json* parent = m_stack.back();
+      parent->m_children.emplace_back(
+        parent->m_kind == JsonKind::Array ? string_view() : m_key,
+        Json()
+      );
+      return &parent->m_children.back().second;
+    }
+
+    Json::Storage& m_storage;
+    Json* m_root = nullptr;
+    vector<Json*> m_stack;
+    string_view m_key;
+  };
+}
+
+namespace {
+  /* Sends the elements of one top level array to a visitor and
+    everything else to the document */
+  class ElementStreamer : public JsonHandler {
+  public:
+    ElementStreamer(
+      dpt::JsonBuilder& root_builder,
+      dpt::JsonBuilder& element_builder,
+      string_view key,
+      std::function<void(Json const&)> const& visit
+    )
+      : m_root_builder(root_builder),
+        m_element_builder(element_builder),
+        m_key(key),
+        m_visit(visit)
+    {
+    }
+
+    void startObject() override
+    {
+      if (m_streaming) {
+        startElement();
+        m_element_builder.startObject();
+      } else {
+        m_root_builder.startObject();
+      }
+      m_depth++;
+    }
+
+    void endObject() override
+    {
+      m_depth--;
+      if (m_streaming) {
+        m_element_builder.endObject();
+        endElement();
+      } else {
+        m_root_builder.endObject();
+      }
+    }
+
+    void startArray() override
+    {
+      if (m_streaming) {
+        startElement();
+        m_element_builder.startArray();
+      } else {
+        m_root_builder.startArray();
+        m_streaming = m_depth == 1 && m_at_key;
+      }
+      m_depth++;
+    }
+
+    void endArray() override
+    {
+      m_depth--;
+      if (m_streaming && m_depth == 1) {
+        m_streaming = false;
+        m_root_builder.endArray();
+      } else if (m_streaming) {
+        m_element_builder.endArray();
+        endElement();
+      } else {
+        m_root_builder.endArray();
+      }
+    }
+
+    void key(string_view key) override
+    {
+      if (m_streaming) {
+        m_element_builder.key(key);
+      } else {
+        m_at_key = m_depth == 1 && key == m_key;
+        m_root_builder.key(key);
+      }
+    }
+
+    void value(JsonKind kind, string_view text) override
+    {
+      if (m_streaming) {
+        startElement();
+        m_element_builder.value(kind, text);
+        endElement();
+      } else {
+        m_root_builder.value(kind, text);
+      }
+    }
+
+  private:
+    void startElement()
+    {
+      if (m_depth == 2) {
+        m_element_builder.reset(&m_element);
+      }
+    }
+
+    void endElement()
+    {
+      if (m_depth == 2) {
+        m_visit(m_element);
+      }
+    }
+
+    dpt::JsonBuilder& m_root_builder;
+    dpt::JsonBuilder& m_element_builder;
+    string_view m_key;
+    std::function<void(Json const&)> const& m_visit;
+    Json m_element;
+    int m_depth = 0;
+    bool m_at_key = false;
+    bool m_streaming = false;
+  };
+}
+
+Json Json::fromString(string const& body)
+{
+  return fromBytes(body.data(), body.size());
+}
+
+Json Json::fromBytes(char const* body, size_t size)
+{
+  if (size == 0) {
+    return Json();
+  }
+  auto copy = make_shared<string>(body, size);
+  return fromBuffer(copy, copy->data(), copy->size());
+}
+
+Json Json::fromBuffer(
+  shared_ptr<void const> owner,
+  char const* body,
+  size_t size
+)
+{
+  Json rtv;
+  if (size == 0) {
+    return rtv;
+  }
+  Storage& storage = rtv.storage();
+  storage.owner = std::move(owner);
+  storage.begin = body;
+  storage.end = body + size;
+  JsonBuilder builder(storage);
+  builder.reset(&rtv);
+  parse(body, size, builder);
+  return rtv;
+}
+
+void Json::parse(char const* body, size_t size, JsonHandler& handler)
+{
+  Parser(body, size, handler).document();
+}
+
+Json Json::forEachElement(
+  shared_ptr<void const> owner,
+  char const* body,
+  size_t size,
+  string_view key,
+  std::function<void(Json const&)> const& visit
+)
+{
+  Json rtv;
+  if (size == 0) {
+    return rtv;
+  }
+  Storage& storage = rtv.storage();
+  storage.owner = std::move(owner);
+  storage.begin = body;
+  storage.end = body + size;
+  JsonBuilder root_builder(storage);
+  JsonBuilder element_builder(storage);
+  root_builder.reset(&rtv);
+  ElementStreamer streamer(root_builder, element_builder, key, visit);
+  parse(body, size, streamer);
+  return rtv;
+}
+
+Json const* Json::findChild(string_view path) const noexcept
+{
+  Json const* node = this;
+  if (path.empty()) {
+    return node;
+  }
+  while (node) {
+    size_t const dot = path.find('.');
+    string_view const key = path.substr(0, dot);
+    Json const* found = nullptr;
+    /* objects from the device are small, a scan beats a map */
+    for (auto const& kv : node->m_children) {
+      if (kv.first == key) {
+        found = &kv.second;
+        break;
+      }
+    }
+    node = found;
+    if (dot == string_view::npos) {
+      break;
+    }
+    path.remove_prefix(dot + 1);
+  }
+  return node;
+}
+
+Json const& Json::get_child(string_view path) const
+{
+  Json const* node = findChild(path);
+  if (! node) {
+    throw "missing json field";
+  }
+  return *node;
+}
+
+Json::Storage& Json::storage()
+{
+  if (! m_storage) {
+    m_storage = make_shared<Storage>();
+  }
+  return *m_storage;
+}
+
+void Json::putValue(
+  string_view key,
+  JsonKind kind,
+  string_view text,
+  bool replace
+)
+{
+  Storage& s = storage();
+  s.strings.emplace_back(text);
+  Json node;
+  node.m_kind = kind;
+  node.m_data = s.strings.back();
+  if (replace) {
+    for (auto& kv : m_children) {
+      if (kv.first == key) {
+        kv.second = std::move(node);
+        return;
+      }
+    }
+  }
+  m_children.emplace_back(s.keep(key), std::move(node));
+}
+
+void Json::add_child(string_view key, Json const& child)
+{
+  m_children.emplace_back(storage().keep(key), child);
+}
+
+Json Json::array()
+{
+  Json rtv;
+  rtv.m_kind = JsonKind::Array;
+  return rtv;
+}
+
+namespace {
+  void writeString(string& out, string_view s)
+  {
+    out += '"';
+    for (char const c : s) {
+      switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+          } else {
+            out += c;
+          }
+      }
+    }
+    out += '"';
+  }
+}
+
+void Json::write(string& out) const
+{
+  switch (m_kind) {
+    case JsonKind::Object:
+    case JsonKind::Array: {
+      bool const object = m_kind == JsonKind::Object;
+      out += object ? '{' : '[';
+      for (auto i = m_children.begin(); i != m_children.end(); i++) {
+        if (i != m_children.begin()) {
+          out += ',';
+        }
+        if (object) {
+          writeString(out, i->first);
+          out += ':';
+        }
+        i->second.write(out);
+      }
+      out += object ? '}' : ']';
+      break;
+    }
+    case JsonKind::String:
+      writeString(out, m_data);
+      break;
+    default:
+      out += m_data;
+  }
+}
+
+string Json::toString() const
+{
+  string rtv;
+  write(rtv);
+  return rtv;
+}
+
+bool Json::convert(string_view text, string* out)
+{
+  out->assign(text.data(), text.size());
+  return true;
+}
+
+bool Json::convert(string_view text, bool* out)
+{
+  if (text == "true" || text == "1") {
+    *out = true;
+  } else if (text == "false" || text == "0") {
+    *out = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool Json::convert(string_view text, double* out)
+{
+  /* strtod wants a terminated string, numbers are short */
+  char buf[64];
+  if (text.empty() || text.size() >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, text.data(), text.size());
+  buf[text.size()] = '\0';
+  char* end;
+  *out = strtod(buf, &end);
+  return end == buf + text.size();
+}
+
+bool Json::convert(string_view text, float* out)
+{
+  double d;
+  if (! convert(text, &d)) {
+    return false;
+  }
+  *out = static_cast<float>(d);
+  return true;
+}
+
+string Json::doubleText(double value)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  return buf;
+}
@@ -0,0 +1,389 @@
+#include <dptrp1/linksnapshot.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include <cstdio>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace dpt;
+using boost::filesystem::path;
+using boost::filesystem::directory_iterator;
+
+LinkSnapshot::LinkSnapshot(path const& dir)
+  : LinkSnapshot(dir, dir / ".snapshots")
+{
+}
+
+LinkSnapshot::LinkSnapshot(path const& dir, path const& store)
+{
+  m_dir = dir;
+  m_store = store;
+  boost::filesystem::create_directories(m_store);
+}
+
+path LinkSnapshot::dir() const
+{
+  return m_dir;
+}
+
+vector<string> LinkSnapshot::ids() const
+{
+  vector<string> rtv;
+  for (auto const& i : directory_iterator(m_store)) {
+    string const name = i.path().filename().string();
+    /* unfinished snapshots are named <id>.tmp */
+    if (is_directory(i.path()) && name.find('.') == string::npos) {
+      rtv.push_back(name);
+    }
+  }
+  /* ids are zero-padded, so this is creation order */
+  sort(rtv.begin(), rtv.end());
+  return rtv;
+}
+
+string LinkSnapshot::latest() const
+{
+  vector<string> const all = ids();
+  return all.empty() ? "" : all.back();
+}
+
+LinkSnapshot::Manifest LinkSnapshot::readManifest(
+  string const& id,
+  time_t* time
+) const
+{
+  Manifest manifest;
+  ifstream inf((m_store / id / "manifest").string());
+  string line;
+  /* first line is when the snapshot was taken */
+  getline(inf, line);
+  if (time) {
+    *time = line.empty() ? 0 : stoll(line);
+  }
+  while (getline(inf, line)) {
+    istringstream iss(line);
+    Entry entry;
+    iss >> entry.size >> entry.mtime;
+    iss.get();
+    string relpath;
+    getline(iss, relpath);
+    manifest[relpath] = entry;
+  }
+  return manifest;
+}
+
+void LinkSnapshot::trackHidden(rpath const& relpath)
+{
+  m_tracked_hidden.insert(relpath.generic_string());
+}
+
+bool LinkSnapshot::ignored(string const& relpath) const
+{
+  if (m_tracked_hidden.count(relpath)) {
+    return false;
+  }
+  /* hidden files and whatever is in a hidden directory */
+  return relpath[0] == '.' || relpath.find("/.") != string::npos;
+}
+
+void LinkSnapshot::scan(path const& p, Manifest& manifest) const
+{
+  size_t const root = m_dir.generic_string().size() + 1;
+  if (is_directory(p)) {
+    for (auto const& i : directory_iterator(p)) {
+      /* ignore hidden files, like the local tree does */
+      if (
+        i.path().filename().string()[0] == '.'
+          && ! m_tracked_hidden.count(i.path().generic_string().substr(root))
+      )
+      {
+        continue;
+      }
+      scan(i.path(), manifest);
+    }
+  } else if (is_regular_file(p)) {
+    string const f = p.generic_string();
+    Entry entry;
+    entry.size = file_size(p);
+    entry.mtime = last_write_time(p);
+    manifest[f.substr(root)] = entry;
+  }
+}
+
+void LinkSnapshot::copyOut(path const& from, path const& to, time_t mtime) const
+{
+  create_directories(to.parent_path());
+  boost::filesystem::remove(to);
+  if (! reflink(from, to)) {
+    copy_file(from, to);
+  }
+  last_write_time(to, mtime);
+}
+
+string LinkSnapshot::commitSnapshot(
+  string const& title,
+  Manifest const& manifest,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  string const prev_id = latest();
+  Manifest const prev = prev_id.empty() ? Manifest() : readManifest(prev_id);
+  char id[16];
+  snprintf(
+    id, sizeof(id), "%010llu",
+    prev_id.empty() ? 1ULL : stoull(prev_id) + 1
+  );
+  path const tmp = m_store / (string(id) + ".tmp");
+  boost::filesystem::remove_all(tmp);
+  create_directories(tmp / "files");
+  vector<pair<string,string>> changes;
+  for (auto const& i : manifest) {
+    path const dest = tmp / "files" / i.first;
+    create_directories(dest.parent_path());
+    auto const old = prev.find(i.first);
+    bool const unchanged =
+      old != prev.end()
+        && old->second.size == i.second.size
+        && old->second.mtime == i.second.mtime;
+    if (unchanged) {
+      boost::system::error_code ec;
+      create_hard_link(m_store / prev_id / "files" / i.first, dest, ec);
+      if (! ec) {
+        continue;
+      }
+    } else {
+      changes.push_back(
+        make_pair(old == prev.end() ? "new" : "modified", i.first)
+      );
+    }
+    /* never link to the live file, the sync writes it in place */
+    copyOut(m_dir / i.first, dest, i.second.mtime);
+  }
+  for (auto const& i : prev) {
+    if (manifest.find(i.first) == manifest.end()) {
+      changes.push_back(make_pair("deleted", i.first));
+    }
+  }
+  applyRenames(changes, renames);
+  ostringstream oss;
+  if (changes.empty()) {
+    oss << "nothing new" << endl;
+  } else {
+    oss << "total changes: " << changes.size() << endl;
+  }
+  for (auto const& change : changes) {
+    oss << "staged: " << change.first << ": " << change.second << endl;
+  }
+  string const summary = oss.str();
+  {
+    ofstream outf((tmp / "manifest").string());
+    outf << time(nullptr) << endl;
+    for (auto const& i : manifest) {
+      outf << i.second.size << " " << i.second.mtime << " " << i.first << endl;
+    }
+    ofstream msgf((tmp / "message").string());
+    msgf << title << "\n\n" << summary;
+  }
+  rename(tmp, m_store / id);
+  return summary;
+}
+
+string LinkSnapshot::checkpoint(
+  string const& title,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  Manifest manifest;
+  scan(m_dir, manifest);
+  return commitSnapshot(title, manifest, renames);
+}
+
+string LinkSnapshot::checkpoint(
+  string const& title,
+  vector<rpath> const& paths,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  /* everything else is carried over from the last snapshot */
+  string const prev_id = latest();
+  Manifest manifest = prev_id.empty() ? Manifest() : readManifest(prev_id);
+  for (auto const& rel : paths) {
+    string const p = rel.generic_string();
+    /* the same files a full checkpoint looks at */
+    if (p.empty() || ignored(p)) {
+      continue;
+    }
+    string const prefix = p + "/";
+    manifest.erase(p);
+    for (
+      auto i = manifest.lower_bound(prefix);
+      i != manifest.end() && i->first.compare(0, prefix.size(), prefix) == 0;
+    )
+    {
+      i = manifest.erase(i);
+    }
+    scan(m_dir / rel, manifest);
+  }
+  return commitSnapshot(title, manifest, renames);
+}
+
+void LinkSnapshot::rollback()
+{
+  string const id = latest();
+  if (id.empty()) {
+    return;
+  }
+  Manifest const manifest = readManifest(id);
+  Manifest current;
+  scan(m_dir, current);
+  for (auto const& i : current) {
+    if (manifest.find(i.first) == manifest.end()) {
+      boost::filesystem::remove(m_dir / i.first);
+    }
+  }
+  for (auto const& i : manifest) {
+    auto const now = current.find(i.first);
+    if (
+      now == current.end()
+        || now->second.size != i.second.size
+        || now->second.mtime != i.second.mtime
+    )
+    {
+      copyOut(m_store / id / "files" / i.first, m_dir / i.first, i.second.mtime);
+    }
+  }
+}
+
+vector<GitCommitRecord> LinkSnapshot::historyPage(
+  size_t limit,
+  string const& after
+)
+{
+  vector<string> const all = ids();
+  vector<GitCommitRecord> rtv;
+  auto i = all.rbegin();
+  if (! after.empty()) {
+    i = find(all.rbegin(), all.rend(), after);
+    if (i != all.rend()) {
+      i++;
+    }
+  }
+  for (; i != all.rend() && rtv.size() < limit; i++) {
+    GitCommitRecord record;
+    record.commit = *i;
+    ifstream timef((m_store / *i / "manifest").string());
+    timef >> record.time;
+    ifstream msgf((m_store / *i / "message").string());
+    record.message.assign(
+      istreambuf_iterator<char>(msgf),
+      istreambuf_iterator<char>()
+    );
+    rtv.push_back(record);
+  }
+  return rtv;
+}
+
+vector<GitFileVersion> LinkSnapshot::versions(rpath const& relpath)
+{
+  string const p = relpath.generic_string();
+  vector<GitFileVersion> rtv;
+  bool present = false;
+  Entry last;
+  for (auto const& id : ids()) {
+    time_t time;
+    Manifest const manifest = readManifest(id, &time);
+    auto const i = manifest.find(p);
+    if (i == manifest.end()) {
+      present = false;
+      continue;
+    }
+    /* a version starts where the file last changed */
+    if (present && last.size == i->second.size && last.mtime == i->second.mtime) {
+      continue;
+    }
+    present = true;
+    last = i->second;
+    GitFileVersion version;
+    version.commit = id;
+    version.blob = (m_store / id / "files" / relpath).string();
+    version.size = i->second.size;
+    version.time = time;
+    rtv.push_back(version);
+  }
+  reverse(rtv.begin(), rtv.end());
+  return rtv;
+}
+
+void LinkSnapshot::restoreVersion(
+  GitFileVersion const& version,
+  path const& dest
+)
+{
+  copyOut(version.blob, dest, last_write_time(path(version.blob)));
+}
+
+void LinkSnapshot::exportTree(string const& id, path const& dest)
+{
+  string const snapshot = id.empty() || id == "HEAD" ? latest() : id;
+  if (snapshot.empty() || ! exists(m_store / snapshot / "manifest")) {
+    throw "no such snapshot";
+  }
+  for (auto const& i : readManifest(snapshot)) {
+    copyOut(m_store / snapshot / "files" / i.first, dest / i.first, i.second.mtime);
+  }
+}
+
+uintmax_t LinkSnapshot::size() const
+{
+  /* hardlinked files take space only once */
+  set<pair<dev_t,ino_t>> seen;
+  uintmax_t total = 0;
+  for (
+    boost::filesystem::recursive_directory_iterator i(m_store), end;
+    i != end;
+    i++
+  )
+  {
+    struct stat st;
+    if (
+      is_regular_file(i->path())
+        && stat(i->path().string().c_str(), &st) == 0
+        && seen.insert(make_pair(st.st_dev, st.st_ino)).second
+    )
+    {
+      total += st.st_size;
+    }
+  }
+  return total;
+}
+
+MaintenanceReport LinkSnapshot::maintain(
+  RetentionPolicy const& policy,
+  time_t now
+)
+{
+  MaintenanceReport report;
+  report.size_before = size();
+  vector<string> const all = ids();
+  vector<time_t> times;
+  for (auto const& id : all) {
+    time_t time = 0;
+    ifstream timef((m_store / id / "manifest").string());
+    timef >> time;
+    times.push_back(time);
+  }
+  vector<bool> const keep = retained(times, policy, now);
+  report.commits_before = all.size();
+  for (size_t i = 0; i < all.size(); i++) {
+    if (keep[i]) {
+      report.commits_after++;
+    } else {
+      /* later snapshots hold their own links to shared files */
+      boost::filesystem::remove_all(m_store / all[i]);
+    }
+  }
+  report.size_after = size();
+  return report;
+}
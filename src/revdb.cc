@@ -14,11 +14,23 @@ using boost::filesystem::path;
 void RevDB::open(path const& db)
 {
   sqlite3_open(db.c_str(), &m_db);
+  /* databases from before the git_oid column; fails harmlessly
+    when it is there */
+  sqlite3_exec(
+    m_db,
+    "ALTER TABLE files ADD COLUMN git_oid TEXT",
+    nullptr, nullptr, nullptr
+  );
 }
 
 void RevDB::close()
 {
+  /* never opened, or closed already */
+  if (! m_db) {
+    return;
+  }
   sqlite3_close_v2(m_db);
+  m_db = nullptr;
 }
 
 vector<string> RevDB::getByRelPath(rpath const& q) const
@@ -34,9 +46,11 @@ vector<string> RevDB::getByRelPath(rpath const& q) const
     rel_path = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
     local_md5 = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 1));
     dpt_rev = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 2));
+    auto const git_oid = sqlite3_column_text(stmt, 3);
     rtv.push_back(rel_path);
     rtv.push_back(local_md5);
     rtv.push_back(dpt_rev);
+    rtv.push_back(git_oid ? reinterpret_cast<char const*>(git_oid) : "");
   }
   sqlite3_finalize(stmt);
   return rtv;
@@ -55,9 +69,11 @@ vector<string> RevDB::getByDptRev(string const& q) const
     rel_path = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
     local_md5 = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 1));
     dpt_rev = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 2));
+    auto const git_oid = sqlite3_column_text(stmt, 3);
     rtv.push_back(rel_path);
     rtv.push_back(local_md5);
     rtv.push_back(dpt_rev);
+    rtv.push_back(git_oid ? reinterpret_cast<char const*>(git_oid) : "");
   }
   sqlite3_finalize(stmt);
   return rtv;
@@ -76,21 +92,47 @@ vector<string> RevDB::getByLocalRev(string const& q) const
     rel_path = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
     local_md5 = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 1));
     dpt_rev = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 2));
+    auto const git_oid = sqlite3_column_text(stmt, 3);
     rtv.push_back(rel_path);
     rtv.push_back(local_md5);
     rtv.push_back(dpt_rev);
+    rtv.push_back(git_oid ? reinterpret_cast<char const*>(git_oid) : "");
   }
   sqlite3_finalize(stmt);
   return rtv;
 }
 
-void RevDB::putRev(path const& rel_path, string const& local_md5, string const& dpt_rev) const
+unordered_map<string,string> RevDB::localRevsByDptRev() const
 {
   sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "INSERT INTO files VALUES (?,?,?)", -1, &stmt, nullptr);
+  sqlite3_prepare_v2(m_db, "SELECT dpt_rev, local_md5 FROM files", -1, &stmt, nullptr);
+  unordered_map<string,string> rtv;
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    auto const dpt_rev = sqlite3_column_text(stmt, 0);
+    auto const local_md5 = sqlite3_column_text(stmt, 1);
+    if (dpt_rev && local_md5) {
+      rtv.emplace(
+        reinterpret_cast<char const*>(dpt_rev),
+        reinterpret_cast<char const*>(local_md5)
+      );
+    }
+  }
+  sqlite3_finalize(stmt);
+  return rtv;
+}
+
+void RevDB::putRev(path const& rel_path, string const& local_md5, string const& dpt_rev, string const& git_oid) const
+{
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(m_db, "INSERT INTO files (rel_path, local_md5, dpt_rev, git_oid) VALUES (?,?,?,?)", -1, &stmt, nullptr);
   sqlite3_bind_text(stmt, 1, rel_path.c_str(), -1, nullptr);
   sqlite3_bind_text(stmt, 2, local_md5.c_str(), -1, nullptr);
   sqlite3_bind_text(stmt, 3, dpt_rev.c_str(), -1, nullptr);
+  if (git_oid.empty()) {
+    sqlite3_bind_null(stmt, 4);
+  } else {
+    sqlite3_bind_text(stmt, 4, git_oid.c_str(), -1, nullptr);
+  }
   bool success;
   int result = sqlite3_step(stmt);
   while (result == SQLITE_BUSY) {
@@ -110,6 +152,16 @@ void RevDB::putRev(path const& rel_path, string const& local_md5, string const&
 
 void RevDB::reset()
 {
+  /* keep the blob ids for previousGitOid() */
+  sqlite3_exec(
+    m_db,
+    "DROP TABLE IF EXISTS temp.previous;"
+    "CREATE TEMP TABLE previous AS"
+    " SELECT rel_path, local_md5, git_oid FROM main.files"
+    " WHERE git_oid IS NOT NULL;"
+    "CREATE UNIQUE INDEX temp.previous_rel_path ON previous(rel_path);",
+    nullptr, nullptr, nullptr
+  );
   sqlite3_stmt* stmt;
   sqlite3_prepare_v2(m_db, "DELETE FROM files", -1, &stmt, nullptr);
   bool success;
@@ -129,6 +181,76 @@ void RevDB::reset()
   }
 }
 
+string RevDB::previousGitOid(rpath const& q, string const& local_md5) const
+{
+  sqlite3_stmt* stmt;
+  if (
+    sqlite3_prepare_v2(
+      m_db,
+      "SELECT git_oid FROM temp.previous WHERE rel_path = ? AND local_md5 = ?",
+      -1, &stmt, nullptr
+    ) != SQLITE_OK
+  )
+  {
+    /* no reset() yet */
+    sqlite3_finalize(stmt);
+    return "";
+  }
+  sqlite3_bind_text(stmt, 1, q.c_str(), -1, nullptr);
+  sqlite3_bind_text(stmt, 2, local_md5.c_str(), -1, nullptr);
+  string rtv;
+  if (SQLITE_ROW == sqlite3_step(stmt)) {
+    rtv = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  return rtv;
+}
+
+unique_ptr<RevCursor> RevDB::sorted() const
+{
+  return unique_ptr<RevCursor>(new RevCursor(m_db));
+}
+
+RevCursor::RevCursor(sqlite3* db)
+{
+  /* '/' must sort before any other byte to match pathLess */
+  sqlite3_prepare_v2(
+    db,
+    "SELECT * FROM files ORDER BY replace(rel_path, '/', char(1))",
+    -1, &m_stmt, nullptr
+  );
+}
+
+RevCursor::~RevCursor()
+{
+  sqlite3_finalize(m_stmt);
+}
+
+bool RevCursor::next(vector<string>* row)
+{
+  if (SQLITE_ROW != sqlite3_step(m_stmt)) {
+    return false;
+  }
+  row->clear();
+  for (int i = 0; i < 4; i++) {
+    auto const text = sqlite3_column_text(m_stmt, i);
+    row->push_back(text ? reinterpret_cast<char const*>(text) : "");
+  }
+  return true;
+}
+
+
+namespace {
+  string md5hex(unsigned char const* result)
+  {
+    std::stringstream md5string;
+    md5string << std::hex << std::uppercase << std::setfill('0');
+    for (size_t i = 0; i < MD5_DIGEST_LENGTH; i++) {
+      md5string << std::setw(2) << (int)result[i];
+    }
+    return md5string.str();
+  }
+}
 
 string dpt::md5(path const& fpath)
 {
@@ -142,10 +264,12 @@ string dpt::md5(path const& fpath)
   }
   unsigned char result[MD5_DIGEST_LENGTH];
   MD5_Final(result, &md5Context);
-  std::stringstream md5string;
-  md5string << std::hex << std::uppercase << std::setfill('0');
-  for (const auto &byte: result) {
-    md5string << std::setw(2) << (int)byte;
-  }
-  return md5string.str();
+  return md5hex(result);
+}
+
+string dpt::md5(void const* data, size_t size)
+{
+  unsigned char result[MD5_DIGEST_LENGTH];
+  MD5(static_cast<unsigned char const*>(data), size, result);
+  return md5hex(result);
 }
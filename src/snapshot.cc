@@ -0,0 +1,122 @@
+#include <dptrp1/snapshot.h>
+#include <unordered_map>
+#include <map>
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+using namespace std;
+using namespace dpt;
+
+bool Snapshot::reflink(path const& from, path const& to)
+{
+  #if defined(__APPLE__)
+  return clonefile(from.c_str(), to.c_str(), 0) == 0;
+  #elif defined(__linux__) && defined(FICLONE)
+  int src = open(from.c_str(), O_RDONLY);
+  if (src < 0) {
+    return false;
+  }
+  int dst = open(to.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (dst < 0) {
+    close(src);
+    return false;
+  }
+  bool ok = ioctl(dst, FICLONE, src) == 0;
+  close(src);
+  close(dst);
+  if (! ok) {
+    boost::filesystem::remove(to);
+  }
+  return ok;
+  #else
+  (void)from;
+  (void)to;
+  return false;
+  #endif
+}
+
+void Snapshot::applyRenames(
+  vector<pair<string,string>>& changes,
+  vector<pair<rpath,rpath>> const& renames
+)
+{
+  if (renames.empty()) {
+    return;
+  }
+  unordered_map<string,size_t> added;
+  for (size_t i = 0; i < changes.size(); i++) {
+    if (changes[i].first == "new") {
+      added[changes[i].second] = i;
+    }
+  }
+  /* deletions by path, so that a renamed directory finds the files
+    under it with a range instead of going over every change */
+  map<string,size_t> deleted;
+  for (size_t i = 0; i < changes.size(); i++) {
+    if (changes[i].first == "deleted") {
+      deleted[changes[i].second] = i;
+    }
+  }
+  vector<bool> dropped(changes.size(), false);
+  auto pair_up = [&](map<string,size_t>::iterator d, string const& to) {
+    string const& p = d->first;
+    auto const j = added.find(to);
+    if (j == added.end() || dropped[j->second]) {
+      return std::next(d);
+    }
+    changes[d->second].first = "renamed";
+    changes[d->second].second = p + " ~> " + j->first;
+    dropped[j->second] = true;
+    return deleted.erase(d);
+  };
+  for (auto const& rename : renames) {
+    string const from = rename.first.generic_string();
+    string const to = rename.second.generic_string();
+    auto const self = deleted.find(from);
+    if (self != deleted.end()) {
+      pair_up(self, to);
+    }
+    string const prefix = from + "/";
+    auto d = deleted.lower_bound(prefix);
+    while (
+      d != deleted.end() && d->first.compare(0, prefix.size(), prefix) == 0
+    )
+    {
+      d = pair_up(d, to + d->first.substr(from.size()));
+    }
+  }
+  size_t k = 0;
+  for (size_t i = 0; i < changes.size(); i++) {
+    if (! dropped[i]) {
+      changes[k++] = changes[i];
+    }
+  }
+  changes.resize(k);
+}
+
+vector<bool> Snapshot::retained(
+  vector<time_t> const& times,
+  RetentionPolicy const& policy,
+  time_t now
+)
+{
+  /* the newest checkpoint of each bucket wins */
+  time_t const day = 24 * 60 * 60;
+  vector<bool> keep(times.size(), false);
+  for (size_t i = 0; i < times.size(); i++) {
+    time_t const age = now - times[i];
+    if (i == 0 || i + 1 == times.size() || age < policy.keep_all_days * day) {
+      keep[i] = true;
+      continue;
+    }
+    time_t const bucket = age < policy.keep_daily_days * day ? day : 7 * day;
+    keep[i] = times[i] / bucket != times[i + 1] / bucket;
+  }
+  return keep;
+}
@@ -1,12 +1,27 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 
 #include "catch.hpp"
 #include <dptrp1/git.h>
+#include <dptrp1/linksnapshot.h>
+#include <dptrp1/dtree.h>
+#include <dptrp1/revdb.h>
+#include <dptrp1/dlisting.h>
+#include <dptrp1/json.h>
+#include <dptrp1/dptapi.h>
+#include <dptrp1/lrucache.h>
+#include <dptrp1/hostresolver.h>
+#include <dptrp1/cancellation.h>
+#include <dptrp1/dptrp1.h>
+#include <boost/property_tree/json_parser.hpp>
 #include <memory>
 #include <boost/filesystem.hpp>
 #include <git2.h>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <algorithm>
+#include <set>
 
 using namespace boost::filesystem;
 using namespace std;
@@ -320,3 +335,937 @@ TEST_CASE("create two directories each with a file") {
         REQUIRE_THAT(git->status(), Contains("staged") && Contains("new") && Contains(fpath2.string()) && Contains(dpath2.string()));
     }
 }
+
+TEST_CASE("find a committed blob") {
+    auto git = setup_git_repo();
+    abspath file = create_file_in(git->dir(), "version 1");
+    string const id = git->blobId(file);
+    git_oid oid;
+    SECTION("not committed") {
+        REQUIRE_FALSE(git->hasBlob(id, &oid));
+    }
+    SECTION("committed") {
+        git->addAll();
+        git->commit("version 1");
+        REQUIRE(git->hasBlob(id, &oid));
+        SECTION("extract blob") {
+            abspath dest = git->dir() / get_unique_str();
+            git->extractBlob(oid, dest);
+            std::ifstream inf(dest.string());
+            string content((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+            REQUIRE(content == "version 1");
+        }
+    }
+    SECTION("malformed id") {
+        REQUIRE_FALSE(git->hasBlob("version 1", &oid));
+    }
+}
+
+TEST_CASE("commit blobs to a branch") {
+    auto git = setup_git_repo();
+    repo_path fpath = to_repo_path(create_file_in(git->dir(), "local"), git->dir());
+    git->addAll();
+    git->commit("local");
+    string const content = "backup";
+    auto stream = git->blobStream();
+    stream->write(content.data(), 3);
+    stream->write(content.data() + 3, content.size() - 3);
+    git_oid oid = stream->commit();
+    git_oid same = git->writeBlob(content.data(), content.size());
+    REQUIRE(git_oid_equal(&oid, &same));
+    vector<pair<rpath,git_oid>> blobs;
+    blobs.push_back(make_pair(fpath, oid));
+    blobs.push_back(make_pair(path("dir") / "new", oid));
+    git_oid commit = git->commitBlobs("backup", "master", blobs, "backup");
+    SECTION("working tree is untouched") {
+        gptr<git_status_list> stats;
+        gptr<git_reference> head;
+        git->status(head, stats);
+        REQUIRE(string(git_reference_name(head)) == "refs/heads/master");
+        REQUIRE(git_status_list_entrycount(stats) == 0);
+        std::ifstream inf((git->dir() / fpath).string());
+        string local((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+        REQUIRE(local == "local");
+    }
+    SECTION("branch points to the new commit") {
+        git_oid branch = git->revparse("backup");
+        REQUIRE(git_oid_equal(&branch, &commit));
+        git->checkout("backup");
+        std::ifstream inf((git->dir() / "dir" / "new").string());
+        string backup((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+        REQUIRE(backup == "backup");
+    }
+}
+
+TEST_CASE("stage a precomputed blob") {
+    auto git = setup_git_repo();
+    string const content = "precomputed";
+    repo_path fpath = to_repo_path(create_file_in(git->dir(), content), git->dir());
+    vector<pair<rpath,git_oid>> blobs;
+    blobs.push_back(make_pair(fpath, git->writeBlob(content.data(), content.size())));
+    git->stage(blobs);
+    gptr<git_status_list> stats;
+    gptr<git_reference> head;
+    git->status(head, stats);
+    int n = git_status_list_entrycount(stats);
+    REQUIRE(n == 1);
+    for (int i = 0; i < n; i++) {
+        git_status_entry const* entry = git_status_byindex(stats, i);
+        REQUIRE_FALSE(entry->index_to_workdir);
+        REQUIRE(entry->head_to_index);
+    }
+    SECTION("git add all keeps it staged") {
+        git->addAll();
+        git->commit("precomputed");
+        gptr<git_status_list> stats;
+        gptr<git_reference> head;
+        git->status(head, stats);
+        REQUIRE(git_status_list_entrycount(stats) == 0);
+    }
+}
+
+TEST_CASE("report empty directories") {
+    auto git = setup_git_repo();
+    git->setScanEmptyDirs(false);
+    repo_path dpath1 = to_repo_path(create_directory_in(git->dir()), git->dir());
+    repo_path dpath2 = to_repo_path(create_directory_in(git->dir()), git->dir());
+    vector<rpath> dirs;
+    dirs.push_back(dpath1);
+    git->insertGitKeepFiles(dirs);
+    gptr<git_status_list> stats;
+    gptr<git_reference> head;
+    git->status(head, stats);
+    REQUIRE(git_status_list_entrycount(stats) == 1);
+    REQUIRE_THAT(git->status(), Contains(dpath1.string()) && !Contains(dpath2.string()));
+}
+
+TEST_CASE("checkpoint") {
+    auto git = setup_git_repo();
+    repo_path fpath1 = to_repo_path(create_file_in(git->dir(), "1"), git->dir());
+    repo_path dpath = to_repo_path(create_directory_in(git->dir()), git->dir());
+    repo_path fpath2 = to_repo_path(create_file_in(git->dir() / dpath, "2"), git->dir());
+    SECTION("all changes") {
+        string summary = git->checkpoint("checkpoint");
+        REQUIRE_THAT(summary, Contains("total changes: 2") && Contains("new: " + fpath1.string()) && Contains("new: " + fpath2.string()));
+        REQUIRE_FALSE(git->hasChanges());
+        REQUIRE(git->history(100).size() == 2);
+    }
+    SECTION("given paths") {
+        vector<rpath> paths;
+        paths.push_back(dpath);
+        string summary = git->checkpoint("checkpoint", paths);
+        REQUIRE_THAT(summary, Contains("total changes: 1") && Contains("new: " + fpath2.string()) && !Contains(fpath1.string()));
+        REQUIRE_THAT(git->status(), Contains(fpath1.string()) && !Contains(fpath2.string()));
+
+        SECTION("removed directory") {
+            remove_all(git->dir() / dpath);
+            string summary = git->checkpoint("checkpoint", paths);
+            REQUIRE_THAT(summary, Contains("deleted: " + fpath2.string()));
+            REQUIRE_THAT(git->status(), Contains(fpath1.string()) && !Contains(fpath2.string()));
+        }
+    }
+}
+
+TEST_CASE("checkpoint with known renames") {
+    auto git = setup_git_repo();
+    repo_path from = to_repo_path(create_file_in(git->dir(), "moved"), git->dir());
+    git->checkpoint("add");
+    repo_path to = path(get_unique_str());
+    rename(git->dir() / from, git->dir() / to);
+    SECTION("without hints") {
+        string summary = git->checkpoint("move");
+        REQUIRE_THAT(summary, Contains("total changes: 2") && Contains("deleted: " + from.string()) && Contains("new: " + to.string()));
+    }
+    SECTION("with hints") {
+        vector<pair<rpath,rpath>> renames;
+        renames.push_back(make_pair(from, to));
+        string summary = git->checkpoint("move", renames);
+        REQUIRE_THAT(summary, Contains("total changes: 1") && Contains("renamed: " + from.string() + " ~> " + to.string()));
+        REQUIRE_FALSE(git->hasChanges());
+    }
+}
+
+TEST_CASE("export a commit") {
+    auto git = setup_git_repo();
+    repo_path dpath = to_repo_path(create_directory_in(git->dir()), git->dir());
+    repo_path fpath1 = to_repo_path(create_file_in(git->dir(), "1"), git->dir());
+    repo_path fpath2 = to_repo_path(create_file_in(git->dir() / dpath, "2"), git->dir());
+    git->checkpoint("export");
+    create_file_in(git->dir(), "changed", fpath1.string());
+    abspath dest = test_root_path() / ("export_" + get_unique_str());
+    git->exportTree("master", dest);
+    auto read = [](abspath const& p) {
+        std::ifstream inf(p.string());
+        return string((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+    };
+    REQUIRE(read(dest / fpath1) == "1");
+    REQUIRE(read(dest / fpath2) == "2");
+    REQUIRE(read(git->dir() / fpath1) == "changed");
+    REQUIRE_THAT(git->status(), Contains("modified") && Contains(fpath1.string()));
+}
+
+TEST_CASE("file versions") {
+    auto git = setup_git_repo();
+    repo_path fpath = to_repo_path(create_file_in(git->dir(), "version 1"), git->dir());
+    git->checkpoint("version 1");
+    create_file_in(git->dir(), "version 2!", fpath.string());
+    git->checkpoint("version 2");
+    create_file_in(git->dir(), "other");
+    git->checkpoint("other file");
+    auto versions = git->versions(fpath);
+    REQUIRE(versions.size() == 2);
+    REQUIRE(versions[0].size == 10);
+    REQUIRE(versions[1].size == 9);
+    SECTION("restore a version") {
+        abspath dest = git->dir() / get_unique_str();
+        git->restoreVersion(versions[1], dest);
+        std::ifstream inf(dest.string());
+        string content((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+        REQUIRE(content == "version 1");
+    }
+}
+
+TEST_CASE("paginated history") {
+    auto git = setup_git_repo();
+    for (int i = 0; i < 4; i++) {
+        create_file_in(git->dir(), to_string(i));
+        git->checkpoint("commit " + to_string(i));
+    }
+    auto all = git->historyPage(100);
+    REQUIRE(all.size() == 5);
+    auto first = git->historyPage(2);
+    REQUIRE(first.size() == 2);
+    REQUIRE(first[0].commit == all[0].commit);
+    auto second = git->historyPage(2, first.back().commit);
+    REQUIRE(second.size() == 2);
+    REQUIRE(second[0].commit == all[2].commit);
+    auto last = git->historyPage(2, second.back().commit);
+    REQUIRE(last.size() == 1);
+    REQUIRE(last[0].commit == all[4].commit);
+}
+
+TEST_CASE("history cache of an older version index") {
+    auto git = setup_git_repo();
+    abspath const dir = git->dir();
+    for (int i = 0; i < 3; i++) {
+        create_file_in(dir, to_string(i));
+        git->checkpoint("commit " + to_string(i));
+    }
+    git.reset();
+    /* versions were indexed before there was a history cache */
+    sqlite3* db;
+    sqlite3_open((dir / ".git" / "dpt_versions").c_str(), &db);
+    sqlite3_exec(db, "DROP TABLE history; DROP TABLE IF EXISTS walked", nullptr, nullptr, nullptr);
+    sqlite3_close(db);
+    git = make_shared<Git>(dir);
+    create_file_in(dir, "3");
+    git->checkpoint("commit 3");
+    /* the new tip is cached, its ancestors are not yet */
+    REQUIRE(git->historyPage(100).size() == 5);
+}
+
+TEST_CASE("maintenance squashes expired checkpoints") {
+    auto git = setup_git_repo();
+    for (int i = 0; i < 4; i++) {
+        create_file_in(git->dir(), to_string(i));
+        git->checkpoint("commit " + to_string(i));
+    }
+    git->tag("dpt_old", git->revparse("master~2"));
+    /* a backup taken at the root, which is kept as is */
+    git_oid const backup = git->revparse("master~3");
+    git_oid const root_oid = git->revparse("master~4");
+    string const root = git_oid_tostr_s(&root_oid);
+    git->tag("dpt_keep", backup);
+    /* everything happened today, so a month later only the
+      root and the tip remain */
+    RetentionPolicy policy;
+    auto report = git->maintain(policy, time(nullptr) + 30 * 24 * 60 * 60);
+    REQUIRE(report.commits_before == 5);
+    REQUIRE(report.commits_after == 2);
+    REQUIRE(report.size_after > 0);
+    /* the root and the tip, plus the two backups hanging off them */
+    auto history = git->historyPage(100);
+    REQUIRE(history.size() == 4);
+    vector<string> messages;
+    for (auto const& record : history) {
+        messages.push_back(record.message);
+    }
+    REQUIRE(count(messages.begin(), messages.end(), "commit 3") == 1);
+    REQUIRE(count(messages.begin(), messages.end(), "commit 2") == 0);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(exists(git->dir() / to_string(i)));
+    }
+    REQUIRE(! git->hasChanges());
+    /* a backup taken at a squashed checkpoint moves to the one it
+      was squashed into */
+    REQUIRE(! exists(git->dir() / ".git/refs/tags/dpt_old"));
+    git_oid const tip = git->revparse("master");
+    string const tip_id = git_oid_tostr_s(&tip);
+    git_oid const moved = git->revparse("dpt_" + tip_id.substr(0,7) + "^{commit}^");
+    REQUIRE(git_oid_equal(&moved, &tip));
+    /* the annotated tag survives the repack */
+    git_oid const kept = git->revparse("dpt_" + root.substr(0,7) + "^{commit}");
+    REQUIRE(git_oid_equal(&kept, &backup));
+}
+
+TEST_CASE("link snapshots") {
+    abspath dir = test_root_path() / ("links_" + get_unique_str());
+    create_directories(dir);
+    LinkSnapshot snapshot(dir);
+    repo_path fpath1 = to_repo_path(create_file_in(dir, "1"), dir);
+    repo_path dpath = to_repo_path(create_directory_in(dir), dir);
+    repo_path fpath2 = to_repo_path(create_file_in(dir / dpath, "2"), dir);
+    string summary = snapshot.checkpoint("first");
+    REQUIRE_THAT(summary, Contains("total changes: 2") && Contains("new: " + fpath1.generic_string()));
+    create_file_in(dir, "changed", fpath1.string());
+    summary = snapshot.checkpoint("second");
+    REQUIRE_THAT(summary, Contains("total changes: 1") && Contains("modified: " + fpath1.generic_string()));
+    auto history = snapshot.historyPage(100);
+    REQUIRE(history.size() == 2);
+    REQUIRE_THAT(history[0].message, StartsWith("second"));
+    /* the unchanged file is shared between both snapshots */
+    REQUIRE(hard_link_count(dir / ".snapshots" / history[0].commit / "files" / fpath2) == 2);
+    auto versions = snapshot.versions(fpath1);
+    REQUIRE(versions.size() == 2);
+    REQUIRE(versions[1].size == 1);
+    SECTION("rollback") {
+        create_file_in(dir, "dirty", fpath1.string());
+        create_file_in(dir, "new");
+        remove(dir / fpath2);
+        snapshot.rollback();
+        REQUIRE_THAT(snapshot.checkpoint("third"), Contains("nothing new"));
+    }
+    SECTION("export") {
+        abspath dest = test_root_path() / ("export_" + get_unique_str());
+        snapshot.exportTree(history[1].commit, dest);
+        REQUIRE(file_size(dest / fpath1) == 1);
+        REQUIRE(exists(dest / fpath2));
+    }
+    SECTION("hidden files") {
+        create_file_in(dir, "state", ".rev");
+        create_file_in(dir, "noise", ".hidden");
+        snapshot.trackHidden(".rev");
+        /* scoped and full checkpoints agree on what is hidden */
+        REQUIRE_THAT(snapshot.checkpoint("scoped", vector<rpath>{".rev", ".hidden"}), Contains("total changes: 1"));
+        REQUIRE_THAT(snapshot.checkpoint("full"), Contains("nothing new"));
+        create_file_in(dir, "changed", ".rev");
+        snapshot.rollback();
+        std::ifstream inf((dir / ".rev").string());
+        string content((std::istreambuf_iterator<char>(inf)), std::istreambuf_iterator<char>());
+        REQUIRE(content == "state");
+    }
+    SECTION("maintenance") {
+        snapshot.checkpoint("third");
+        auto report = snapshot.maintain(RetentionPolicy(), time(nullptr) + 30 * 24 * 60 * 60);
+        REQUIRE(report.commits_before == 3);
+        REQUIRE(report.commits_after == 2);
+        REQUIRE(snapshot.historyPage(100).size() == 2);
+    }
+}
+
+TEST_CASE("arena allocated nodes") {
+    auto arena = make_shared<DArena>(256);
+    auto root = makeNode(arena);
+    root->setIsDir(true);
+    root->setPath("Document");
+    root->setRelPath("");
+    auto dir = makeNode(arena);
+    dir->setIsDir(true);
+    dir->setPath("Document/papers");
+    dir->setRelPath("papers");
+    root->addChild(dir);
+    for (int i = 0; i < 20; i++) {
+        auto file = makeNode(arena);
+        file->setPath("Document/papers/" + to_string(i) + ".pdf");
+        file->setRelPath("papers/" + to_string(i) + ".pdf");
+        dir->addChild(file);
+    }
+    REQUIRE(arena->bytesAllocated() > 0);
+    REQUIRE(root->relPath().empty());
+    REQUIRE(dir->children()[3]->relPath() == path("papers/3.pdf"));
+    REQUIRE(root->allFiles().size() == 20);
+    SECTION("md5 revisions round trip") {
+        string const md5 = "0123456789abcdef0123456789abcdef";
+        dir->setRev(md5);
+        REQUIRE(dir->rev() == md5);
+        REQUIRE(dir->hasRev(md5));
+        REQUIRE_FALSE(dir->hasRev("0123456789ABCDEF0123456789ABCDEF"));
+        dir->setRev(dpt::md5(md5.data(), md5.size()));
+        REQUIRE(dir->rev() == dpt::md5(md5.data(), md5.size()));
+        dir->setRev("folder");
+        REQUIRE(dir->rev() == "folder");
+        REQUIRE(dir->hasRev("folder"));
+        REQUIRE_FALSE(dir->hasRev(md5));
+    }
+    SECTION("relpath that is not a suffix") {
+        dir->setRelPath("renamed");
+        REQUIRE(dir->relPath() == path("renamed"));
+        dir->setRelPath("papers");
+        REQUIRE(dir->relPath() == path("papers"));
+    }
+    SECTION("relpath survives a new path") {
+        dir->setPath("Document/moved/papers");
+        REQUIRE(dir->relPath() == path("papers"));
+        dir->setRelPath("renamed");
+        dir->setPath("Document/renamed");
+        REQUIRE(dir->relPath() == path("renamed"));
+    }
+}
+
+TEST_CASE("symmetric diff") {
+    auto arena = make_shared<DArena>();
+    auto make_dir = [&](vector<string> const& names) {
+        auto dir = makeNode(arena);
+        dir->setIsDir(true);
+        for (auto const& name : names) {
+            auto file = makeNode(arena);
+            file->setFilename(name);
+            dir->addChild(file);
+        }
+        dir->sortChildren();
+        return dir;
+    };
+    auto a = make_dir({"d", "a", "c"});
+    auto b = make_dir({"b", "c", "e", "a"});
+    vector<shared_ptr<DNode>> only_a;
+    vector<shared_ptr<DNode>> only_b;
+    vector<pair<shared_ptr<DNode>,shared_ptr<DNode>>> both;
+    symmetricDiff(a->children(), b->children(), only_a, only_b, both);
+    REQUIRE(only_a.size() == 1);
+    REQUIRE(only_a[0]->filename() == "d");
+    REQUIRE(only_b.size() == 2);
+    REQUIRE(only_b[0]->filename() == "b");
+    REQUIRE(only_b[1]->filename() == "e");
+    REQUIRE(both.size() == 2);
+    REQUIRE(both[0].first->filename() == "a");
+    REQUIRE(both[1].second->filename() == "c");
+}
+
+TEST_CASE("symmetric diff of a wide folder", "[.][benchmark]") {
+    auto arena = make_shared<DArena>();
+    auto make_dir = [&](size_t first, size_t count) {
+        auto dir = makeNode(arena);
+        dir->setIsDir(true);
+        for (size_t i = first; i < first + count; i++) {
+            auto file = makeNode(arena);
+            file->setFilename("document " + to_string(i) + ".pdf");
+            dir->addChild(file);
+        }
+        dir->sortChildren();
+        return dir;
+    };
+    auto a = make_dir(0, 100000);
+    auto b = make_dir(1000, 100000);
+    vector<shared_ptr<DNode>> only_a;
+    vector<shared_ptr<DNode>> only_b;
+    vector<pair<shared_ptr<DNode>,shared_ptr<DNode>>> both;
+    BENCHMARK("hash join") {
+        /* what symmetricDiff used to do */
+        unordered_map<string,shared_ptr<DNode>> hash_a;
+        unordered_map<string,shared_ptr<DNode>> hash_b;
+        only_a.clear();
+        only_b.clear();
+        both.clear();
+        for (auto const& p : a->children()) {
+            hash_a[p->filename()] = p;
+        }
+        for (auto const& p : b->children()) {
+            hash_b[p->filename()] = p;
+            auto const i = hash_a.find(p->filename());
+            if (i != hash_a.end()) {
+                both.push_back(make_pair(i->second, p));
+            } else {
+                only_b.push_back(p);
+            }
+        }
+        for (auto const& p : a->children()) {
+            if (hash_b.find(p->filename()) == hash_b.end()) {
+                only_a.push_back(p);
+            }
+        }
+        return both.size();
+    };
+    BENCHMARK("merge join") {
+        symmetricDiff(a->children(), b->children(), only_a, only_b, both);
+        return both.size();
+    };
+    REQUIRE(both.size() == 99000);
+}
+
+TEST_CASE("sorted listings") {
+    REQUIRE(pathLess("a", "a/b"));
+    REQUIRE(pathLess("a/b", "a b"));
+    REQUIRE(pathLess("a/z", "ab"));
+    REQUIRE_FALSE(pathLess("b", "a/b"));
+    abspath spill_dir = test_root_path() / ("spill_" + get_unique_str());
+    create_directories(spill_dir);
+    vector<string> names;
+    for (int i = 0; i < 1000; i++) {
+        names.push_back("dir " + to_string(i % 7) + "/file " + to_string(i));
+        names.push_back("dir " + to_string(i % 7));
+    }
+    SECTION("in memory") {
+        DEntrySorter sorter(1 << 30, spill_dir);
+        for (auto const& name : names) {
+            DEntry entry;
+            entry.rel_path = name;
+            sorter.push(entry);
+        }
+        DEntry entry;
+        string last;
+        size_t count = 0;
+        while (sorter.next(&entry)) {
+            REQUIRE_FALSE(pathLess(entry.rel_path, last));
+            last = entry.rel_path;
+            count++;
+        }
+        REQUIRE(count == names.size());
+        REQUIRE(sorter.spills() == 0);
+    }
+    SECTION("spilled to disk") {
+        {
+            DEntrySorter sorter(4096, spill_dir);
+            for (auto const& name : names) {
+                DEntry entry;
+                entry.rel_path = name;
+                entry.rev = "rev of " + name;
+                entry.filesize = name.size();
+                entry.is_dir = name.find('/') == string::npos;
+                sorter.push(entry);
+            }
+            DEntry entry;
+            string last;
+            size_t count = 0;
+            while (sorter.next(&entry)) {
+                REQUIRE_FALSE(pathLess(entry.rel_path, last));
+                REQUIRE(entry.rev == "rev of " + entry.rel_path);
+                REQUIRE(entry.filesize == entry.rel_path.size());
+                REQUIRE(entry.is_dir == (entry.rel_path.find('/') == string::npos));
+                last = entry.rel_path;
+                count++;
+            }
+            REQUIRE(count == names.size());
+            REQUIRE(sorter.spills() > 1);
+        }
+        REQUIRE(directory_iterator(spill_dir) == directory_iterator());
+    }
+}
+
+namespace {
+    string listing_json(size_t count) {
+        ostringstream os;
+        os << "{\"count\":" << count << ",\"entry_list\":[";
+        for (size_t i = 0; i < count; i++) {
+            os
+                << (i ? "," : "")
+                << "{\"entry_path\":\"Document/folder " << i % 50
+                << "/document " << i << ".pdf\","
+                << "\"entry_id\":\"" << i << "-id\","
+                << "\"entry_name\":\"document " << i << ".pdf\","
+                << "\"entry_type\":\"document\","
+                << "\"file_size\":" << i * 1000 << ","
+                << "\"file_revision\":\"" << i << "-rev\","
+                << "\"document_type\":\"normal\"}";
+        }
+        os << "]}";
+        return os.str();
+    }
+}
+
+TEST_CASE("json") {
+    SECTION("reading") {
+        Json js = Json::fromString(
+            "{\"a\": {\"b\": \"x\\\"y\\u00e9\"}, \"n\": -12.5e1,"
+            " \"size\": 42, \"ok\": true, \"none\": null, \"list\": [1, 2, 3]}"
+        );
+        REQUIRE(js.get<string>("a.b") == "x\"y\xc3\xa9");
+        REQUIRE(js.get<float>("n") == -125.0f);
+        REQUIRE(js.get<size_t>("size") == 42);
+        REQUIRE(js.get<string>("size") == "42");
+        REQUIRE(js.get<bool>("ok"));
+        REQUIRE(js.get<size_t>("missing", 7) == 7);
+        REQUIRE(js.get<size_t>("a.b", 7) == 7);
+        REQUIRE(js.get_child("none").kind() == JsonKind::Null);
+        REQUIRE_THROWS(js.get<string>("missing"));
+        size_t sum = 0;
+        for (auto const& kv : js.get_child("list")) {
+            sum += kv.second.get<size_t>("");
+        }
+        REQUIRE(sum == 6);
+    }
+    SECTION("malformed") {
+        REQUIRE_THROWS(Json::fromString("{\"a\": }"));
+        REQUIRE_THROWS(Json::fromString("{\"a\": 1"));
+        REQUIRE_THROWS(Json::fromString("{\"a\": 1} x"));
+    }
+    SECTION("writing") {
+        Json inner;
+        inner.put("parent_folder_id", "root");
+        Json js;
+        js.put("name", "a \"b\"\n");
+        js.put("name", "c");
+        js.put("size", 3);
+        js.add_child("doc_copy_info", inner);
+        REQUIRE(js.toString()
+            == "{\"name\":\"c\",\"size\":3,"
+               "\"doc_copy_info\":{\"parent_folder_id\":\"root\"}}");
+        Json back = Json::fromString(js.toString());
+        REQUIRE(back.get<string>("doc_copy_info.parent_folder_id") == "root");
+        REQUIRE(Json().empty());
+    }
+    SECTION("streaming an array") {
+        auto body = make_shared<string>(listing_json(100));
+        size_t visited = 0;
+        size_t size_sum = 0;
+        Json rest = Json::forEachElement(
+            body, body->data(), body->size(), "entry_list",
+            [&](Json const& entry) {
+                REQUIRE(
+                    entry.get<string>("entry_id")
+                        == to_string(visited) + "-id"
+                );
+                size_sum += entry.get<size_t>("file_size");
+                visited++;
+            }
+        );
+        REQUIRE(visited == 100);
+        REQUIRE(size_sum == 1000 * 99 * 100 / 2);
+        REQUIRE(rest.get<size_t>("count") == 100);
+        REQUIRE(rest.get_child("entry_list").empty());
+    }
+}
+
+TEST_CASE("json of a large listing", "[.][benchmark]") {
+    string const body = listing_json(10000);
+    BENCHMARK("ptree") {
+        namespace pt = boost::property_tree;
+        istringstream iss(body);
+        pt::ptree tree;
+        pt::read_json(iss, tree);
+        size_t total = 0;
+        for (auto const& kv : tree.get_child("entry_list")) {
+            total += kv.second.get<size_t>("file_size");
+        }
+        return total;
+    };
+    BENCHMARK("json") {
+        Json js = Json::fromBytes(body.data(), body.size());
+        size_t total = 0;
+        for (auto const& kv : js.get_child("entry_list")) {
+            total += kv.second.get<size_t>("file_size");
+        }
+        return total;
+    };
+    BENCHMARK("json streaming") {
+        size_t total = 0;
+        Json::forEachElement(
+            nullptr, body.data(), body.size(), "entry_list",
+            [&total](Json const& entry) {
+                total += entry.get<size_t>("file_size");
+            }
+        );
+        return total;
+    };
+}
+
+TEST_CASE("typed device api") {
+    SECTION("reading a response") {
+        Json js = Json::fromString(
+            "{\"count\": 2, \"entry_list\": ["
+            "{\"entry_id\": \"a\", \"entry_path\": \"Document/a.pdf\","
+            " \"entry_type\": \"document\", \"file_size\": 123},"
+            "{\"entry_id\": \"b\", \"entry_path\": \"Document/b\","
+            " \"entry_type\": \"folder\", \"file_size\": null}"
+            "]}"
+        );
+        CommonEntryListObjectResult2 list;
+        readApi(js, &list);
+        REQUIRE(list.entry_list.size() == 2);
+        REQUIRE(list.entry_list[0].entry_path == "Document/a.pdf");
+        REQUIRE(list.entry_list[0].file_size == string("123"));
+        REQUIRE_FALSE(list.entry_list[1].file_size);
+    }
+    SECTION("writing a request") {
+        DocumentsDocumentIdPutRequest2 update;
+        update.file_name = "b.pdf";
+        REQUIRE(writeApi(update).toString() == "{\"file_name\":\"b.pdf\"}");
+        Documents2GetQuery query;
+        query.entry_type = "all";
+        query.fields = "entry_path,file_size";
+        REQUIRE(apiQuery(query) == "?entry_type=all&fields=entry_path%2Cfile_size");
+        REQUIRE(urlEncode("Document/a b.pdf") == "Document%2Fa%20b.pdf");
+    }
+}
+
+TEST_CASE("lru cache") {
+    LruCache<string,int> cache(2);
+    int value = 0;
+    cache.put("Document/a", 1);
+    cache.put("Document/b", 2);
+    REQUIRE(cache.get("Document/a", &value));
+    REQUIRE(value == 1);
+    /* b is now the least recently used */
+    cache.put("Document/c", 3);
+    REQUIRE(cache.size() == 2);
+    REQUIRE_FALSE(cache.get("Document/b", &value));
+    REQUIRE(cache.get("Document/c", &value));
+    REQUIRE(value == 3);
+    cache.eraseIf([](string const& p) { return p == "Document/a"; });
+    REQUIRE_FALSE(cache.get("Document/a", &value));
+    REQUIRE(cache.size() == 1);
+}
+
+TEST_CASE("content range") {
+    size_t filesize = 0;
+    REQUIRE(parseContentRange("bytes 0-131071/1048576", &filesize));
+    REQUIRE(filesize == 1048576);
+    REQUIRE(parseContentRange("bytes */0", &filesize));
+    REQUIRE(filesize == 0);
+    REQUIRE_FALSE(parseContentRange("bytes 0-99/*", &filesize));
+    REQUIRE_FALSE(parseContentRange("", &filesize));
+}
+
+TEST_CASE("host resolver", "[.][network]") {
+    HostResolver resolver(std::chrono::seconds(60));
+    boost::asio::ip::address addr;
+    REQUIRE_FALSE(resolver.cached("localhost", &addr));
+    REQUIRE(resolver.resolve("localhost", 8443, &addr));
+    REQUIRE(addr.is_loopback());
+    REQUIRE(resolver.cached("localhost", &addr));
+    resolver.invalidate("localhost");
+    REQUIRE_FALSE(resolver.cached("localhost", &addr));
+    REQUIRE_FALSE(resolver.resolve("no-such-device.invalid", 8443, &addr));
+    auto const devices = resolver.discover("localhost", 8443, 2);
+    REQUIRE(devices.size() == 1);
+    REQUIRE(devices[0].hostname == "localhost");
+    resolver.startRefresh("localhost", 8443);
+    resolver.stopRefresh();
+}
+
+TEST_CASE("host resolver refresh from several threads") {
+    HostResolver resolver(std::chrono::seconds(60));
+    vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&resolver, i] {
+            for (int j = 0; j < 20; j++) {
+                resolver.startRefresh("localhost", 8443 + (i + j) % 2);
+                if (j % 3 == 0) {
+                    resolver.stopRefresh();
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    resolver.stopRefresh();
+}
+
+TEST_CASE("cancellation token") {
+    CancellationToken token;
+    REQUIRE_FALSE(token.cancelled());
+    REQUIRE_NOTHROW(token.throwIfCancelled());
+    std::thread([&token] { token.cancel(); }).join();
+    REQUIRE(token.cancelled());
+    REQUIRE_THROWS_AS(token.throwIfCancelled(), SyncInterrupted);
+}
+
+namespace {
+    struct OperationDpt : Dpt {
+        using Dpt::OperationScope;
+    };
+}
+
+TEST_CASE("stop outside an operation") {
+    OperationDpt dpt;
+    auto const in_flight = dpt.cancellation();
+    dpt.stop();
+    /* what was in flight stops, later requests go through */
+    REQUIRE(in_flight->cancelled());
+    REQUIRE_NOTHROW(dpt.cancellation()->throwIfCancelled());
+    SECTION("stop during an operation") {
+        {
+            OperationDpt::OperationScope scope(dpt);
+            OperationDpt::OperationScope nested(dpt);
+            REQUIRE(nested.token() == scope.token());
+            dpt.stop();
+            REQUIRE(dpt.cancellation()->cancelled());
+            REQUIRE(scope.token()->cancelled());
+        }
+        REQUIRE_NOTHROW(dpt.cancellation()->throwIfCancelled());
+    }
+}
+
+namespace {
+    /* Lists entries given by the test instead of asking a device */
+    struct ListingDpt : Dpt {
+        vector<string> entries;
+
+        void forEachDptEntry(
+            std::function<void(Json const&)> const& visit
+        ) const override
+        {
+            for (auto const& entry : entries) {
+                visit(Json::fromString(entry));
+            }
+        }
+
+        void addEntry(string const& rel_path, string const& rev = "")
+        {
+            path const p = path("Document") / rel_path;
+            ostringstream os;
+            os
+                << "{\"entry_path\":\"" << p.generic_string() << "\","
+                << "\"entry_id\":\"" << rel_path << "-id\","
+                << "\"entry_name\":\"" << p.filename().string() << "\",";
+            if (rev.empty()) {
+                os << "\"entry_type\":\"folder\"}";
+            } else {
+                os
+                    << "\"entry_type\":\"document\","
+                    << "\"file_size\":1,"
+                    << "\"file_revision\":\"" << rev << "\","
+                    << "\"document_type\":\"normal\"}";
+            }
+            entries.push_back(os.str());
+        }
+
+        /* the plan as reported, one line per entry, in any order */
+        multiset<string> plan(bool streaming)
+        {
+            ostringstream log;
+            setLogger(log);
+            setDiffMemoryBudget(streaming ? 1 << 20 : 0);
+            dbOpen();
+            if (streaming) {
+                computeSyncFilesStreaming();
+            } else {
+                updateLocalTree();
+                updateDptTree();
+                computeSyncFiles();
+            }
+            reportComputedSyncFiles();
+            dbClose();
+            multiset<string> lines;
+            istringstream is(log.str());
+            for (string line; getline(is, line);) {
+                lines.insert(line);
+            }
+            return lines;
+        }
+
+        /* RevDB rows after recording both listings as synced */
+        vector<vector<string>> revs(bool streaming)
+        {
+            ostringstream log;
+            setLogger(log);
+            dbOpen();
+            if (streaming) {
+                updateRevDBStreaming();
+            } else {
+                updateLocalTree();
+                updateDptTree();
+                updateRevDB();
+            }
+            dbClose();
+            RevDB db;
+            db.open(syncDir() / ".rev");
+            auto cursor = db.sorted();
+            vector<vector<string>> rows;
+            for (vector<string> row; cursor->next(&row);) {
+                /* the tree walk also records the root folder */
+                if (! row[RelPath].empty()) {
+                    rows.push_back(row);
+                }
+            }
+            db.close();
+            return rows;
+        }
+    };
+}
+
+TEST_CASE("streaming sync plan") {
+    abspath const sync_dir = test_root_path() / ("sync_" + get_unique_str());
+    create_directories(sync_dir / ".app");
+    copy_file("rev_db", sync_dir / ".rev");
+    ListingDpt dpt;
+    dpt.setSyncDir(sync_dir);
+    /* "a/c.pdf" sorts before "a b.pdf" by path, not by string */
+    create_directory_in(sync_dir, "a");
+    create_file_in(sync_dir / "a", "c", "c.pdf");
+    create_file_in(sync_dir, "a b", "a b.pdf");
+    create_file_in(sync_dir, "same", "same.pdf");
+    dpt.addEntry("a");
+    dpt.addEntry("a/c.pdf", "c-rev");
+    dpt.addEntry("a b.pdf", "ab-rev");
+    dpt.addEntry("same.pdf", "same-rev");
+    SECTION("plan") {
+        create_file_in(sync_dir, "edited here", "edited.pdf");
+        create_directory_in(sync_dir, "new dir");
+        create_file_in(sync_dir / "new dir", "new", "x.pdf");
+        dpt.addEntry("edited.pdf", "edited-rev");
+        dpt.addEntry("gone.pdf", "gone-rev");
+        dpt.addEntry("dpt only");
+        dpt.addEntry("dpt only/y.pdf", "y-rev");
+        {
+            RevDB db;
+            db.open(sync_dir / ".rev");
+            db.putRev("a/c.pdf", dpt::md5(sync_dir / "a" / "c.pdf"), "c-rev");
+            db.putRev("a b.pdf", dpt::md5(sync_dir / "a b.pdf"), "ab-rev");
+            db.putRev("same.pdf", dpt::md5(sync_dir / "same.pdf"), "same-rev");
+            db.putRev("edited.pdf", dpt::md5("before", 6), "edited-rev");
+            db.putRev("gone.pdf", dpt::md5("gone", 4), "gone-rev");
+            db.close();
+        }
+        auto const streamed = dpt.plan(true);
+        REQUIRE(streamed == dpt.plan(false));
+        auto const mentions = [&streamed](string const& rel_path) {
+            return any_of(streamed.begin(), streamed.end(),
+                [&rel_path](string const& line) {
+                    return line.find("\"" + rel_path + "\"") != string::npos;
+                });
+        };
+        REQUIRE(mentions("edited.pdf"));
+        REQUIRE(mentions("gone.pdf"));
+        /* only the topmost node of a one-sided subtree */
+        REQUIRE(mentions("new dir"));
+        REQUIRE_FALSE(mentions("new dir/x.pdf"));
+        REQUIRE(mentions("dpt only"));
+        REQUIRE_FALSE(mentions("dpt only/y.pdf"));
+        REQUIRE_FALSE(mentions("same.pdf"));
+        REQUIRE_FALSE(mentions("a/c.pdf"));
+        REQUIRE_FALSE(mentions("a b.pdf"));
+    }
+    SECTION("rev db") {
+        auto const rows = dpt.revs(true);
+        REQUIRE(rows == dpt.revs(false));
+        vector<string> rel_paths;
+        for (auto const& row : rows) {
+            rel_paths.push_back(row[RelPath]);
+        }
+        REQUIRE(rel_paths
+            == vector<string>{"a", "a/c.pdf", "a b.pdf", "same.pdf"});
+        REQUIRE(rows[1][DptRev] == "c-rev");
+        REQUIRE(rows[1][LocalRev] == dpt::md5(sync_dir / "a" / "c.pdf"));
+        dpt.addEntry("dpt only.pdf", "rev");
+        REQUIRE_THROWS(dpt.revs(true));
+        REQUIRE_THROWS(dpt.revs(false));
+    }
+}
+
+TEST_CASE("listing snapshot") {
+    ListingSnapshot listing;
+    for (string p : {"a", "a/b.pdf", "a b.pdf", "c.pdf"}) {
+        DEntry entry;
+        entry.rel_path = p;
+        listing.entries.push_back(entry);
+    }
+    sort(listing.entries.begin(), listing.entries.end(),
+        [](DEntry const& a, DEntry const& b) {
+            return pathLess(a.rel_path, b.rel_path);
+        });
+    REQUIRE(listing.find("a/b.pdf"));
+    REQUIRE(listing.find("a b.pdf")->rel_path == "a b.pdf");
+    REQUIRE(listing.find("c.pdf"));
+    REQUIRE_FALSE(listing.find("b.pdf"));
+}
@@ -0,0 +1,453 @@
+#include <dptrp1/json.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <set>
+#include <map>
+#include <functional>
+#include <cctype>
+#include <vector>
+
+/* Reads endpoints.json (Swagger 2.0) and writes the typed device
+  API, dptapi.h and dptapi.cc. Definitions become structs with an
+  apiFields() table, each path and method becomes a method of DptApi
+  named like the definitions are, eg, documentsDocumentIdPut. */
+
+using namespace std;
+using dpt::Json;
+
+namespace {
+  struct Field {
+    string name;
+    string ident;
+    string type;
+  };
+
+  struct Struct {
+    string name;
+    vector<Field> fields;
+  };
+
+  struct Param {
+    string name;
+    string ident;
+    string type;
+    bool required;
+  };
+
+  struct Op {
+    string method;
+    string url;
+    string name;
+    vector<Param> path_params;
+    vector<Param> query_params;
+    bool has_file = false;
+    Param body;
+    bool has_body = false;
+    string result; /* struct, file or void */
+  };
+
+  bool isKeyword(string const& s)
+  {
+    static set<string> const keywords = {
+      "auto", "bool", "break", "case", "catch", "char", "class", "const",
+      "continue", "default", "delete", "do", "double", "else", "enum",
+      "explicit", "export", "extern", "false", "float", "for", "friend",
+      "goto", "if", "inline", "int", "long", "mutable", "namespace", "new",
+      "operator", "private", "protected", "public", "register", "return",
+      "short", "signed", "sizeof", "static", "struct", "switch", "template",
+      "this", "throw", "true", "try", "typedef", "typename", "union",
+      "unsigned", "using", "virtual", "void", "volatile", "while",
+    };
+    return keywords.count(s) != 0;
+  }
+
+  string identifier(string_view name)
+  {
+    string rtv;
+    for (char const c : name) {
+      rtv += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    }
+    if (rtv.empty() || isdigit(static_cast<unsigned char>(rtv[0]))) {
+      rtv = "_" + rtv;
+    }
+    if (isKeyword(rtv)) {
+      rtv += "_";
+    }
+    return rtv;
+  }
+
+  /* documents_document_id -> DocumentsDocumentId */
+  string camel(string_view name, bool upper_first)
+  {
+    string rtv;
+    bool upper = upper_first;
+    for (char const c : name) {
+      if (! isalnum(static_cast<unsigned char>(c))) {
+        upper = true;
+        continue;
+      }
+      rtv += upper ? toupper(c) : c;
+      upper = false;
+    }
+    return rtv;
+  }
+
+  string refName(string_view ref)
+  {
+    return camel(ref.substr(ref.rfind('/') + 1), true);
+  }
+
+  string cppType(Json const& schema)
+  {
+    if (Json const* ref = schema.findChild("$ref")) {
+      return refName(ref->data());
+    }
+    string const type = schema.get<string>("type", "string");
+    if (type == "integer") {
+      return "int64_t";
+    }
+    if (type == "number") {
+      return "double";
+    }
+    if (type == "boolean") {
+      return "bool";
+    }
+    if (type == "array") {
+      return "vector<" + cppType(schema.get_child("items")) + ">";
+    }
+    return "string";
+  }
+
+  set<string> requiredNames(Json const& schema)
+  {
+    set<string> rtv;
+    if (Json const* required = schema.findChild("required")) {
+      for (auto const& kv : *required) {
+        rtv.insert(string(kv.second.data()));
+      }
+    }
+    return rtv;
+  }
+
+  /* names of the structs a struct refers to */
+  void refsOf(Json const& schema, set<string>& refs)
+  {
+    if (Json const* ref = schema.findChild("$ref")) {
+      refs.insert(refName(ref->data()));
+    }
+    for (auto const& kv : schema) {
+      if (kv.second.kind() == dpt::JsonKind::Object) {
+        refsOf(kv.second, refs);
+      }
+    }
+  }
+
+  vector<Struct> readStructs(Json const& definitions)
+  {
+    map<string,Json const*> schemas;
+    for (auto const& kv : definitions) {
+      schemas[camel(kv.first, true)] = &kv.second;
+    }
+    /* a struct must come after the structs it holds */
+    vector<Struct> rtv;
+    set<string> done;
+    function<void(string const&)> visit = [&](string const& name) {
+      if (done.count(name) || ! schemas.count(name)) {
+        return;
+      }
+      done.insert(name);
+      Json const& schema = *schemas[name];
+      set<string> refs;
+      refsOf(schema, refs);
+      for (auto const& ref : refs) {
+        visit(ref);
+      }
+      Struct s;
+      s.name = name;
+      set<string> const required = requiredNames(schema);
+      if (Json const* properties = schema.findChild("properties")) {
+        for (auto const& kv : *properties) {
+          Field f;
+          f.name = string(kv.first);
+          f.ident = identifier(kv.first);
+          f.type = cppType(kv.second);
+          if (! required.count(f.name)) {
+            f.type = "optional<" + f.type + ">";
+          }
+          s.fields.push_back(f);
+        }
+      }
+      rtv.push_back(s);
+    };
+    /* in the order of endpoints.json where possible */
+    for (auto const& kv : definitions) {
+      visit(camel(kv.first, true));
+    }
+    return rtv;
+  }
+
+  vector<Op> readOps(Json const& paths, vector<Struct>& structs)
+  {
+    vector<Op> rtv;
+    for (auto const& p : paths) {
+      for (auto const& m : p.second) {
+        Op op;
+        for (char const c : m.first) {
+          op.method += toupper(c);
+        }
+        op.url = string(p.first);
+        op.name = camel(op.url, true) + camel(m.first, true);
+        op.name[0] = tolower(op.name[0]);
+        if (Json const* params = m.second.findChild("parameters")) {
+          for (auto const& kv : *params) {
+            Json const& param = kv.second;
+            Param pa;
+            pa.name = param.get<string>("name");
+            pa.ident = identifier(pa.name);
+            pa.required = param.get<bool>("required", false);
+            string const in = param.get<string>("in");
+            if (in == "path") {
+              pa.type = "string";
+              op.path_params.push_back(pa);
+            } else if (in == "query") {
+              pa.type = pa.required ? "string" : "optional<string>";
+              op.query_params.push_back(pa);
+            } else if (in == "formData") {
+              op.has_file = true;
+            } else if (in == "body") {
+              pa.type = cppType(param.get_child("schema"));
+              op.body = pa;
+              op.has_body = true;
+            }
+          }
+        }
+        op.result = "void";
+        for (auto const& kv : m.second.get_child("responses")) {
+          if (kv.first.empty() || kv.first[0] != '2') {
+            continue;
+          }
+          if (Json const* schema = kv.second.findChild("schema")) {
+            op.result =
+              schema->get<string>("type", "") == "file"
+                ? "file"
+                : cppType(*schema);
+          }
+          break;
+        }
+        if (! op.query_params.empty()) {
+          Struct q;
+          q.name = camel(op.name, true) + "Query";
+          for (auto const& pa : op.query_params) {
+            q.fields.push_back(Field{pa.name, pa.ident, pa.type});
+          }
+          structs.push_back(q);
+        }
+        rtv.push_back(op);
+      }
+    }
+    return rtv;
+  }
+
+  void writeStruct(ostream& out, Struct const& s)
+  {
+    out << "struct " << s.name << " {\n";
+    for (auto const& f : s.fields) {
+      out << "  " << f.type << " " << f.ident << ";\n";
+    }
+    out << "\n  static constexpr auto apiFields()\n  {\n";
+    out << "    return std::make_tuple(";
+    for (size_t i = 0; i < s.fields.size(); i++) {
+      out
+        << (i ? "," : "") << "\n      apiField(\""
+        << s.fields[i].name << "\", &" << s.name << "::"
+        << s.fields[i].ident << ")";
+    }
+    out << (s.fields.empty() ? "" : "\n    ") << ");\n  }\n};\n\n";
+  }
+
+  string resultType(Op const& op)
+  {
+    if (op.result == "file") {
+      return "shared_ptr<DptResponse>";
+    }
+    return op.result;
+  }
+
+  /* declared in the class with defaults, defined without */
+  string signature(Op const& op, bool defaults)
+  {
+    vector<string> args;
+    for (auto const& pa : op.path_params) {
+      args.push_back("string const& " + pa.ident);
+    }
+    if (op.has_file) {
+      args.push_back("vector<uint8_t> const& file");
+    }
+    if (op.has_body) {
+      if (op.body.required) {
+        args.push_back(op.body.type + " const& " + op.body.ident);
+      } else {
+        args.push_back(
+          "optional<" + op.body.type + "> const& " + op.body.ident
+            + (defaults ? " = std::nullopt" : "")
+        );
+      }
+    }
+    if (! op.query_params.empty()) {
+      args.push_back(
+        camel(op.name, true) + "Query const& query"
+          + (defaults ? " = {}" : "")
+      );
+    }
+    string const indent = defaults ? "  " : "";
+    string rtv = "(";
+    for (size_t i = 0; i < args.size(); i++) {
+      rtv += (i ? ",\n  " : "\n  ") + indent + args[i];
+    }
+    rtv += args.empty() ? ")" : "\n" + indent + ")";
+    return rtv;
+  }
+
+  /* string("/documents/") + urlEncode(document_id) + "/file" */
+  string urlExpression(Op const& op)
+  {
+    vector<string> pieces;
+    size_t pos = 0;
+    while (pos < op.url.size()) {
+      size_t const open = op.url.find('{', pos);
+      if (open != pos) {
+        string const literal = "\"" + op.url.substr(pos, open - pos) + "\"";
+        /* the first one makes it a string concatenation */
+        pieces.push_back(pieces.empty() ? "string(" + literal + ")" : literal);
+      }
+      if (open == string::npos) {
+        break;
+      }
+      size_t const close = op.url.find('}', open);
+      pieces.push_back(
+        "urlEncode(" + identifier(op.url.substr(open + 1, close - open - 1)) + ")"
+      );
+      pos = close + 1;
+    }
+    if (! op.query_params.empty()) {
+      pieces.push_back("apiQuery(query)");
+    }
+    string rtv;
+    for (auto const& piece : pieces) {
+      rtv += (rtv.empty() ? "" : " + ") + piece;
+    }
+    return rtv;
+  }
+
+  void writeMethod(ostream& out, Op const& op)
+  {
+    out
+      << resultType(op) << " DptApi::" << op.name
+      << signature(op, false) << " const\n{\n";
+    out << "  string const url = " << urlExpression(op) << ";\n";
+    string send;
+    if (op.has_file) {
+      send = "sendFile(\"" + op.method + "\", url, file)";
+    } else if (op.has_body && op.body.required) {
+      out << "  Json const body = writeApi(" << op.body.ident << ");\n";
+      send = "send(\"" + op.method + "\", url, &body)";
+    } else if (op.has_body) {
+      out
+        << "  Json body;\n"
+        << "  if (" << op.body.ident << ") {\n"
+        << "    body = writeApi(*" << op.body.ident << ");\n"
+        << "  }\n";
+      send =
+        "send(\"" + op.method + "\", url, " + op.body.ident
+          + " ? &body : nullptr)";
+    } else {
+      send = "send(\"" + op.method + "\", url)";
+    }
+    if (op.result == "void") {
+      out << "  " << send << ";\n";
+    } else if (op.result == "file") {
+      out << "  return " << send << ";\n";
+    } else {
+      out << "  return read<" << op.result << ">(" << send << ");\n";
+    }
+    out << "}\n\n";
+  }
+
+  void writeHeader(
+    ostream& out,
+    vector<Struct> const& structs,
+    vector<Op> const& ops
+  )
+  {
+    out
+      << "/* Generated by dpt-apigen from endpoints.json, do not edit */\n\n"
+      << "#ifndef dptapi_h\n#define dptapi_h\n\n"
+      << "#include <dptrp1/apifields.h>\n\n"
+      << "namespace dpt {\n\n";
+    for (auto const& s : structs) {
+      writeStruct(out, s);
+    }
+    out
+      << "/* One method per endpoint, throws on a non 2xx response */\n"
+      << "class DptApi : public ApiTransport {\n"
+      << "public:\n"
+      << "  using ApiTransport::ApiTransport;\n";
+    for (auto const& op : ops) {
+      out
+        << "\n  /* " << op.method << " " << op.url << " */\n"
+        << "  " << resultType(op) << " " << op.name
+        << signature(op, true) << " const;\n";
+    }
+    out << "};\n\n};\n\n#endif\n";
+  }
+
+  void writeSource(ostream& out, vector<Op> const& ops)
+  {
+    out
+      << "/* Generated by dpt-apigen from endpoints.json, do not edit */\n\n"
+      << "#include <dptrp1/dptapi.h>\n"
+      << "#include <dptrp1/dptrp1.h>\n\n"
+      << "using namespace std;\n"
+      << "using namespace dpt;\n\n";
+    for (auto const& op : ops) {
+      writeMethod(out, op);
+    }
+  }
+
+  void writeFile(char const* p, string const& content)
+  {
+    ofstream outf(p, ios_base::binary|ios_base::trunc);
+    outf << content;
+    if (! outf) {
+      throw "failed to write generated file";
+    }
+  }
+}
+
+int main(int argn, char** argv)
+{
+  if (argn != 4) {
+    cerr << "usage: dpt-apigen endpoints.json dptapi.h dptapi.cc" << endl;
+    return 2;
+  }
+  try {
+    ifstream inf(argv[1], ios_base::binary);
+    string const spec(
+      (istreambuf_iterator<char>(inf)),
+      istreambuf_iterator<char>()
+    );
+    Json const js = Json::fromString(spec);
+    vector<Struct> structs = readStructs(js.get_child("definitions"));
+    vector<Op> const ops = readOps(js.get_child("paths"), structs);
+    ostringstream header;
+    writeHeader(header, structs, ops);
+    ostringstream source;
+    writeSource(source, ops);
+    writeFile(argv[2], header.str());
+    writeFile(argv[3], source.str());
+  } catch (char const* e) {
+    cerr << "dpt-apigen: " << e << endl;
+    return 1;
+  }
+}